@@ -0,0 +1,1080 @@
+﻿// bench.cpp : reproducible benchmarks of the ve2 hot paths, written out as json to track regressions between versions
+//
+// bench [--media <file>...] [--media-cache <directory>] [--generate-media] [--filter <substring>] [--content <directory>] [--output <file>]
+//
+// without --media the benchmarks run against the synthetic clips of the test_media module, generated once into the media cache
+
+import utilities;
+import keyframes;
+import easing;
+import composition;
+import decoder;
+import video;
+import headless_context;
+import gui;
+import exporter;
+import test_media;
+import project;
+import keyframe_filters;
+import tracker;
+import stabilizer;
+
+#include "libav.h"
+#include "sdf_font.h"
+#include "allocation_tracking.h"
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <iostream>
+#include <fstream>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <numeric>
+#include <cmath>
+#include <cstring>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+using namespace std;
+using namespace glm;
+
+#define CHECK_SUCCESS(cmd, errormsg) if(!(cmd)) { cerr << errormsg << "\n"; return -1; }
+
+// every random input comes from this seed, so two runs measure the same work
+constexpr uint32_t bench_seed = 20201018;
+
+// the sizes of the key frame and composition lookups
+constexpr int lookup_sizes[] = { 10'000, 100'000 };
+constexpr int lookups_per_sample = 4096;
+
+// the batch key frame evaluation covers a two hour source with this many crop tracks
+constexpr int evaluate_duration_sec = 2 * 60 * 60;
+constexpr int evaluate_track_count = 4;
+constexpr int evaluate_samples = 20;
+
+// the simplification runs over a dense track with a key frame per frame, at 60fps
+constexpr int simplify_keyframe_count = 100'000;
+constexpr float simplify_tolerance_pixels = 1;
+constexpr ivec2 simplify_frame_size{ 1920, 1080 };
+constexpr int simplify_samples = 20;
+
+// the smoothing runs over an hour of a tracked track at 60fps
+constexpr int smooth_duration_sec = 60 * 60;
+constexpr int smooth_samples = 10;
+
+// the project load covers 100k key frames over 20 tracks
+constexpr int project_track_count = 20;
+constexpr int project_keyframes_per_track = 5'000;
+constexpr int project_samples = 20;
+constexpr int project_json_samples = 5;
+constexpr int journal_edits_per_sample = 100;
+
+constexpr int seek_count = 64;
+constexpr int torture_seeks_per_pattern = 1000;
+constexpr int torture_forward_step_max = 30;		// in frames
+constexpr int torture_backward_step_max = 15;
+constexpr chrono::seconds torture_seek_timeout{ 10 };
+constexpr int decode_runs = 3;
+constexpr int samples_per_benchmark = 200;
+constexpr int cold_glyph_count = 1000;
+constexpr int upload_frame_count = 120;
+constexpr ivec2 upload_frame_size{ 1920, 1080 };
+constexpr ivec2 export_rendition_size{ 1280, 720 };
+constexpr int allocation_warmup_frames = 30;
+constexpr int allocation_frames = 120;
+
+struct BenchmarkResult
+{
+	string name;
+	vector<pair<string, string>> parameters;
+	vector<double> samples_sec;						// the time of a single operation, one entry per measurement
+	vector<pair<string, double>> values;			// anything else worth tracking, like throughputs
+};
+
+vector<BenchmarkResult> results;
+string filter;
+bool checks_failed = false;						// set by the benchmarks that also assert something, fails the run
+
+bool selected(const string_view name) { return filter.empty() || name.find(filter) != string_view::npos; }
+
+// keeps the optimizer from dropping the measured work
+volatile double sink;
+
+template<typename TFunc>
+double time_sec(TFunc&& func)
+{
+	const auto start_time = chrono::steady_clock::now();
+	func();
+	return chrono::duration<double>(chrono::steady_clock::now() - start_time).count();
+}
+
+double percentile(vector<double> samples, const double fraction)
+{
+	if (samples.empty()) return 0;
+	const auto index = std::min(static_cast<size_t>(fraction * samples.size()), samples.size() - 1);
+	nth_element(samples.begin(), samples.begin() + index, samples.end());
+	return samples[index];
+}
+
+string json_escape(const string_view s)
+{
+	string escaped;
+	for (const auto c : s)
+		if (c == '"' || c == '\\') { escaped += '\\'; escaped += c; }
+		else if (static_cast<unsigned char>(c) < 0x20) escaped += ' ';
+		else escaped += c;
+	return escaped;
+}
+
+void write_json(ostream& output)
+{
+	output << "{\n\t\"schema\": 1,\n\t\"seed\": " << bench_seed << ",\n\t\"results\": [";
+
+	const char* separator = "\n";
+	for (const auto& result : results)
+	{
+		output << separator << "\t\t{ \"name\": \"" << json_escape(result.name) << "\", \"parameters\": {";
+		const char* parameter_separator = " ";
+		for (const auto& [key, value] : result.parameters)
+		{
+			output << parameter_separator << "\"" << json_escape(key) << "\": \"" << json_escape(value) << "\"";
+			parameter_separator = ", ";
+		}
+		output << " }";
+
+		if (!result.samples_sec.empty())
+		{
+			const auto& samples = result.samples_sec;
+			output << ", \"samples\": " << samples.size()
+				<< ", \"mean_ns\": " << accumulate(samples.begin(), samples.end(), 0.) / samples.size() * 1e9
+				<< ", \"min_ns\": " << *min_element(samples.begin(), samples.end()) * 1e9
+				<< ", \"p50_ns\": " << percentile(samples, .5) * 1e9
+				<< ", \"p95_ns\": " << percentile(samples, .95) * 1e9
+				<< ", \"p99_ns\": " << percentile(samples, .99) * 1e9
+				<< ", \"max_ns\": " << *max_element(samples.begin(), samples.end()) * 1e9;
+		}
+
+		for (const auto& [key, value] : result.values)
+			output << ", \"" << json_escape(key) << "\": " << value;
+
+		output << " }";
+		separator = ",\n";
+	}
+
+	output << "\n\t]\n}\n";
+}
+
+// full decodes, the frame rate is the median of the runs
+void bench_decode(const vector<string>& media_paths)
+{
+	for (const auto& path : media_paths)
+	{
+		BenchmarkResult result{ "decode_throughput" };
+		int64_t frames{};
+
+		for (int run = 0; run < decode_runs; ++run)
+		{
+			Decoder decoder(path.c_str());
+			frames = 0;
+			result.samples_sec.push_back(time_sec([&] { while (decoder.next_frame()) ++frames; }));
+
+			if (!run)
+			{
+				const auto size = decoder.frame_size();
+				result.parameters = {
+					{ "media", filesystem::path(path).filename().string() },
+					{ "codec", decoder.codec_context() ? avcodec_get_name(decoder.codec_context()->codec_id) : "y4m" },
+					{ "resolution", to_string(size.x) + "x" + to_string(size.y) } };
+			}
+		}
+
+		result.values = { { "frames", static_cast<double>(frames) }, { "fps", frames / percentile(result.samples_sec, .5) } };
+		results.push_back(move(result));
+	}
+}
+
+// seeks to random positions and decodes up to the target frame, like scrubbing the play bar does
+void bench_seek(const vector<string>& media_paths)
+{
+	for (const auto& path : media_paths)
+	{
+		Decoder decoder(path.c_str());
+		BenchmarkResult result{ "seek_to_first_frame", { { "media", filesystem::path(path).filename().string() } } };
+
+		mt19937 random(bench_seed);
+		uniform_int_distribution<int64_t> target_distribution(decoder.start_pts(), decoder.start_pts() + std::max<int64_t>(decoder.duration_pts() - 1, 0));
+		for (int seek = 0; seek < seek_count; ++seek)
+		{
+			const auto target_pts = target_distribution(random);
+			result.samples_sec.push_back(time_sec([&]
+				{
+					decoder.seek_pts(target_pts);
+					while (const auto frame = decoder.next_frame())
+						if (frame->best_effort_timestamp >= target_pts)
+							break;
+				}));
+		}
+
+		results.push_back(move(result));
+	}
+}
+
+enum class SeekPattern { Random, SequentialForward, ShortBackward, KeyFrameAligned };
+
+// every frame of a file in display order, and which of them are key frames
+struct FrameIndex
+{
+	vector<int64_t> pts;
+	vector<int64_t> key_frame_pts;
+};
+
+FrameIndex index_frames(const string& path)
+{
+	FrameIndex index;
+	Decoder decoder(path.c_str());
+	while (const auto frame = decoder.next_frame())
+	{
+		index.pts.push_back(frame->best_effort_timestamp);
+		if (frame->key_frame)
+			index.key_frame_pts.push_back(frame->best_effort_timestamp);
+	}
+
+	sort(index.pts.begin(), index.pts.end());
+	sort(index.key_frame_pts.begin(), index.key_frame_pts.end());
+	return index;
+}
+
+// the seek targets of a pattern, always pts of real frames so the player has an exact frame to land on
+vector<int64_t> seek_targets(const FrameIndex& index, const SeekPattern pattern, mt19937& random)
+{
+	vector<int64_t> targets;
+	const auto frame_count = static_cast<int64_t>(index.pts.size());
+	uniform_int_distribution<int64_t> frame_distribution(0, frame_count - 1);
+	uniform_int_distribution<int64_t> forward_distribution(1, torture_forward_step_max);
+	uniform_int_distribution<int64_t> backward_distribution(1, torture_backward_step_max);
+	int64_t current = frame_distribution(random);
+
+	for (int seek = 0; seek < torture_seeks_per_pattern; ++seek)
+	{
+		switch (pattern)
+		{
+		case SeekPattern::Random: current = frame_distribution(random); break;
+		case SeekPattern::SequentialForward: current = (current + forward_distribution(random)) % frame_count; break;
+		case SeekPattern::ShortBackward: current = ((current - backward_distribution(random)) % frame_count + frame_count) % frame_count; break;
+		case SeekPattern::KeyFrameAligned:
+		{
+			uniform_int_distribution<size_t> key_frame_distribution(0, index.key_frame_pts.size() - 1);
+			targets.push_back(index.key_frame_pts[key_frame_distribution(random)]);
+			continue;
+		}
+		}
+		targets.push_back(index.pts[current]);
+	}
+
+	return targets;
+}
+
+// drives the player's Video like the ui does, timing every seek until consume_frame hands out the target frame, and
+// checking that it is exactly the target and not whatever frame happened to be nearby
+void bench_seek_torture(const vector<string>& media_paths)
+{
+	constexpr pair<SeekPattern, const char*> patterns[] =
+	{
+		{ SeekPattern::Random, "random" }, { SeekPattern::SequentialForward, "sequential_forward" },
+		{ SeekPattern::ShortBackward, "short_backward" }, { SeekPattern::KeyFrameAligned, "key_frame_aligned" },
+	};
+
+	for (const auto& path : media_paths)
+	{
+		const auto index = index_frames(path);
+		if (index.pts.empty() || index.key_frame_pts.empty()) continue;
+
+		mutex frame_available_mutex;
+		condition_variable frame_available_cv;
+		uint64_t frames_available{};
+		Video video(path.c_str(), [&]
+			{
+				{
+					lock_guard lock(frame_available_mutex);
+					++frames_available;
+				}
+				frame_available_cv.notify_one();
+			});
+
+		mt19937 random(bench_seed);
+		for (const auto& [pattern, pattern_name] : patterns)
+		{
+			BenchmarkResult result{ "seek_torture", { { "media", filesystem::path(path).filename().string() }, { "pattern", pattern_name } } };
+			int wrong_frames{}, timeouts{};
+
+			for (const auto target_pts : seek_targets(index, pattern, random))
+			{
+				const auto start_time = chrono::steady_clock::now();
+				video.seek_pts(target_pts);
+
+				optional<int64_t> displayed_pts;
+				while (true)
+				{
+					uint64_t seen;
+					{
+						lock_guard lock(frame_available_mutex);
+						seen = frames_available;
+					}
+					if (video.consume_frame([&](const int64_t pts, int64_t, auto) { displayed_pts = pts; }))
+						break;
+
+					// nothing queued yet, sleep until the decoding thread queues something
+					unique_lock lock(frame_available_mutex);
+					if (!frame_available_cv.wait_until(lock, start_time + torture_seek_timeout, [&] { return frames_available != seen; }))
+						break;
+				}
+
+				if (!displayed_pts)
+					++timeouts;
+				else
+				{
+					result.samples_sec.push_back(chrono::duration<double>(chrono::steady_clock::now() - start_time).count());
+					if (*displayed_pts != target_pts)
+						++wrong_frames;
+				}
+			}
+
+			result.values = { { "seeks", static_cast<double>(torture_seeks_per_pattern) }, { "wrong_frames", static_cast<double>(wrong_frames) },
+				{ "timeouts", static_cast<double>(timeouts) } };
+			if (wrong_frames || timeouts)
+			{
+				cerr << filesystem::path(path).filename().string() << " " << pattern_name << ": " << wrong_frames << " wrong frames, "
+					<< timeouts << " timeouts\n";
+				checks_failed = true;
+			}
+			results.push_back(move(result));
+		}
+	}
+}
+
+// a single cpu rendition of a fixed crop, per clip
+void bench_export(const vector<string>& media_paths, const filesystem::path& output_directory)
+{
+	CropTrack crop_track{ "bench" };
+	crop_track.keyframes.add(0, { { .2f, .2f }, { .8f, .8f } });
+
+	for (const auto& path : media_paths)
+	{
+		const auto output_path = output_directory / (filesystem::path(path).stem().string() + "_export.mp4");
+		BenchmarkResult result{ "export_cpu", { { "media", filesystem::path(path).filename().string() },
+			{ "rendition", to_string(export_rendition_size.x) + "x" + to_string(export_rendition_size.y) } } };
+
+		Exporter exporter(path.c_str());
+		exporter.add_output({ &crop_track, { { output_path.string(), export_rendition_size } } });
+		int64_t frames{};
+		result.samples_sec.push_back(time_sec([&] { frames = exporter.run(); }));
+		filesystem::remove(output_path);
+
+		result.values = { { "frames", static_cast<double>(frames) }, { "fps", frames / result.samples_sec[0] } };
+		results.push_back(move(result));
+	}
+}
+
+// tracks a box in the middle of each clip from its first frame to its last, on the pixels and on the motion vectors, the
+// real time factor is against the clip's frame rate
+void bench_tracker(const vector<string>& media_paths)
+{
+	for (const auto& path : media_paths)
+	{
+		Decoder probe(path.c_str());
+		const auto size = probe.frame_size();
+		const auto frame_rate = av_q2d(probe.frame_rate());
+
+		for (const auto mode : { TrackerMode::Pixels, TrackerMode::MotionVectors })
+		{
+			BenchmarkResult result{ "tracker_throughput", { { "media", filesystem::path(path).filename().string() },
+				{ "resolution", to_string(size.x) + "x" + to_string(size.y) }, { "mode", mode == TrackerMode::Pixels ? "pixels" : "motion_vectors" } } };
+
+			mutex stopped_mutex;
+			condition_variable stopped_cv;
+			unique_ptr<Tracker> tracker;
+			TrackerState state{};
+
+			// the synthetic clips cut to an unrelated pattern every few seconds, which would end the tracking at the first cut
+			TrackerSettings settings;
+			settings.mode = mode;
+			settings.min_correlation = -1;
+
+			result.samples_sec.push_back(time_sec([&]
+				{
+					tracker = make_unique<Tracker>(path.c_str(), probe.start_pts(), box2{ { .4f, .4f }, { .6f, .6f } },
+						[&] { lock_guard lock(stopped_mutex); stopped_cv.notify_one(); }, settings);
+
+					unique_lock lock(stopped_mutex);
+					stopped_cv.wait(lock, [&] { return tracker->state() != TrackerState::Running; });
+					state = tracker->state();
+				}));
+			const auto frames = tracker->take_tracked().size();
+			if (state == TrackerState::Failed)
+				result.parameters.push_back({ "error", tracker->error() });
+			tracker.reset();
+
+			const auto fps = frames / result.samples_sec[0];
+			result.values = { { "frames", static_cast<double>(frames) }, { "fps", fps }, { "real_time_factor", frame_rate > 0 ? fps / frame_rate : 0 } };
+			results.push_back(move(result));
+		}
+	}
+}
+
+// the stabilization analysis of each clip, on every core
+void bench_stabilizer(const vector<string>& media_paths)
+{
+	for (const auto& path : media_paths)
+	{
+		Decoder probe(path.c_str());
+		const auto size = probe.frame_size();
+		BenchmarkResult result{ "stabilizer_throughput", { { "media", filesystem::path(path).filename().string() },
+			{ "resolution", to_string(size.x) + "x" + to_string(size.y) } } };
+
+		KeyFrames keyframes;
+		try
+		{
+			result.samples_sec.push_back(time_sec([&] { keyframes = stabilize(path.c_str()); }));
+		}
+		catch (const exception& e)
+		{
+			// the high bit depth clips aren't read
+			result.parameters.push_back({ "error", e.what() });
+			results.push_back(move(result));
+			continue;
+		}
+
+		const auto frames = distance(keyframes.begin(), keyframes.end());
+		result.values = { { "frames", static_cast<double>(frames) }, { "fps", frames / result.samples_sec[0] } };
+		results.push_back(move(result));
+	}
+}
+
+// one sample is the average over a batch of lookups, single lookups are too short for the clock
+template<typename TLookup>
+vector<double> sample_lookups(const vector<double>& lookup_positions, TLookup&& lookup)
+{
+	vector<double> samples;
+	for (int sample = 0; sample < samples_per_benchmark; ++sample)
+		samples.push_back(time_sec([&]
+			{
+				double sum{};
+				for (const auto position : lookup_positions)
+					sum += lookup(position);
+				sink = sum;
+			}) / lookup_positions.size());
+	return samples;
+}
+
+void bench_lookups()
+{
+	for (const auto size : lookup_sizes)
+	{
+		mt19937 random(bench_seed);
+
+		if (selected("keyframes_at") || selected("keyframes_at_playback"))
+		{
+			// a key frame every half a second of a 90kHz stream, the boxes slowly drifting around
+			constexpr int64_t keyframe_interval_pts = 45'000;
+			KeyFrames keyframes;
+			for (int index = 0; index < size; ++index)
+			{
+				const float offset = .2f * (index % 5) / 5.f;
+				keyframes.add(index * keyframe_interval_pts, { { offset, offset }, { offset + .5f, offset + .5f } });
+			}
+
+			if (selected("keyframes_at"))
+			{
+				uniform_int_distribution<int64_t> pts_distribution(0, size * keyframe_interval_pts - 1);
+				vector<double> positions(lookups_per_sample);
+				generate(positions.begin(), positions.end(), [&] { return static_cast<double>(pts_distribution(random)); });
+
+				results.push_back({ "keyframes_at", { { "keyframes", to_string(size) } },
+					sample_lookups(positions, [&](const double pts) { return static_cast<double>(keyframes.at(static_cast<int64_t>(pts)).v0.x); }) });
+			}
+
+			if (selected("keyframes_at_playback"))
+			{
+				// 60fps playback from a random spot, through the cursor like the player and the exporter
+				constexpr int64_t frame_duration_pts = 1'500;
+				uniform_int_distribution<int64_t> start_distribution(0, size * keyframe_interval_pts - lookups_per_sample * frame_duration_pts);
+				const auto start_pts = start_distribution(random);
+				vector<double> positions(lookups_per_sample);
+				for (int index = 0; index < lookups_per_sample; ++index)
+					positions[index] = static_cast<double>(start_pts + index * frame_duration_pts);
+
+				KeyFrameCursor cursor;
+				results.push_back({ "keyframes_at_playback", { { "keyframes", to_string(size) }, { "easing", "linear" } },
+					sample_lookups(positions, [&](const double pts) { return static_cast<double>(keyframes.at(static_cast<int64_t>(pts), cursor).v0.x); }) });
+
+				// the same with every key frame eased, which should only add the table lookup
+				for (const auto& [pts, keyframe] : keyframes)
+					keyframes.set_easing(pts, easing_preset(EasingType::EaseInOut));
+				results.push_back({ "keyframes_at_playback", { { "keyframes", to_string(size) }, { "easing", "ease_in_out" } },
+					sample_lookups(positions, [&](const double pts) { return static_cast<double>(keyframes.at(static_cast<int64_t>(pts), cursor).v0.x); }) });
+			}
+		}
+
+		if (selected("composition_lookup"))
+		{
+			// the parts are split in increasing order, so every split finds its part at the end
+			constexpr int64_t part_length_pts = 100;
+			Composition composition(size * part_length_pts);
+			for (int64_t index = 1; index < size; ++index)
+				composition.split(index * part_length_pts);
+
+			uniform_int_distribution<int64_t> pts_distribution(0, size * part_length_pts - 1);
+			vector<double> positions(lookups_per_sample);
+			generate(positions.begin(), positions.end(), [&] { return static_cast<double>(pts_distribution(random)); });
+
+			results.push_back({ "composition_lookup", { { "parts", to_string(size) } },
+				sample_lookups(positions, [&](const double pts) { return static_cast<double>(composition[static_cast<int64_t>(pts)]); }) });
+		}
+	}
+}
+
+// the boxes of every frame of a long source for every crop track, in one batch per track, checked against single lookups
+void bench_keyframes_evaluate()
+{
+	constexpr int64_t frame_duration_pts = 1'500, keyframe_interval_pts = 180'000;		// 60fps and a key frame every 2s at 90kHz
+	const auto frame_count = static_cast<size_t>(evaluate_duration_sec * 90'000 / frame_duration_pts);
+
+	mt19937 random(bench_seed);
+	uniform_real_distribution<float> offset_distribution(0, .4f);
+	vector<KeyFrames> tracks(evaluate_track_count);
+	for (auto& track : tracks)
+		for (int64_t pts = 0; pts < static_cast<int64_t>(frame_count) * frame_duration_pts; pts += keyframe_interval_pts)
+		{
+			const auto offset = offset_distribution(random);
+			track.add(pts, { { offset, offset }, { offset + .5f, offset + .5f } });
+			if (pts / keyframe_interval_pts % 2)
+				track.set_easing(pts, easing_preset(EasingType::EaseInOut));
+		}
+
+	vector<int64_t> pts(frame_count);
+	for (size_t index = 0; index < frame_count; ++index)
+		pts[index] = static_cast<int64_t>(index) * frame_duration_pts;
+
+	vector<CropBoxes> boxes(evaluate_track_count);
+	BenchmarkResult result{ "keyframes_evaluate", { { "frames", to_string(frame_count) }, { "tracks", to_string(evaluate_track_count) } } };
+	for (int sample = 0; sample < evaluate_samples; ++sample)
+		result.samples_sec.push_back(time_sec([&]
+			{
+				for (size_t track = 0; track < tracks.size(); ++track)
+					tracks[track].evaluate(pts, boxes[track]);
+			}));
+	results.push_back(move(result));
+
+	const auto differs = [](const vec2& a, const vec2& b) { return glm::any(glm::greaterThan(glm::abs(a - b), vec2(1e-6f))); };
+	size_t mismatches{};
+	for (size_t track = 0; track < tracks.size(); ++track)
+		for (size_t index = 0; index < frame_count; index += 97)
+		{
+			const auto expected = tracks[track].at(pts[index]), actual = boxes[track][index];
+			if (differs(expected.v0, actual.v0) || differs(expected.v1, actual.v1))
+				++mismatches;
+		}
+	if (mismatches)
+	{
+		cerr << "keyframes_evaluate: " << mismatches << " batch boxes differ from their single lookups\n";
+		checks_failed = true;
+	}
+}
+
+// a dense track like tracking leaves behind, a box drifting smoothly with a bit of jitter on every frame, reduced to the
+// fewest key frames within the tolerance, and checked that every dense box is still within it
+void bench_keyframes_simplify()
+{
+	constexpr int64_t frame_duration_pts = 1'500;
+
+	mt19937 random(bench_seed);
+	normal_distribution<float> jitter_distribution(0, .15f / simplify_frame_size.x);
+	uniform_real_distribution<float> velocity_distribution(-.002f, .002f);
+	KeyFrames dense;
+	vec2 position{ .25f, .25f }, velocity{};
+	for (int frame = 0; frame < simplify_keyframe_count; ++frame)
+	{
+		// the motion changes course every second or so
+		if (frame % 60 == 0) velocity = { velocity_distribution(random), velocity_distribution(random) };
+		position = glm::clamp(position + velocity, vec2(0), vec2(.5f));
+		const vec2 jitter{ jitter_distribution(random), jitter_distribution(random) };
+		dense.append(frame * frame_duration_pts, { { position + jitter, position + jitter + vec2(.5f) } });
+	}
+
+	for (const auto use_easing : { false, true })
+	{
+		KeyFrames simplified;
+		BenchmarkResult result{ "keyframes_simplify", { { "keyframes", to_string(simplify_keyframe_count) }, { "easing", use_easing ? "true" : "false" } } };
+		for (int sample = 0; sample < simplify_samples; ++sample)
+			result.samples_sec.push_back(time_sec([&] { simplified = simplify_keyframes(dense, simplify_frame_size, { simplify_tolerance_pixels, use_easing }); }));
+
+		float max_error{};
+		for (const auto& [pts, keyframe] : dense)
+		{
+			const auto box = simplified.at(pts);
+			const auto error0 = glm::abs(box.v0 - keyframe.box.v0) * vec2(simplify_frame_size);
+			const auto error1 = glm::abs(box.v1 - keyframe.box.v1) * vec2(simplify_frame_size);
+			max_error = std::max({ max_error, error0.x, error0.y, error1.x, error1.y });
+		}
+		const auto kept = distance(simplified.begin(), simplified.end());
+		result.values.push_back({ "kept_keyframes", static_cast<double>(kept) });
+		result.values.push_back({ "max_error_pixels", static_cast<double>(max_error) });
+		results.push_back(move(result));
+
+		// a little slack for the rounding of the interpolation
+		if (max_error > simplify_tolerance_pixels + 1e-3f)
+		{
+			cerr << "keyframes_simplify: the simplified track strays " << max_error << " pixels from the dense one\n";
+			checks_failed = true;
+		}
+	}
+}
+
+// a jittery box following a smooth path, a key frame per frame like tracking leaves behind, smoothed back, and checked that
+// the path stays in the frame and within the margin of the boxes
+void bench_keyframes_smooth()
+{
+	constexpr int64_t frame_duration_pts = 1'500;
+	constexpr double time_base = 1. / 90'000;
+	const auto frame_count = smooth_duration_sec * 60;
+
+	mt19937 random(bench_seed);
+	normal_distribution<float> jitter_distribution(0, .003f);
+	KeyFrames jittery;
+	for (int frame = 0; frame < frame_count; ++frame)
+	{
+		const auto sec = frame / 60.f;
+		const vec2 center{ .5f + .25f * sin(sec * .3f), .5f + .2f * sin(sec * .17f + 1) };
+		const vec2 jitter{ jitter_distribution(random), jitter_distribution(random) };
+		jittery.append(frame * frame_duration_pts, { { center + jitter - vec2(.15f), center + jitter + vec2(.15f) } });
+	}
+
+	const SmoothSettings settings;
+	KeyFrames smoothed;
+	BenchmarkResult result{ "keyframes_smooth", { { "keyframes", to_string(frame_count) } } };
+	for (int sample = 0; sample < smooth_samples; ++sample)
+		result.samples_sec.push_back(time_sec([&] { smoothed = smooth_keyframes(jittery, time_base, settings); }));
+
+	// the jitter as the mean change of speed between frames, in frame widths
+	const auto jitter = [](const KeyFrames& keyframes)
+	{
+		double sum{};
+		size_t count{};
+		vec2 previous_center{}, previous_speed{};
+		for (const auto& [pts, keyframe] : keyframes)
+		{
+			const auto center = (keyframe.box.v0 + keyframe.box.v1) * .5f;
+			const auto speed = center - previous_center;
+			if (count > 1) sum += glm::length(speed - previous_speed);
+			previous_center = center;
+			previous_speed = speed;
+			++count;
+		}
+		return count > 2 ? sum / (count - 2) : 0;
+	};
+	result.values = { { "jitter_before", jitter(jittery) }, { "jitter_after", jitter(smoothed) } };
+	results.push_back(move(result));
+
+	size_t violations{};
+	for (auto original = jittery.begin(), path = smoothed.begin(); original != jittery.end() && path != smoothed.end(); ++original, ++path)
+	{
+		const auto& box = path->second.box;
+		const auto offset = glm::abs((box.v0 + box.v1) * .5f - (original->second.box.v0 + original->second.box.v1) * .5f);
+		const auto margin = original->second.box.size() * settings.margin + 1e-5f;
+		if (any(lessThan(box.v0, vec2(-1e-5f))) || any(greaterThan(box.v1, vec2(1 + 1e-5f))) || any(greaterThan(offset, margin)))
+			++violations;
+	}
+	if (violations || distance(smoothed.begin(), smoothed.end()) != frame_count)
+	{
+		cerr << "keyframes_smooth: " << violations << " boxes leave the frame or the margin\n";
+		checks_failed = true;
+	}
+}
+
+// loads a large project from both formats, and checks that it comes back as it was saved
+void bench_project(const filesystem::path& output_directory)
+{
+	mt19937 random(bench_seed);
+	uniform_real_distribution<float> offset_distribution(0, .4f);
+	uniform_int_distribution<int64_t> interval_distribution(1, 90'000);
+
+	Project project;
+	for (int track_index = 0; track_index < project_track_count; ++track_index)
+	{
+		auto& track = project.crop_tracks.emplace_back(CropTrack{ "track" + to_string(track_index) });
+		int64_t pts{};
+		for (int index = 0; index < project_keyframes_per_track; ++index, pts += interval_distribution(random))
+		{
+			const auto offset = offset_distribution(random);
+			track.keyframes.add(pts, { { offset, offset }, { offset + .5f, offset + .5f } });
+			if (index % 3 == 1)
+				track.keyframes.set_easing(pts, easing_preset(EasingType::EaseInOut));
+			else if (index % 3 == 2)
+				track.keyframes.set_easing(pts, easing_custom({ .3f, -.2f }, { .7f, 1.2f }));
+		}
+	}
+	project.composition = make_unique<Composition>(int64_t{ 1'000'000'000 });
+	for (int64_t pts = 1'000'000; pts < 1'000'000'000; pts += 10'000'000)
+		project.composition->erase(pts, pts + 500'000);
+
+	const auto binary_path = output_directory / "ve2_bench_project.ve2p";
+	const auto json_path = output_directory / "ve2_bench_project.json";
+	save_project(project, binary_path);
+	ofstream(json_path, ios::binary) << project_json(project);
+
+	const auto keyframes_parameter = to_string(project_track_count * project_keyframes_per_track);
+	const auto bench_load = [&](const char* name, const filesystem::path& path, const int samples)
+	{
+		BenchmarkResult result{ name, { { "keyframes", keyframes_parameter }, { "bytes", to_string(filesystem::file_size(path)) } } };
+		Project loaded;
+		for (int sample = 0; sample < samples; ++sample)
+			result.samples_sec.push_back(time_sec([&] { loaded = load_project(path); }));
+		results.push_back(move(result));
+		return loaded;
+	};
+
+	if (selected("project_view_open"))
+	{
+		BenchmarkResult result{ "project_view_open", { { "keyframes", keyframes_parameter } } };
+		for (int sample = 0; sample < project_samples; ++sample)
+			result.samples_sec.push_back(time_sec([&] { const ProjectView view(binary_path.string().c_str()); sink = static_cast<double>(view.tracks().size()); }));
+		results.push_back(move(result));
+	}
+
+	// the binary format quantizes the boxes to 16 bits, the json one keeps them exactly
+	const auto check = [&](const char* name, const Project& loaded, const float tolerance)
+	{
+		auto matches = loaded.crop_tracks.size() == project.crop_tracks.size() && loaded.composition
+			&& equal(loaded.composition->begin(), loaded.composition->end(), project.composition->begin(), project.composition->end(),
+				[](const Part& a, const Part& b) { return a.from_pts == b.from_pts && a.to_pts == b.to_pts; });
+		for (size_t track = 0; matches && track < project.crop_tracks.size(); ++track)
+		{
+			const auto& expected = project.crop_tracks[track], & actual = loaded.crop_tracks[track];
+			matches = expected.name == actual.name && equal(expected.keyframes.begin(), expected.keyframes.end(), actual.keyframes.begin(), actual.keyframes.end(),
+				[&](const auto& a, const auto& b)
+				{
+					return a.first == b.first && a.second.easing.spec() == b.second.easing.spec()
+						&& !glm::any(glm::greaterThan(glm::abs(a.second.box.v0 - b.second.box.v0), vec2(tolerance)))
+						&& !glm::any(glm::greaterThan(glm::abs(a.second.box.v1 - b.second.box.v1), vec2(tolerance)));
+				});
+		}
+		if (!matches)
+		{
+			cerr << name << ": the loaded project differs from the saved one\n";
+			checks_failed = true;
+		}
+	};
+
+	if (selected("project_load_binary"))
+		check("project_load_binary", bench_load("project_load_binary", binary_path, project_samples), .5f / 65535 + 1e-6f);
+	if (selected("project_load_json"))
+		check("project_load_json", bench_load("project_load_json", json_path, project_json_samples), 0);
+
+	if (selected("project_journal_append"))
+	{
+		// an edit only queues a record, whatever the size of the project, the journal's thread does the writing
+		const auto journal_path = output_directory / "ve2_bench_journal.ve2p";
+		BenchmarkResult result{ "project_journal_append", { { "keyframes", keyframes_parameter } } };
+		{
+			ProjectJournal journal(journal_path, project);
+			for (int sample = 0; sample < samples_per_benchmark; ++sample)
+				result.samples_sec.push_back(time_sec([&]
+					{
+						for (int edit = 0; edit < journal_edits_per_sample; ++edit)
+						{
+							const auto track = static_cast<uint32_t>(edit % project_track_count);
+							const auto pts = -1 - static_cast<int64_t>(sample) * journal_edits_per_sample - edit;
+							const box2 box{ { .1f, .1f }, { .6f, .6f } };
+							project.crop_tracks[track].keyframes.add(pts, box);
+							journal.add_keyframe(track, pts, box);
+						}
+					}) / journal_edits_per_sample);
+			journal.flush();
+		}
+		results.push_back(move(result));
+
+		check("project_journal_append", load_project(journal_path), .5f / 65535 + 1e-6f);
+		filesystem::remove(journal_path);
+	}
+
+	filesystem::remove(binary_path);
+	filesystem::remove(json_path);
+}
+
+// cold glyphs go through RenderSDF and the atlas upload, warm ones are only cache lookups
+void bench_font(const vector<const char*>& font_paths)
+{
+	if (selected("font_glyph_cold"))
+	{
+		Font font(font_paths, 64);
+		BenchmarkResult result{ "font_glyph_cold", { { "render_size", "64" } } };
+
+		// hangul syllables, so every glyph is new to the cache
+		for (char32_t c = 0xac00; c < 0xac00 + cold_glyph_count; ++c)
+		{
+			const u8string utf8{ static_cast<char8_t>(0xe0 | (c >> 12)), static_cast<char8_t>(0x80 | ((c >> 6) & 0x3f)), static_cast<char8_t>(0x80 | (c & 0x3f)) };
+			result.samples_sec.push_back(time_sec([&] { sink = static_cast<double>(font.get_glyph_data(utf8).size()); }));
+		}
+		results.push_back(move(result));
+	}
+
+	if (selected("font_glyph_warm"))
+	{
+		Font font(font_paths, 64);
+		const u8string text = u8"0:00:00.000 / 1:23:45 The quick brown fox jumps over the lazy dog";
+		font.get_glyph_data(text);
+
+		BenchmarkResult result{ "font_glyph_warm", { { "characters", to_string(text.size()) } } };
+		for (int sample = 0; sample < samples_per_benchmark; ++sample)
+			result.samples_sec.push_back(time_sec([&] { sink = static_cast<double>(font.get_glyph_data(text).size()); }) / text.size());
+		results.push_back(move(result));
+	}
+}
+
+// a frame of the editor gui: the play bar, the time label and a column of labels like the metrics overlay
+void build_gui_frame(const int frame)
+{
+	gui_slider(box2::from_corner_size({ 30, 7 }, { 1500, 15 }), 0, 1000, frame % 1000, [](double) {});
+	gui_button(box2::from_corner_size({}, { 30, 30 }), u8"▶", [] {}, .2f);
+
+	static u8string time_label;
+	time_label.clear();
+	u8_append_seconds_to_time_string(time_label, frame / 30.);
+	time_label += u8" / 1:23:45";
+	gui_label(box2::from_corner_size({ 1600, 0 }, { 100, 30 }), time_label, .2f);
+
+	for (int line = 0; line < 20; ++line)
+		gui_label(box2::from_corner_size({ 0, 30.f + line * 16 }, { 600, 16 }), u8"render.texture_upload: p50 0.42ms p99 1.37ms max 2.05ms", .2f);
+}
+
+// steady playback like the player's render loop: take the next decoded frame and build and render the gui, which must
+// not allocate at all once warmed up, any frame that does fails the run
+void bench_frame_allocations(const string& media_path)
+{
+	Video video(media_path.c_str());
+	video.play(true);
+
+	BenchmarkResult result{ "frame_allocations", { { "media", filesystem::path(media_path).filename().string() } } };
+	uint64_t total_allocations{}, max_allocations{};
+	int frames{};
+
+	for (int frame = 0; frame < allocation_warmup_frames + allocation_frames; ++frame)
+	{
+		const auto start_allocations = thread_allocation_count();
+
+		// the decoding thread may still be catching up, the wait itself doesn't allocate
+		const auto deadline = chrono::steady_clock::now() + chrono::seconds(1);
+		bool consumed;
+		while (!(consumed = video.consume_frame([&](int64_t, int64_t, const array<span<const uint8_t>, 3>& planes) { sink = planes[0][0]; }))
+			&& chrono::steady_clock::now() < deadline)
+			this_thread::yield();
+		if (!consumed) break;
+
+		build_gui_frame(frame);
+		gui_render();
+
+		if (frame >= allocation_warmup_frames)
+		{
+			const auto allocations = thread_allocation_count() - start_allocations;
+			total_allocations += allocations;
+			max_allocations = std::max(max_allocations, allocations);
+			++frames;
+		}
+	}
+
+	result.values = { { "frames", static_cast<double>(frames) }, { "allocations", static_cast<double>(total_allocations) },
+		{ "max_allocations_per_frame", static_cast<double>(max_allocations) } };
+	results.push_back(move(result));
+
+	if (!allocation_tracking_enabled)
+		cerr << "frame_allocations: built without VE2_TRACK_ALLOCATIONS, nothing was counted\n";
+	else if (total_allocations)
+	{
+		cerr << "frame_allocations: " << total_allocations << " heap allocations over " << frames << " steady state frames, expected none\n";
+		checks_failed = true;
+	}
+}
+
+void bench_gui(const vector<const char*>& font_paths, const vector<string>& media_paths)
+{
+	gui_init(nullptr, make_unique<Font>(font_paths, 64));
+
+	// warm up the glyph cache
+	build_gui_frame(0);
+	gui_render();
+
+	if (selected("gui_build"))
+	{
+		BenchmarkResult result{ "gui_build", { { "labels", "22" } } };
+		for (int sample = 0; sample < samples_per_benchmark; ++sample)
+		{
+			result.samples_sec.push_back(time_sec([&] { build_gui_frame(sample); }));
+			gui_render();
+		}
+		results.push_back(move(result));
+	}
+
+	// an unchanged frame only hashes the vertices, a changed one also uploads them
+	if (selected("gui_render"))
+	{
+		for (const auto changing : { false, true })
+		{
+			BenchmarkResult result{ "gui_render", { { "vertices", changing ? "changing" : "unchanged" } } };
+			for (int sample = 0; sample < samples_per_benchmark; ++sample)
+			{
+				build_gui_frame(changing ? sample : 0);
+				result.samples_sec.push_back(time_sec([&] { gui_render(); glFinish(); }));
+			}
+			results.push_back(move(result));
+		}
+	}
+
+	if (selected("frame_allocations") && !media_paths.empty())
+		bench_frame_allocations(media_paths.front());
+}
+
+// uploads a 1080p yuv 4:2:0 frame like the player does, straight from client memory or through a pixel buffer object
+void bench_upload()
+{
+	const ivec2 plane_sizes[] = { upload_frame_size, upload_frame_size / 2, upload_frame_size / 2 };
+	GLuint textures[3];
+	glCreateTextures(GL_TEXTURE_2D, 3, textures);
+	for (int plane = 0; plane < 3; ++plane)
+		glTextureStorage2D(textures[plane], 1, GL_R8, plane_sizes[plane].x, plane_sizes[plane].y);
+
+	mt19937 random(bench_seed);
+	vector<uint8_t> frame(upload_frame_size.x * upload_frame_size.y * 3 / 2);
+	generate(frame.begin(), frame.end(), [&] { return static_cast<uint8_t>(random()); });
+	const size_t plane_offsets[] = { 0, static_cast<size_t>(upload_frame_size.x * upload_frame_size.y), static_cast<size_t>(upload_frame_size.x * upload_frame_size.y * 5 / 4) };
+
+	GLuint pbo;
+	glCreateBuffers(1, &pbo);
+
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	for (const auto use_pbo : { false, true })
+	{
+		const auto name = use_pbo ? "yuv_upload_pbo" : "yuv_upload_direct";
+		if (!selected(name)) continue;
+
+		BenchmarkResult result{ name, { { "resolution", to_string(upload_frame_size.x) + "x" + to_string(upload_frame_size.y) } } };
+		for (int sample = 0; sample < upload_frame_count; ++sample)
+			result.samples_sec.push_back(time_sec([&]
+				{
+					if (use_pbo)
+					{
+						// orphan the previous storage so the copy never waits on the gpu still reading it
+						glNamedBufferData(pbo, frame.size(), nullptr, GL_STREAM_DRAW);
+						const auto mapped = glMapNamedBufferRange(pbo, 0, frame.size(), GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+						memcpy(mapped, frame.data(), frame.size());
+						glUnmapNamedBuffer(pbo);
+
+						glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+						for (int plane = 0; plane < 3; ++plane)
+							glTextureSubImage2D(textures[plane], 0, 0, 0, plane_sizes[plane].x, plane_sizes[plane].y, GL_RED, GL_UNSIGNED_BYTE,
+								reinterpret_cast<const void*>(plane_offsets[plane]));
+						glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+					}
+					else
+						for (int plane = 0; plane < 3; ++plane)
+							glTextureSubImage2D(textures[plane], 0, 0, 0, plane_sizes[plane].x, plane_sizes[plane].y, GL_RED, GL_UNSIGNED_BYTE,
+								frame.data() + plane_offsets[plane]);
+
+					// the upload isn't done until the driver is
+					glFinish();
+				}));
+
+		result.values = { { "mb_per_sec", frame.size() / percentile(result.samples_sec, .5) / (1 << 20) } };
+		results.push_back(move(result));
+	}
+
+	glDeleteBuffers(1, &pbo);
+	glDeleteTextures(3, textures);
+}
+
+int main(int argc, const char* argv[])
+{
+	vector<string> media_paths;
+	filesystem::path content_directory = "content";
+	filesystem::path media_cache_directory = filesystem::temp_directory_path() / "ve2_bench_media";
+	bool generate_media_only{};
+	const char* output_path{};
+
+	for (int index = 1; index < argc; ++index)
+	{
+		const string_view argument = argv[index];
+		if (argument == "--media")
+			while (index + 1 < argc && argv[index + 1][0] != '-')
+				media_paths.push_back(argv[++index]);
+		else if (argument == "--media-cache" && index + 1 < argc)
+			media_cache_directory = argv[++index];
+		else if (argument == "--generate-media")
+			generate_media_only = true;
+		else if (argument == "--filter" && index + 1 < argc)
+			filter = argv[++index];
+		else if (argument == "--content" && index + 1 < argc)
+			content_directory = argv[++index];
+		else if (argument == "--output" && index + 1 < argc)
+			output_path = argv[++index];
+		else
+		{
+			cerr << "usage: bench [--media <file>...] [--media-cache <directory>] [--generate-media] [--filter <substring>] [--content <directory>] [--output <file>]\n";
+			return -1;
+		}
+	}
+
+	av_log_set_level(AV_LOG_ERROR);
+
+	// known content, so the results compare across machines
+	if (media_paths.empty() || generate_media_only)
+		for (const auto& spec : standard_test_clips())
+			if (const auto path = generate_test_clip(spec, media_cache_directory))
+				media_paths.push_back(path->string());
+	if (generate_media_only)
+	{
+		for (const auto& path : media_paths)
+			cout << path << "\n";
+		return 0;
+	}
+
+	if (selected("decode_throughput")) bench_decode(media_paths);
+	if (selected("seek_to_first_frame")) bench_seek(media_paths);
+	if (selected("seek_torture")) bench_seek_torture(media_paths);
+	if (selected("export_cpu")) bench_export(media_paths, filesystem::temp_directory_path());
+	if (selected("tracker_throughput")) bench_tracker(media_paths);
+	if (selected("stabilizer_throughput")) bench_stabilizer(media_paths);
+	bench_lookups();
+	if (selected("keyframes_evaluate")) bench_keyframes_evaluate();
+	if (selected("keyframes_simplify")) bench_keyframes_simplify();
+	if (selected("keyframes_smooth")) bench_keyframes_smooth();
+	if (selected("project_view_open") || selected("project_load_binary") || selected("project_load_json") || selected("project_journal_append"))
+		bench_project(filesystem::temp_directory_path());
+
+	// everything past this point needs a gl context, a software one is fine
+	HeadlessContext headless_context;
+
+	const vector<string> font_path_strings = { (content_directory / "OpenSans-Regular.ttf").string(), (content_directory / "NotoSansKR-Regular.otf").string(),
+		(content_directory / "Symbola605.ttf").string() };
+	vector<const char*> font_paths;
+	for (const auto& path : font_path_strings)
+		font_paths.push_back(path.c_str());
+	CHECK_SUCCESS(filesystem::exists(font_paths[0]), "Could not find the fonts, point --content at the content directory.");
+
+	bench_font(font_paths);
+	if (selected("gui_build") || selected("gui_render") || selected("frame_allocations")) bench_gui(font_paths, media_paths);
+	bench_upload();
+
+	if (output_path)
+	{
+		ofstream output(output_path);
+		write_json(output);
+	}
+	else
+		write_json(cout);
+
+	return checks_failed ? 1 : 0;
+}
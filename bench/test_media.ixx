@@ -0,0 +1,263 @@
+module;
+
+#include "libav.h"
+#include <glm/glm.hpp>
+#include <string>
+#include <vector>
+#include <optional>
+#include <filesystem>
+#include <iostream>
+#include <algorithm>
+#include <cstdio>
+#include <stdexcept>
+
+export module test_media;
+
+import utilities;
+
+using namespace std;
+using namespace glm;
+
+#define CHECK_SUCCESS(cmd, errormsg) if(!(cmd)) { throw runtime_error(errormsg); }
+#define CHECK_AV_SUCCESS(cmd) [[gsl::suppress(bounds.3)]] { const int __res = (cmd); if(__res < 0) { char av_error_buffer[AV_ERROR_MAX_STRING_SIZE]; av_strerror(__res, av_error_buffer, sizeof(av_error_buffer)); throw runtime_error(av_error_buffer); } }
+
+// bump when the generated content changes, so the cached clips are regenerated
+constexpr uint32_t test_media_version = 2;
+
+// the time base of the generated streams, fine enough for every frame rate and the variable frame durations
+constexpr AVRational test_media_time_base{ 1, 90000 };
+
+// a synthetic clip, everything in it derives from these fields so the same spec always gives the same frames
+export struct TestClipSpec
+{
+	string name;
+	ivec2 size{ 1920, 1080 };
+	int frame_count = 300;
+	AVRational frame_rate{ 30, 1 };
+	bool variable_frame_rate = false;			// every third frame lasts twice as long
+	int gop_length = 30;
+	int scene_cut_interval = 90;				// frames between pattern changes, 0 for a single scene
+	int noise_amplitude = 0;					// in 8 bit steps
+	AVPixelFormat pixel_format = AV_PIX_FMT_YUV420P;
+	string codec_name = "libx264";
+	string codec_options = "preset=veryfast";
+	string extension = ".mkv";
+	uint32_t seed = 1;
+};
+
+// the clips the benchmarks run against: the common case, long gops, a heavy noisy source, the high bit depth and
+// chroma formats, variable frame rate, 8K, and raw y4m for the mapped input path
+export vector<TestClipSpec> standard_test_clips()
+{
+	vector<TestClipSpec> clips;
+	clips.push_back({ "h264_1080p_gop30" });
+	clips.push_back({ "h264_1080p_gop250", { 1920, 1080 }, 500, { 30, 1 }, false, 250 });
+	clips.push_back({ "h264_720p_noise", { 1280, 720 }, 300, { 60, 1 }, false, 60, 120, 24 });
+	clips.push_back({ "h264_1080p_10bit_422", { 1920, 1080 }, 120, { 24000, 1001 }, false, 24, 48, 0, AV_PIX_FMT_YUV422P10 });
+	clips.push_back({ "h264_1080p_444_vfr", { 1920, 1080 }, 180, { 30, 1 }, true, 30, 60, 0, AV_PIX_FMT_YUV444P });
+	clips.push_back({ "hevc_4320p", { 7680, 4320 }, 30, { 30, 1 }, false, 15, 15, 0, AV_PIX_FMT_YUV420P, "libx265", "preset=ultrafast" });
+	clips.push_back({ "y4m_1080p", { 1920, 1080 }, 120, { 30, 1 }, false, 1, 60, 0, AV_PIX_FMT_YUV420P, "wrapped_avframe", "", ".y4m" });
+	return clips;
+}
+
+// a small xorshift, seeded per frame and plane so any frame can be generated on its own
+struct NoiseGenerator
+{
+	uint32_t state;
+
+	NoiseGenerator(const uint32_t seed) :state(seed ? seed : 0x9e3779b9) {}
+
+	int next(const int amplitude)
+	{
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		return static_cast<int>(state % (2 * amplitude + 1)) - amplitude;
+	}
+};
+
+// one of three patterns per scene, each moving with the frame index so the encoder has motion to find
+template<typename TSample>
+void fill_plane(const TestClipSpec& spec, const int frame_index, const int plane, uint8_t* data, const int linesize, const ivec2& plane_size,
+	const int bit_depth)
+{
+	const auto scene = spec.scene_cut_interval ? frame_index / spec.scene_cut_interval : 0;
+	const auto max_value = (1 << bit_depth) - 1;
+	NoiseGenerator noise(spec.seed ^ (frame_index * 0x9e3779b9u) ^ (plane * 0x85ebca6bu));
+
+	for (int y = 0; y < plane_size.y; ++y)
+	{
+		auto row = reinterpret_cast<TSample*>(data + static_cast<ptrdiff_t>(y) * linesize);
+		for (int x = 0; x < plane_size.x; ++x)
+		{
+			int value;
+			if (plane)
+				value = (64 + scene * 37 + (x + y) / 8 + frame_index) & 255;
+			else switch (scene % 3)
+			{
+			case 0: value = (x + y + frame_index * 4) & 255; break;
+			case 1: value = ((x + frame_index * 8) / 32 % 2) * 160 + 48; break;
+			default:
+			{
+				const auto cell = 16 + frame_index % 16;
+				value = ((x / cell ^ y / cell) & 1) * 200 + 28;
+				break;
+			}
+			}
+
+			if (spec.noise_amplitude)
+				value += noise.next(spec.noise_amplitude);
+			row[x] = static_cast<TSample>(std::clamp(value << (bit_depth - 8), 0, max_value));
+		}
+	}
+}
+
+void fill_frame(const TestClipSpec& spec, const int frame_index, AVFrame* frame)
+{
+	const auto desc = av_pix_fmt_desc_get(static_cast<AVPixelFormat>(frame->format));
+	const auto bit_depth = desc->comp[0].depth;
+
+	for (int plane = 0; plane < 3; ++plane)
+	{
+		const ivec2 plane_size = plane ? ivec2{ AV_CEIL_RSHIFT(frame->width, desc->log2_chroma_w), AV_CEIL_RSHIFT(frame->height, desc->log2_chroma_h) }
+			: ivec2{ frame->width, frame->height };
+		if (bit_depth > 8)
+			fill_plane<uint16_t>(spec, frame_index, plane, frame->data[plane], frame->linesize[plane], plane_size, bit_depth);
+		else
+			fill_plane<uint8_t>(spec, frame_index, plane, frame->data[plane], frame->linesize[plane], plane_size, bit_depth);
+	}
+}
+
+// the y4m muxer writes its frame rate header from the time base, so the y4m clips tick once per frame
+AVRational clip_time_base(const TestClipSpec& spec)
+{
+	return spec.extension == ".y4m" ? av_inv_q(spec.frame_rate) : test_media_time_base;
+}
+
+int64_t frame_duration(const TestClipSpec& spec, const int frame_index)
+{
+	const auto duration = av_rescale_q(1, av_inv_q(spec.frame_rate), clip_time_base(spec));
+	return spec.variable_frame_rate && frame_index % 3 == 2 ? duration * 2 : duration;
+}
+
+bool encoder_supports(AVCodec const* codec, const AVPixelFormat pixel_format)
+{
+	if (!codec->pix_fmts) return true;
+	for (auto supported = codec->pix_fmts; *supported != AV_PIX_FMT_NONE; ++supported)
+		if (*supported == pixel_format)
+			return true;
+	return false;
+}
+
+void encode_clip(const TestClipSpec& spec, const string& path)
+{
+	AVFormatContext* format_context{};
+	CHECK_AV_SUCCESS(avformat_alloc_output_context2(&format_context, nullptr, nullptr, path.c_str()));
+
+	const auto codec = avcodec_find_encoder_by_name(spec.codec_name.c_str());
+	auto codec_context = avcodec_alloc_context3(codec);
+	codec_context->width = spec.size.x;
+	codec_context->height = spec.size.y;
+	codec_context->pix_fmt = spec.pixel_format;
+	codec_context->time_base = clip_time_base(spec);
+	codec_context->framerate = spec.frame_rate;
+	codec_context->sample_aspect_ratio = { 1, 1 };
+	codec_context->gop_size = spec.gop_length;
+	codec_context->keyint_min = spec.gop_length;
+	codec_context->flags |= AV_CODEC_FLAG_CLOSED_GOP;
+	if (format_context->oformat->flags & AVFMT_GLOBALHEADER)
+		codec_context->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+	// the gops stay at their configured length even across the scene cuts
+	AVDictionary* options{};
+	av_dict_parse_string(&options, spec.codec_options.c_str(), "=", ":", 0);
+	if (spec.codec_name == "libx264")
+		av_dict_set(&options, "x264-params", "scenecut=0", 0);
+	else if (spec.codec_name == "libx265")
+		av_dict_set(&options, "x265-params", "scenecut=0:log-level=error", 0);
+	const int open_result = avcodec_open2(codec_context, codec, &options);
+	av_dict_free(&options);
+	CHECK_AV_SUCCESS(open_result);
+
+	const auto stream = avformat_new_stream(format_context, nullptr);
+	CHECK_SUCCESS(stream, "Could not create the output stream.");
+	CHECK_AV_SUCCESS(avcodec_parameters_from_context(stream->codecpar, codec_context));
+	stream->time_base = codec_context->time_base;
+
+	if (!(format_context->oformat->flags & AVFMT_NOFILE))
+		CHECK_AV_SUCCESS(avio_open(&format_context->pb, path.c_str(), AVIO_FLAG_WRITE));
+	CHECK_AV_SUCCESS(avformat_write_header(format_context, nullptr));
+
+	auto frame = av_frame_alloc();
+	frame->width = spec.size.x;
+	frame->height = spec.size.y;
+	frame->format = spec.pixel_format;
+	CHECK_AV_SUCCESS(av_frame_get_buffer(frame, 32));
+	auto packet = av_packet_alloc();
+
+	const auto encode = [&](const AVFrame* frame)
+	{
+		CHECK_AV_SUCCESS(avcodec_send_frame(codec_context, frame));
+		while (true)
+		{
+			const int res = avcodec_receive_packet(codec_context, packet);
+			if (res == AVERROR(EAGAIN) || res == AVERROR_EOF) break;
+			CHECK_AV_SUCCESS(res);
+
+			av_packet_rescale_ts(packet, codec_context->time_base, stream->time_base);
+			packet->stream_index = stream->index;
+			CHECK_AV_SUCCESS(av_interleaved_write_frame(format_context, packet));
+		}
+	};
+
+	int64_t pts{};
+	for (int frame_index = 0; frame_index < spec.frame_count; ++frame_index)
+	{
+		CHECK_AV_SUCCESS(av_frame_make_writable(frame));
+		fill_frame(spec, frame_index, frame);
+		frame->pts = pts;
+		frame->pkt_duration = frame_duration(spec, frame_index);
+		pts += frame->pkt_duration;
+		encode(frame);
+	}
+	encode(nullptr);
+	CHECK_AV_SUCCESS(av_write_trailer(format_context));
+
+	av_packet_free(&packet);
+	av_frame_free(&frame);
+	avcodec_free_context(&codec_context);
+	if (!(format_context->oformat->flags & AVFMT_NOFILE))
+		avio_closep(&format_context->pb);
+	avformat_free_context(format_context);
+}
+
+// returns the path of the clip in the cache directory, generating it first if it isn't there yet, or nothing if this
+// libav build can't encode it (no such encoder, or not in that pixel format)
+export optional<filesystem::path> generate_test_clip(const TestClipSpec& spec, const filesystem::path& cache_directory)
+{
+	const auto codec = avcodec_find_encoder_by_name(spec.codec_name.c_str());
+	if (!codec || !encoder_supports(codec, spec.pixel_format))
+	{
+		cerr << "skipping test clip " << spec.name << ", " << spec.codec_name << " can't encode " << av_get_pix_fmt_name(spec.pixel_format) << "\n";
+		return {};
+	}
+
+	Hasher hasher;
+	hasher.add(test_media_version).add(spec.name).add(spec.size).add(spec.frame_count).add(spec.frame_rate).add(spec.variable_frame_rate)
+		.add(spec.gop_length).add(spec.scene_cut_interval).add(spec.noise_amplitude).add(spec.pixel_format).add(spec.codec_name)
+		.add(spec.codec_options).add(spec.seed);
+	char key[32];
+	snprintf(key, sizeof(key), "_%016llx", static_cast<unsigned long long>(hasher.value));
+
+	filesystem::create_directories(cache_directory);
+	const auto path = cache_directory / (spec.name + key + spec.extension);
+	if (filesystem::exists(path))
+		return path;
+
+	// encode next to it and rename once done, so an interrupted run never leaves a truncated clip behind
+	const auto partial_path = cache_directory / (spec.name + key + ".partial" + spec.extension);
+	cerr << "generating test clip " << spec.name << "\n";
+	encode_clip(spec, partial_path.string());
+	filesystem::rename(partial_path, path);
+	return path;
+}
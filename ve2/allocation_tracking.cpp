@@ -0,0 +1,86 @@
+#include "allocation_tracking.h"
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+using namespace std;
+
+thread_local uint64_t thread_allocations;
+atomic<uint64_t> total_allocations;
+
+uint64_t thread_allocation_count() noexcept { return thread_allocations; }
+uint64_t total_allocation_count() noexcept { return total_allocations.load(memory_order_relaxed); }
+
+#ifdef VE2_TRACK_ALLOCATIONS
+void* counted_malloc(const size_t size) noexcept
+{
+	++thread_allocations;
+	total_allocations.fetch_add(1, memory_order_relaxed);
+	return malloc(size ? size : 1);
+}
+
+void* counted_aligned_malloc(const size_t size, const align_val_t alignment) noexcept
+{
+	++thread_allocations;
+	total_allocations.fetch_add(1, memory_order_relaxed);
+#ifdef _WIN32
+	return _aligned_malloc(size ? size : 1, static_cast<size_t>(alignment));
+#else
+	// aligned_alloc wants the size to be a multiple of the alignment
+	const auto aligned = static_cast<size_t>(alignment);
+	return aligned_alloc(aligned, (size + aligned - 1) / aligned * aligned);
+#endif
+}
+
+void aligned_free(void* pointer) noexcept
+{
+#ifdef _WIN32
+	_aligned_free(pointer);
+#else
+	free(pointer);
+#endif
+}
+
+void* operator new(const size_t size)
+{
+	if (const auto pointer = counted_malloc(size)) return pointer;
+	throw bad_alloc();
+}
+
+void* operator new[](const size_t size)
+{
+	if (const auto pointer = counted_malloc(size)) return pointer;
+	throw bad_alloc();
+}
+
+void* operator new(const size_t size, const align_val_t alignment)
+{
+	if (const auto pointer = counted_aligned_malloc(size, alignment)) return pointer;
+	throw bad_alloc();
+}
+
+void* operator new[](const size_t size, const align_val_t alignment)
+{
+	if (const auto pointer = counted_aligned_malloc(size, alignment)) return pointer;
+	throw bad_alloc();
+}
+
+void* operator new(const size_t size, const nothrow_t&) noexcept { return counted_malloc(size); }
+void* operator new[](const size_t size, const nothrow_t&) noexcept { return counted_malloc(size); }
+void* operator new(const size_t size, const align_val_t alignment, const nothrow_t&) noexcept { return counted_aligned_malloc(size, alignment); }
+void* operator new[](const size_t size, const align_val_t alignment, const nothrow_t&) noexcept { return counted_aligned_malloc(size, alignment); }
+
+void operator delete(void* pointer) noexcept { free(pointer); }
+void operator delete[](void* pointer) noexcept { free(pointer); }
+void operator delete(void* pointer, size_t) noexcept { free(pointer); }
+void operator delete[](void* pointer, size_t) noexcept { free(pointer); }
+void operator delete(void* pointer, const nothrow_t&) noexcept { free(pointer); }
+void operator delete[](void* pointer, const nothrow_t&) noexcept { free(pointer); }
+
+void operator delete(void* pointer, align_val_t) noexcept { aligned_free(pointer); }
+void operator delete[](void* pointer, align_val_t) noexcept { aligned_free(pointer); }
+void operator delete(void* pointer, size_t, align_val_t) noexcept { aligned_free(pointer); }
+void operator delete[](void* pointer, size_t, align_val_t) noexcept { aligned_free(pointer); }
+void operator delete(void* pointer, align_val_t, const nothrow_t&) noexcept { aligned_free(pointer); }
+void operator delete[](void* pointer, align_val_t, const nothrow_t&) noexcept { aligned_free(pointer); }
+#endif
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <cstdint>
+
+// counts the global operator new calls, so the hot loops can check that they stay off the heap once warmed up
+// building without VE2_TRACK_ALLOCATIONS keeps the default operator new, and the counts stay at 0
+#ifdef VE2_TRACK_ALLOCATIONS
+constexpr bool allocation_tracking_enabled = true;
+#else
+constexpr bool allocation_tracking_enabled = false;
+#endif
+
+// the allocations made by the calling thread, and by every thread
+uint64_t thread_allocation_count() noexcept;
+uint64_t total_allocation_count() noexcept;
@@ -0,0 +1,308 @@
+module;
+
+#include "libav.h"
+#include <glm/glm.hpp>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <span>
+#include <functional>
+#include <filesystem>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <numeric>
+#include <cstdio>
+#include <cmath>
+#include <stdexcept>
+
+export module analyzer;
+
+import video;
+import exporter;
+import y4m_reader;
+import utilities;
+
+using namespace std;
+using namespace glm;
+
+#define CHECK_SUCCESS(cmd, errormsg) if(!(cmd)) { throw runtime_error(errormsg); }
+#define CHECK_AV_SUCCESS(cmd) [[gsl::suppress(bounds.3)]] { const int __res = (cmd); if(__res < 0) { char av_error_buffer[AV_ERROR_MAX_STRING_SIZE]; av_strerror(__res, av_error_buffer, sizeof(av_error_buffer)); throw runtime_error(av_error_buffer); } }
+
+// how much of the source the export estimates actually encode, the rest is extrapolated from their frame rate
+constexpr double export_sample_sec = 2.;
+
+// the player's decoding thread doesn't signal the end of the file, the decode pass ends when no frame shows up for this long
+constexpr chrono::seconds decode_idle_timeout{ 2 };
+
+export struct ExportEstimate
+{
+	string name;
+	double estimated_sec;
+};
+
+export struct SourceAnalysis
+{
+	string path;
+	string error;							// set when the source couldn't be analyzed, in which case the rest is missing
+
+	// stream info
+	string codec, pixel_format;
+	ivec2 size{};
+	double frame_rate{}, duration_sec{};
+	int64_t bit_rate{}, frames{};
+
+	// groups of pictures, split on the key frame packets, in frames
+	int64_t gop_count{}, gop_min_frames{}, gop_max_frames{};
+	double gop_mean_frames{};
+
+	// what the player holds decoded ahead of playback: its full frame queue, plus the decoder's threads and reference frames
+	int64_t max_decode_ahead_bytes{};
+
+	// through the player's decoding thread, at its thread settings
+	int64_t decoded_frames{};
+	double decode_fps{};
+
+	// one entry per configured rendition, and one for all of them in a single pass like the real export
+	vector<ExportEstimate> export_estimates;
+};
+
+// what the scan learns that the later passes need
+struct StreamTiming
+{
+	int64_t start_pts{};
+	double time_base{};
+};
+
+void set_gop_statistics(SourceAnalysis& analysis, const vector<int64_t>& gop_lengths)
+{
+	if (gop_lengths.empty()) return;
+	analysis.gop_count = static_cast<int64_t>(gop_lengths.size());
+	analysis.gop_min_frames = *min_element(gop_lengths.begin(), gop_lengths.end());
+	analysis.gop_max_frames = *max_element(gop_lengths.begin(), gop_lengths.end());
+	analysis.gop_mean_frames = static_cast<double>(accumulate(gop_lengths.begin(), gop_lengths.end(), int64_t{})) / gop_lengths.size();
+}
+
+// demuxes the whole file without decoding it, for the stream info, the frame count and the groups of pictures
+StreamTiming scan_stream(const char* url, SourceAnalysis& analysis)
+{
+	if (Y4mReader::is_y4m(url))
+	{
+		// every frame stands on its own, and they're mapped rather than decoded ahead
+		const Y4mReader y4m(url);
+		analysis.codec = "y4m";
+		analysis.pixel_format = av_get_pix_fmt_name(y4m.format());
+		analysis.size = y4m.frame_size();
+		analysis.frame_rate = av_q2d(y4m.frame_rate());
+		analysis.frames = y4m.frames();
+		analysis.duration_sec = analysis.frame_rate > 0 ? analysis.frames / analysis.frame_rate : 0;
+		analysis.bit_rate = static_cast<int64_t>(av_image_get_buffer_size(y4m.format(), y4m.frame_size().x, y4m.frame_size().y, 1) * 8 * analysis.frame_rate);
+		set_gop_statistics(analysis, vector<int64_t>(static_cast<size_t>(analysis.frames), 1));
+		return { 0, av_q2d(y4m.time_base()) };
+	}
+
+	AVFormatContext* format_context{};
+	CHECK_AV_SUCCESS(avformat_open_input(&format_context, url, nullptr, nullptr));
+	CHECK_AV_SUCCESS(avformat_find_stream_info(format_context, nullptr));
+	const int video_stream_index = av_find_best_stream(format_context, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+	CHECK_SUCCESS(video_stream_index >= 0, "Could not find a video stream.");
+
+	const auto stream = format_context->streams[video_stream_index];
+	const auto codecpar = stream->codecpar;
+	analysis.codec = avcodec_get_name(codecpar->codec_id);
+	const auto pixel_format_name = av_get_pix_fmt_name(static_cast<AVPixelFormat>(codecpar->format));
+	analysis.pixel_format = pixel_format_name ? pixel_format_name : "unknown";
+	analysis.size = { codecpar->width, codecpar->height };
+	analysis.frame_rate = av_q2d(av_guess_frame_rate(format_context, stream, nullptr));
+	analysis.duration_sec = format_context->duration != AV_NOPTS_VALUE ? static_cast<double>(format_context->duration) / AV_TIME_BASE : 0;
+	analysis.bit_rate = format_context->bit_rate;
+
+	vector<int64_t> gop_lengths;
+	auto packet = av_packet_alloc();
+	while (av_read_frame(format_context, packet) >= 0)
+	{
+		if (packet->stream_index == video_stream_index)
+		{
+			++analysis.frames;
+			if ((packet->flags & AV_PKT_FLAG_KEY) || gop_lengths.empty())
+				gop_lengths.push_back(0);
+			++gop_lengths.back();
+		}
+		av_packet_unref(packet);
+	}
+	av_packet_free(&packet);
+	set_gop_statistics(analysis, gop_lengths);
+
+	const auto frame_bytes = av_image_get_buffer_size(static_cast<AVPixelFormat>(codecpar->format), codecpar->width, codecpar->height, 32);
+	analysis.max_decode_ahead_bytes = static_cast<int64_t>(std::max(frame_bytes, 0)) * (frames_queue_max_length + decoder_thread_count + codecpar->video_delay + 1);
+
+	const StreamTiming timing{ stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0, av_q2d(stream->time_base) };
+	avformat_close_input(&format_context);
+	return timing;
+}
+
+// plays the source through the player's Video as fast as the frames come, without a window to show them in
+void measure_decode(const char* url, SourceAnalysis& analysis)
+{
+	mutex frame_available_mutex;
+	condition_variable frame_available_cv;
+	uint64_t frames_available{};
+	Video video(url, [&]
+		{
+			{
+				lock_guard lock(frame_available_mutex);
+				++frames_available;
+			}
+			frame_available_cv.notify_one();
+		});
+
+	const auto start_time = chrono::steady_clock::now();
+	auto last_frame_time = start_time;
+	while (analysis.decoded_frames < analysis.frames)
+	{
+		uint64_t seen;
+		{
+			lock_guard lock(frame_available_mutex);
+			seen = frames_available;
+		}
+		if (video.consume_frame([](int64_t, int64_t, const auto&) {}))
+		{
+			++analysis.decoded_frames;
+			last_frame_time = chrono::steady_clock::now();
+			continue;
+		}
+
+		unique_lock lock(frame_available_mutex);
+		if (!frame_available_cv.wait_until(lock, last_frame_time + decode_idle_timeout, [&] { return frames_available != seen; }))
+			break;
+	}
+
+	const auto elapsed_sec = chrono::duration<double>(last_frame_time - start_time).count();
+	analysis.decode_fps = elapsed_sec > 0 ? analysis.decoded_frames / elapsed_sec : 0;
+}
+
+// exports the first few seconds with the configured settings and scales the time up to the whole source
+void estimate_exports(const char* url, const vector<ExportOutput>& outputs, const StreamTiming& timing, SourceAnalysis& analysis)
+{
+	const auto sample_pts = static_cast<int64_t>(export_sample_sec / timing.time_base);
+
+	const auto run_sample = [&](const vector<ExportOutput>& sample_outputs)
+	{
+		Exporter exporter(url);
+		exporter.set_range(timing.start_pts, timing.start_pts + sample_pts);
+		for (const auto& output : sample_outputs)
+			exporter.add_output(output);
+
+		const auto start_time = chrono::steady_clock::now();
+		const auto frames = exporter.run();
+		const auto elapsed_sec = chrono::duration<double>(chrono::steady_clock::now() - start_time).count();
+
+		for (const auto& output : sample_outputs)
+			for (const auto& rendition : output.renditions)
+			{
+				error_code ignored;
+				filesystem::remove(rendition.path, ignored);
+			}
+
+		return frames ? elapsed_sec * analysis.frames / frames : 0.;
+	};
+
+	for (const auto& output : outputs)
+		for (const auto& rendition : output.renditions)
+			analysis.export_estimates.push_back({ filesystem::path(rendition.path).stem().string(), run_sample({ { output.track, { rendition } } }) });
+	analysis.export_estimates.push_back({ "all", run_sample(outputs) });
+}
+
+// analyzes the sources on as many threads as the core budget allows, every analysis decoding on decoder_thread_count
+// threads of its own, a source that fails only gets its error set
+// configured_outputs gets the index of the source and its frame size, and returns the outputs a real export would write
+export vector<SourceAnalysis> analyze_sources(const span<const char* const> urls, const int core_budget,
+	const function<vector<ExportOutput>(size_t, ivec2)>& configured_outputs)
+{
+	vector<SourceAnalysis> analyses(urls.size());
+	atomic<size_t> next_source{};
+
+	const auto worker = [&]
+	{
+		for (size_t index; (index = next_source.fetch_add(1)) < urls.size();)
+		{
+			auto& analysis = analyses[index];
+			analysis.path = urls[index];
+
+			try
+			{
+				const auto timing = scan_stream(urls[index], analysis);
+				measure_decode(urls[index], analysis);
+				estimate_exports(urls[index], configured_outputs(index, analysis.size), timing, analysis);
+			}
+			catch (const exception& e)
+			{
+				analysis.error = e.what();
+			}
+		}
+	};
+
+	const auto job_count = std::clamp<size_t>(std::max(core_budget, 1) / decoder_thread_count, 1, std::max<size_t>(urls.size(), 1));
+	vector<thread> jobs;
+	for (size_t job = 1; job < job_count; ++job)
+		jobs.emplace_back(worker);
+	worker();
+	for (auto& job : jobs)
+		job.join();
+
+	return analyses;
+}
+
+// a json number, or null for the values a broken header can make infinite or nan, which json can't hold
+string json_number(const double number)
+{
+	if (!isfinite(number)) return "null";
+	char value[32];
+	snprintf(value, sizeof(value), "%g", number);
+	return value;
+}
+
+export string analysis_json(const span<const SourceAnalysis> analyses)
+{
+	string json = "{\n\t\"schema\": 1,\n\t\"sources\": [";
+	char value[1024];
+
+	const char* separator = "\n";
+	for (const auto& analysis : analyses)
+	{
+		json += separator;
+		json += "\t\t{ \"path\": \"" + json_escape(analysis.path) + "\"";
+		separator = ",\n";
+
+		if (!analysis.error.empty())
+		{
+			json += ", \"error\": \"" + json_escape(analysis.error) + "\" }";
+			continue;
+		}
+
+		snprintf(value, sizeof(value), ", \"codec\": \"%s\", \"pixel_format\": \"%s\", \"width\": %d, \"height\": %d, \"frame_rate\": %s, "
+			"\"duration_sec\": %s, \"bit_rate\": %lld, \"frames\": %lld, \"gop\": { \"count\": %lld, \"min_frames\": %lld, \"mean_frames\": %s, "
+			"\"max_frames\": %lld }, \"max_decode_ahead_bytes\": %lld, \"decoded_frames\": %lld, \"decode_fps\": %s, \"export_estimates_sec\": {",
+			json_escape(analysis.codec).c_str(), json_escape(analysis.pixel_format).c_str(), analysis.size.x, analysis.size.y, json_number(analysis.frame_rate).c_str(),
+			json_number(analysis.duration_sec).c_str(), static_cast<long long>(analysis.bit_rate), static_cast<long long>(analysis.frames),
+			static_cast<long long>(analysis.gop_count), static_cast<long long>(analysis.gop_min_frames), json_number(analysis.gop_mean_frames).c_str(),
+			static_cast<long long>(analysis.gop_max_frames), static_cast<long long>(analysis.max_decode_ahead_bytes),
+			static_cast<long long>(analysis.decoded_frames), json_number(analysis.decode_fps).c_str());
+		json += value;
+
+		const char* estimate_separator = " ";
+		for (const auto& estimate : analysis.export_estimates)
+		{
+			snprintf(value, sizeof(value), "%s\"%s\": %s", estimate_separator, json_escape(estimate.name).c_str(), json_number(estimate.estimated_sec).c_str());
+			json += value;
+			estimate_separator = ", ";
+		}
+		json += " } }";
+	}
+
+	json += "\n\t]\n}\n";
+	return json;
+}
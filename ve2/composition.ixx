@@ -2,12 +2,14 @@ module;
 
 #include <vector>
 #include <memory>
+#include <algorithm>
+#include <stdexcept>
 
 export module composition;
 
 using namespace std;
 
-struct Part
+export struct Part
 {
 	int64_t from_pts, to_pts;
 };
@@ -27,16 +29,44 @@ export struct Composition
 		impl->parts.push_back({ 0, duration_pts });
 	}
 
+	// restores a saved composition, the parts have to be in order, not overlap and lie within the duration
+	Composition(const int64_t duration_pts, vector<Part> parts)
+	{
+		int64_t previous_to_pts{};
+		for (const auto& part : parts)
+		{
+			if (part.from_pts < previous_to_pts || part.to_pts <= part.from_pts || part.to_pts > duration_pts)
+				throw runtime_error("composition parts out of order, overlapping or out of range");
+			previous_to_pts = part.to_pts;
+		}
+
+		impl->duration_pts = duration_pts;
+		impl->parts = move(parts);
+	}
+
 	void split(const int64_t pts)
 	{
 		for (auto part_it = impl->parts.begin(); part_it != impl->parts.end(); ++part_it)
-			if (part_it->from_pts <= pts && part_it->to_pts >= pts)
+			if (part_it->from_pts < pts && part_it->to_pts > pts)
 			{
-				impl->parts.insert(part_it + 1, { pts, part_it->to_pts });
+				const auto to_pts = part_it->to_pts;
 				part_it->to_pts = pts;
+				impl->parts.insert(part_it + 1, { pts, to_pts });
+				break;
 			}
 	}
 
+	// removes the [from_pts, to_pts) range from the composition
+	void erase(const int64_t from_pts, const int64_t to_pts)
+	{
+		split(from_pts);
+		split(to_pts);
+		impl->parts.erase(remove_if(impl->parts.begin(), impl->parts.end(),
+			[&](const auto& part) { return part.from_pts >= from_pts && part.to_pts <= to_pts; }), impl->parts.end());
+	}
+
+	int64_t duration_pts() const noexcept { return impl->duration_pts; }
+
 	auto begin() const noexcept { return impl->parts.cbegin(); }
 	auto end() const noexcept { return impl->parts.cend(); }
 
@@ -54,7 +84,7 @@ export struct Composition
 				full_pts = part.to_pts;
 			}
 
-		throw exception("composition lookup out of range");
+		throw runtime_error("composition lookup out of range");
 	}
 
 private:
@@ -0,0 +1,156 @@
+module;
+
+#include "libav.h"
+#include <glm/glm.hpp>
+#include <span>
+#include <memory>
+#include <stdexcept>
+
+export module decoder;
+
+import y4m_reader;
+
+using namespace std;
+using namespace glm;
+
+#define CHECK_SUCCESS(cmd, errormsg) if(!(cmd)) { throw runtime_error(errormsg); }
+#define CHECK_AV_SUCCESS(cmd) [[gsl::suppress(bounds.3)]] { const int __res = (cmd); if(__res < 0) { char av_error_buffer[AV_ERROR_MAX_STRING_SIZE]; av_strerror(__res, av_error_buffer, sizeof(av_error_buffer)); throw runtime_error(av_error_buffer); } }
+
+// a synchronous, pull based decoder for the first video stream of a file, used by the offline passes (export, analysis)
+// where the frames have to be processed in order and exactly once, unlike the playback queue in the video module
+// y4m files skip libav altogether, their frames point straight into a mapping of the file
+export class Decoder
+{
+	unique_ptr<Y4mReader> y4m;
+	int64_t y4m_next_frame{};
+
+	AVFormatContext* format_context{};
+	AVStream* video_stream{};
+	AVCodecContext* codec_decoder_context{};
+
+	AVFrame* frame{};
+	AVPacket* packet{};
+	bool draining{};
+
+public:
+	// luma_only asks the codec to skip the chroma planes, for passes that only look at brightness, codecs (or libav builds)
+	// that can't still decode them, export_motion_vectors attaches the blocks' motion vectors to the frames as side data
+	Decoder(const char* url, const int thread_count = 4, const bool luma_only = false, const bool export_motion_vectors = false)
+	{
+		frame = av_frame_alloc();
+
+		if (Y4mReader::is_y4m(url))
+		{
+			y4m = make_unique<Y4mReader>(url);
+			return;
+		}
+
+		CHECK_AV_SUCCESS(avformat_open_input(&format_context, url, nullptr, nullptr));
+		CHECK_AV_SUCCESS(avformat_find_stream_info(format_context, nullptr));
+
+		// find the first video stream
+		for (const auto current_video_stream : span<AVStream*>(format_context->streams, format_context->nb_streams))
+			if (current_video_stream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+			{
+				video_stream = current_video_stream;
+				break;
+			}
+		CHECK_SUCCESS(video_stream, "Could not find a video stream.");
+
+		AVCodec const* codec_decoder = avcodec_find_decoder(video_stream->codecpar->codec_id);
+		CHECK_SUCCESS(codec_decoder, "Could not find decoder codec.");
+
+		codec_decoder_context = avcodec_alloc_context3(codec_decoder);
+		CHECK_AV_SUCCESS(avcodec_parameters_to_context(codec_decoder_context, video_stream->codecpar));
+
+		codec_decoder_context->thread_count = thread_count;
+		codec_decoder_context->thread_type = FF_THREAD_FRAME;
+		if (luma_only) codec_decoder_context->flags |= AV_CODEC_FLAG_GRAY;
+		if (export_motion_vectors) codec_decoder_context->flags2 |= AV_CODEC_FLAG2_EXPORT_MVS;
+
+		CHECK_AV_SUCCESS(avcodec_open2(codec_decoder_context, codec_decoder, nullptr));
+
+		packet = av_packet_alloc();
+	}
+
+	Decoder(const Decoder&) = delete;
+	Decoder& operator=(const Decoder&) = delete;
+
+	~Decoder()
+	{
+		av_frame_free(&frame);
+		av_packet_free(&packet);
+		avcodec_free_context(&codec_decoder_context);
+		avformat_close_input(&format_context);
+	}
+
+	// returns the next decoded frame, owned by the decoder and valid until the next call, or nullptr once the stream is fully drained
+	AVFrame* next_frame()
+	{
+		if (y4m)
+		{
+			if (y4m_next_frame >= y4m->frames()) return nullptr;
+			y4m->fill_frame(y4m_next_frame++, frame);
+			return frame;
+		}
+
+		while (true)
+		{
+			av_frame_unref(frame);
+
+			const int res = avcodec_receive_frame(codec_decoder_context, frame);
+			if (res >= 0) return frame;
+			if (res == AVERROR_EOF) return nullptr;
+			if (res != AVERROR(EAGAIN)) CHECK_AV_SUCCESS(res);
+
+			// the decoder needs more data
+			if (av_read_frame(format_context, packet) < 0)
+			{
+				// end of file, flush the frames still buffered in the decoder
+				CHECK_SUCCESS(!draining, "Decoder stalled while draining.");
+				CHECK_AV_SUCCESS(avcodec_send_packet(codec_decoder_context, nullptr));
+				draining = true;
+				continue;
+			}
+
+			if (packet->stream_index == video_stream->index)
+				CHECK_AV_SUCCESS(avcodec_send_packet(codec_decoder_context, packet));
+			av_packet_unref(packet);
+		}
+	}
+
+	// seeks to the key frame at or before pts, the caller is expected to skip the frames before pts
+	void seek_pts(const int64_t pts)
+	{
+		if (y4m)
+		{
+			y4m_next_frame = std::max<int64_t>(pts, 0);
+			return;
+		}
+
+		avformat_seek_file(format_context, video_stream->index, INT64_MIN, pts, pts, AVSEEK_FLAG_BACKWARD);
+		avcodec_flush_buffers(codec_decoder_context);
+		draining = false;
+	}
+
+	// the libav contexts, null for y4m input
+	AVFormatContext* format() const { return format_context; }
+	AVStream* stream() const { return video_stream; }
+	AVCodecContext* codec_context() const { return codec_decoder_context; }
+
+	ivec2 frame_size() const { return y4m ? y4m->frame_size() : ivec2{ video_stream->codecpar->width, video_stream->codecpar->height }; }
+	AVPixelFormat pixel_format() const { return y4m ? y4m->format() : codec_decoder_context->pix_fmt; }
+	bool colorspace_is_bt709() const { return !y4m && codec_decoder_context->colorspace == AVCOL_SPC_BT709; }
+	AVRational time_base() const { return y4m ? y4m->time_base() : video_stream->time_base; }
+	AVRational frame_rate() const { return y4m ? y4m->frame_rate() : av_guess_frame_rate(format_context, video_stream, nullptr); }
+	int64_t start_pts() const { return y4m || video_stream->start_time == AV_NOPTS_VALUE ? 0 : video_stream->start_time; }
+
+	// the stream's duration, or the container's for formats that only store that one (mkv), AV_NOPTS_VALUE if neither is known
+	int64_t duration_pts() const
+	{
+		if (y4m) return y4m->frames();
+		if (video_stream->duration != AV_NOPTS_VALUE) return video_stream->duration;
+		if (format_context->duration != AV_NOPTS_VALUE) return av_rescale_q(format_context->duration, AV_TIME_BASE_Q, video_stream->time_base);
+		return AV_NOPTS_VALUE;
+	}
+};
@@ -0,0 +1,102 @@
+module;
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+
+#ifdef _MSC_VER
+#include <CppCoreCheck\Warnings.h>
+#endif
+#pragma warning(push)
+#pragma warning(disable : ALL_CPPCORECHECK_WARNINGS)
+// the out of line definitions of the curves are compiled with the font code, which includes agg_curves_impl.hpp
+#include "agg/agg_curves.h"
+#pragma warning(pop)
+
+export module easing;
+
+using namespace std;
+using namespace glm;
+
+// the flattened curve is resampled at this many evenly spaced steps of progress, plenty for the lerp between them not to show
+constexpr int easing_table_steps = 64;
+
+// agg flattens to within half a unit over this, the curve spans a single unit
+constexpr double easing_approximation_scale = 2000;
+
+export enum class EasingType : int32_t { Linear, EaseIn, EaseOut, EaseInOut, Custom };
+
+// a cubic bezier from (0, 0) to (1, 1), mapping the progress between two key frames to how far the box has moved, the
+// handles' x stay within [0, 1] so the curve never runs backwards in time, their y can overshoot
+export struct Easing
+{
+	EasingType type = EasingType::Linear;
+	vec2 handle0{}, handle1{ 1, 1 };
+
+	bool operator==(const Easing&) const = default;
+};
+
+// the usual css handles for the presets
+export Easing easing_preset(const EasingType type)
+{
+	switch (type)
+	{
+	case EasingType::EaseIn: return { type, { .42f, 0 }, { 1, 1 } };
+	case EasingType::EaseOut: return { type, { 0, 0 }, { .58f, 1 } };
+	case EasingType::EaseInOut: return { type, { .42f, 0 }, { .58f, 1 } };
+	default: return {};
+	}
+}
+
+export Easing easing_custom(const vec2& handle0, const vec2& handle1)
+{
+	return { EasingType::Custom, { std::clamp(handle0.x, 0.f, 1.f), handle0.y }, { std::clamp(handle1.x, 0.f, 1.f), handle1.y } };
+}
+
+// an easing flattened into a lookup table once, when it's set, so evaluating it is a lookup and a lerp
+export class EasingCurve
+{
+	Easing easing;
+	vector<float> table;					// empty when linear
+
+public:
+	EasingCurve(const Easing& easing = {}) :easing(easing)
+	{
+		if (easing.type == EasingType::Linear) return;
+
+		agg_fontnik::curve4_div curve;
+		curve.approximation_scale(easing_approximation_scale);
+		curve.init(0, 0, easing.handle0.x, easing.handle0.y, easing.handle1.x, easing.handle1.y, 1, 1);
+
+		vector<dvec2> points;
+		double x, y;
+		while (!agg_fontnik::is_stop(curve.vertex(&x, &y)))
+			points.push_back({ x, y });
+
+		// the flattened points are spaced by curvature, resample them evenly over x
+		table.resize(easing_table_steps + 1);
+		size_t segment{};
+		for (int step = 0; step <= easing_table_steps; ++step)
+		{
+			const auto progress = static_cast<double>(step) / easing_table_steps;
+			while (segment + 2 < points.size() && points[segment + 1].x < progress) ++segment;
+
+			const auto& p0 = points[segment];
+			const auto& p1 = points[segment + 1];
+			const auto dx = p1.x - p0.x;
+			table[step] = static_cast<float>(dx > 0 ? mix(p0.y, p1.y, std::clamp((progress - p0.x) / dx, 0., 1.)) : p1.y);
+		}
+	}
+
+	const Easing& spec() const { return easing; }
+
+	float operator()(const float progress) const
+	{
+		if (table.empty()) return progress;
+
+		const auto position = std::clamp(progress, 0.f, 1.f) * easing_table_steps;
+		const auto step = std::min(static_cast<int>(position), easing_table_steps - 1);
+		return mix(table[step], table[step + 1], position - step);
+	}
+};
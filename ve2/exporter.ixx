@@ -0,0 +1,478 @@
+module;
+
+#include "libav.h"
+#include <glm/glm.hpp>
+#include <memory>
+#include <vector>
+#include <string>
+#include <functional>
+#include <algorithm>
+#include <span>
+#include <stdexcept>
+
+export module exporter;
+
+import utilities;
+import keyframes;
+import decoder;
+import headless_context;
+import gpu_scaler;
+
+using namespace std;
+using namespace glm;
+
+#define CHECK_SUCCESS(cmd, errormsg) if(!(cmd)) { throw runtime_error(errormsg); }
+#define CHECK_AV_SUCCESS(cmd) [[gsl::suppress(bounds.3)]] { const int __res = (cmd); if(__res < 0) { char av_error_buffer[AV_ERROR_MAX_STRING_SIZE]; av_strerror(__res, av_error_buffer, sizeof(av_error_buffer)); throw runtime_error(av_error_buffer); } }
+
+// how a rendition is written: encoded into a container guessed from the path extension, or as raw frames for tools
+// that read video from a pipe, in which case the path can also be "pipe:1" for stdout or a named pipe
+export enum class RenditionFormat { Encoded, Y4m, NutRaw };
+
+export struct Rendition
+{
+	string path;					// output file, the container is guessed from the extension for encoded renditions
+	ivec2 size;
+	RenditionFormat format = RenditionFormat::Encoded;
+};
+
+// every rendition of a crop track gets the same crop, only scaled differently
+export struct ExportOutput
+{
+	const CropTrack* track;
+	vector<Rendition> renditions;
+};
+
+// where the crop and scale kernels run: on the cpu through swscale, or on an offscreen gpu context, which renders
+// either re-packed yuv 4:2:0 planes or rgb that is then converted to the encoder format on the cpu
+export enum class ExportBackend { Cpu, GpuYuv, GpuRgb };
+
+export struct ExportSettings
+{
+	string codec_name = "libx264";
+	string codec_options = "crf=20:preset=medium";			// key=value pairs separated by ':', passed to the encoder as is
+	int decoder_thread_count = 4;
+	ExportBackend backend = ExportBackend::Cpu;
+	int gpu_readback_ring_size = 3;							// frames in flight per rendition before the encoder waits on the gpu
+};
+
+AVPixelFormat pick_pixel_format(AVCodec const* codec)
+{
+	if (!codec->pix_fmts) return AV_PIX_FMT_YUV420P;
+
+	for (auto pixel_format = codec->pix_fmts; *pixel_format != AV_PIX_FMT_NONE; ++pixel_format)
+		if (*pixel_format == AV_PIX_FMT_YUV420P)
+			return AV_PIX_FMT_YUV420P;
+	return codec->pix_fmts[0];
+}
+
+// a single output file with its video stream
+struct Encoder
+{
+	AVFormatContext* format_context{};
+	AVCodecContext* codec_context{};
+	AVStream* stream{};
+	AVPacket* packet{};
+	AVRational source_time_base;
+
+	// delegates to the constructor below, so the destructor frees whatever was allocated when a later step throws
+	Encoder(const Rendition& rendition, const AVRational time_base, const AVRational frame_rate, const ExportSettings& settings)
+		:Encoder(time_base)
+	{
+		const auto& path = rendition.path;
+		const auto& size = rendition.size;
+
+		// the raw formats skip the encoder: y4m takes the frames themselves (wrapped_avframe) and the muxer writes the rows
+		// straight from the frame planes, nut gets the planes packed into one packet. either way nothing is queued, every frame
+		// is written out before the next one is decoded, so a slow reader blocks the writes and with them the decoding
+		AVCodec const* codec{};
+		switch (rendition.format)
+		{
+		case RenditionFormat::Encoded:
+			CHECK_AV_SUCCESS(avformat_alloc_output_context2(&format_context, nullptr, nullptr, path.c_str()));
+			codec = avcodec_find_encoder_by_name(settings.codec_name.c_str());
+			if (!codec) codec = avcodec_find_encoder(format_context->oformat->video_codec);
+			break;
+		case RenditionFormat::Y4m:
+			CHECK_AV_SUCCESS(avformat_alloc_output_context2(&format_context, nullptr, "yuv4mpegpipe", path.c_str()));
+			codec = avcodec_find_encoder(AV_CODEC_ID_WRAPPED_AVFRAME);
+			break;
+		case RenditionFormat::NutRaw:
+			CHECK_AV_SUCCESS(avformat_alloc_output_context2(&format_context, nullptr, "nut", path.c_str()));
+			codec = avcodec_find_encoder(AV_CODEC_ID_RAWVIDEO);
+			break;
+		}
+		CHECK_SUCCESS(codec, "Could not find encoder codec.");
+		const bool raw = rendition.format != RenditionFormat::Encoded;
+
+		codec_context = avcodec_alloc_context3(codec);
+		codec_context->width = size.x;
+		codec_context->height = size.y;
+		// the raw muxers write the frame rate from the time base (y4m's F header), so they tick once per frame
+		codec_context->time_base = raw && frame_rate.num > 0 && frame_rate.den > 0 ? av_inv_q(frame_rate) : time_base;
+		codec_context->framerate = frame_rate;
+		codec_context->sample_aspect_ratio = { 1, 1 };
+		codec_context->pix_fmt = pick_pixel_format(codec);
+		if (format_context->oformat->flags & AVFMT_GLOBALHEADER)
+			codec_context->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+		AVDictionary* options{};
+		if (!raw)
+			av_dict_parse_string(&options, settings.codec_options.c_str(), "=", ":", 0);
+		const int open_result = avcodec_open2(codec_context, codec, &options);
+		av_dict_free(&options);
+		CHECK_AV_SUCCESS(open_result);
+
+		stream = avformat_new_stream(format_context, nullptr);
+		CHECK_SUCCESS(stream, "Could not create the output stream.");
+		CHECK_AV_SUCCESS(avcodec_parameters_from_context(stream->codecpar, codec_context));
+		stream->time_base = codec_context->time_base;
+
+		if (!(format_context->oformat->flags & AVFMT_NOFILE))
+			CHECK_AV_SUCCESS(avio_open(&format_context->pb, path.c_str(), AVIO_FLAG_WRITE));
+
+		// hand every frame to the pipe as soon as it's written instead of holding it in the io buffer
+		if (raw)
+			format_context->flags |= AVFMT_FLAG_FLUSH_PACKETS;
+		CHECK_AV_SUCCESS(avformat_write_header(format_context, nullptr));
+
+		packet = av_packet_alloc();
+	}
+
+	Encoder(const Encoder&) = delete;
+	Encoder& operator=(const Encoder&) = delete;
+
+	~Encoder()
+	{
+		av_packet_free(&packet);
+		avcodec_free_context(&codec_context);
+		if (format_context)
+		{
+			if (!(format_context->oformat->flags & AVFMT_NOFILE))
+				avio_closep(&format_context->pb);
+			avformat_free_context(format_context);
+		}
+	}
+
+private:
+	Encoder(const AVRational time_base) :source_time_base(time_base) {}
+
+public:
+	// a pts relative to the source start, in the time base of the frames sent to encode
+	int64_t frame_pts(const int64_t source_pts) const
+	{
+		return av_rescale_q_rnd(source_pts, source_time_base, codec_context->time_base, AV_ROUND_NEAR_INF);
+	}
+
+	// encodes a frame and writes out any packets that became available, nullptr flushes the encoder
+	void encode(const AVFrame* frame)
+	{
+		CHECK_AV_SUCCESS(avcodec_send_frame(codec_context, frame));
+
+		while (true)
+		{
+			const int res = avcodec_receive_packet(codec_context, packet);
+			if (res == AVERROR(EAGAIN) || res == AVERROR_EOF) break;
+			CHECK_AV_SUCCESS(res);
+
+			av_packet_rescale_ts(packet, codec_context->time_base, stream->time_base);
+			packet->stream_index = stream->index;
+			CHECK_AV_SUCCESS(av_interleaved_write_frame(format_context, packet));
+		}
+	}
+
+	void finish()
+	{
+		encode(nullptr);
+		CHECK_AV_SUCCESS(av_write_trailer(format_context));
+	}
+};
+
+struct RenditionState
+{
+	Rendition rendition;
+	unique_ptr<Encoder> encoder;
+	AVFrame* frame{};						// the scaled frame, reused for every source frame
+	SwsContext* sws_context{};
+	int source_rendition = -1;				// the larger rendition of the same track this one is scaled from, or -1 to scale from the crop
+
+	int gpu_target = -1;
+	AVFrame* gpu_frame{};					// the gpu read back, if it's not already in the encoder pixel format
+
+	RenditionState(const Rendition& rendition, unique_ptr<Encoder> _encoder)
+		:rendition(rendition), encoder(move(_encoder))
+	{
+		frame = av_frame_alloc();
+		frame->width = rendition.size.x;
+		frame->height = rendition.size.y;
+		frame->format = encoder->codec_context->pix_fmt;
+		CHECK_AV_SUCCESS(av_frame_get_buffer(frame, 32));
+	}
+
+	RenditionState(const RenditionState&) = delete;
+	RenditionState& operator=(const RenditionState&) = delete;
+
+	~RenditionState()
+	{
+		av_frame_free(&frame);
+		av_frame_free(&gpu_frame);
+		sws_freeContext(sws_context);
+	}
+};
+
+struct TrackState
+{
+	const CropTrack* track;
+	KeyFrameCursor keyframe_cursor;
+	vector<unique_ptr<RenditionState>> renditions;			// sorted by decreasing size, so every rendition comes after its scaling source
+
+	// the boxes of the frames known up front, evaluated in one batch and walked in step with the decoded frames
+	vector<int64_t> box_pts;
+	CropBoxes boxes;
+	size_t next_box{};
+
+	// the frames off that list, if any, are looked up through the cursor
+	box2 box_at(const int64_t pts)
+	{
+		while (next_box < box_pts.size() && box_pts[next_box] < pts) ++next_box;
+		if (next_box < box_pts.size() && box_pts[next_box] == pts) return boxes[next_box++];
+		return track->keyframes.at(pts, keyframe_cursor);
+	}
+};
+
+struct ExporterImpl
+{
+	Decoder decoder;
+	ExportSettings settings;
+	vector<TrackState> tracks;
+
+	unique_ptr<HeadlessContext> headless_context;
+	unique_ptr<GpuScaler> gpu_scaler;
+
+	int64_t range_from_pts = INT64_MIN, range_to_pts = INT64_MAX;
+
+	ExporterImpl(const char* url, ExportSettings settings) :decoder(url, settings.decoder_thread_count), settings(move(settings))
+	{
+		if (this->settings.backend != ExportBackend::Cpu)
+		{
+			CHECK_SUCCESS(this->settings.gpu_readback_ring_size >= 1, "The gpu readback ring needs at least one frame.");
+			headless_context = make_unique<HeadlessContext>();
+			gpu_scaler = make_unique<GpuScaler>(decoder.frame_size(), decoder.pixel_format(),
+				this->settings.backend == ExportBackend::GpuYuv ? GpuScalerOutput::Yuv : GpuScalerOutput::Rgb,
+				decoder.colorspace_is_bt709(), this->settings.gpu_readback_ring_size);
+		}
+	}
+};
+
+// converts a normalized crop box to a pixel box inside the frame, aligned to the chroma subsampling of the pixel format
+ibox2 crop_pixel_box(const box2& normalized_box, const ivec2& frame_size, const AVPixelFormat pixel_format)
+{
+	const auto desc = av_pix_fmt_desc_get(pixel_format);
+	const ivec2 alignment{ 1 << desc->log2_chroma_w, 1 << desc->log2_chroma_h };
+
+	ivec2 v0 = clamp(ivec2(vec2(frame_size) * min(normalized_box.v0, normalized_box.v1)), ivec2(0), frame_size - alignment);
+	ivec2 v1 = clamp(ivec2(vec2(frame_size) * max(normalized_box.v0, normalized_box.v1)), v0 + alignment, frame_size);
+	v0 -= v0 % alignment;
+	v1 -= (v1 - v0) % alignment;
+
+	return { v0, v1 };
+}
+
+// points the plane pointers at the top left corner of the crop box, the line sizes stay those of the full frame
+void crop_frame_planes(const AVFrame* frame, const ibox2& crop_box, const uint8_t* crop_data[4])
+{
+	const auto desc = av_pix_fmt_desc_get(static_cast<AVPixelFormat>(frame->format));
+	int max_pixel_steps[4]{};
+	av_image_fill_max_pixsteps(max_pixel_steps, nullptr, desc);
+
+	for (int plane = 0; plane < 4; ++plane)
+	{
+		if (!frame->data[plane])
+		{
+			crop_data[plane] = nullptr;
+			continue;
+		}
+
+		const bool chroma = plane == 1 || plane == 2;
+		const int x = chroma ? crop_box.v0.x >> desc->log2_chroma_w : crop_box.v0.x;
+		const int y = chroma ? crop_box.v0.y >> desc->log2_chroma_h : crop_box.v0.y;
+		crop_data[plane] = frame->data[plane] + static_cast<ptrdiff_t>(y) * frame->linesize[plane] + x * max_pixel_steps[plane];
+	}
+}
+
+void scale_into(SwsContext*& sws_context, const uint8_t* const source_data[4], const int source_linesize[4], const ivec2& source_size,
+	const AVPixelFormat source_pixel_format, AVFrame* destination)
+{
+	// the context is only rebuilt when the crop size changes, ie while zooming between key frames
+	sws_context = sws_getCachedContext(sws_context, source_size.x, source_size.y, source_pixel_format,
+		destination->width, destination->height, static_cast<AVPixelFormat>(destination->format), SWS_BICUBIC, nullptr, nullptr, nullptr);
+	CHECK_SUCCESS(sws_context, "Could not create the scaling context.");
+
+	// the encoder might still hold a reference to the previous frame
+	CHECK_AV_SUCCESS(av_frame_make_writable(destination));
+	sws_scale(sws_context, source_data, source_linesize, 0, source_size.y, destination->data, destination->linesize);
+}
+
+// encodes the oldest gpu read back of a rendition, blocking until the gpu is done with it
+void encode_gpu_readback(GpuScaler& gpu_scaler, RenditionState& state)
+{
+	const auto destination = state.gpu_frame ? state.gpu_frame : state.frame;
+	CHECK_AV_SUCCESS(av_frame_make_writable(destination));
+
+	const auto pts = gpu_scaler.read(state.gpu_target, destination);
+	if (!pts) return;
+
+	if (state.gpu_frame)
+		scale_into(state.sws_context, state.gpu_frame->data, state.gpu_frame->linesize, state.rendition.size,
+			static_cast<AVPixelFormat>(state.gpu_frame->format), state.frame);
+
+	state.frame->pts = state.encoder->frame_pts(*pts);
+	state.encoder->encode(state.frame);
+}
+
+bool same_aspect_ratio(const ivec2& a, const ivec2& b)
+{
+	const float ar_a = static_cast<float>(a.x) / a.y, ar_b = static_cast<float>(b.x) / b.y;
+	return abs(ar_a - ar_b) < ar_a * .01f;
+}
+
+// decodes the source once and fans every frame out to all the crop tracks and their renditions
+export class Exporter
+{
+	unique_ptr<ExporterImpl> impl;
+
+public:
+	Exporter(const char* url, ExportSettings settings = {}) :impl(make_unique<ExporterImpl>(url, move(settings))) {}
+
+	ivec2 frame_size() const { return impl->decoder.frame_size(); }
+
+	// limits the export to the source frames in [from_pts, to_pts), in stream pts, from_pts should be a key frame
+	void set_range(const int64_t from_pts, const int64_t to_pts)
+	{
+		impl->range_from_pts = from_pts;
+		impl->range_to_pts = to_pts;
+	}
+
+	// frame_pts are the increasing pts of the frames the run will export, when the caller knows them (from an index of the
+	// packets), the boxes for those are evaluated in one batch rather than looked up frame by frame
+	void add_output(const ExportOutput& output, const span<const int64_t> frame_pts = {})
+	{
+		auto renditions = output.renditions;
+		sort(renditions.begin(), renditions.end(), [](const auto& a, const auto& b) { return a.size.x * a.size.y > b.size.x * b.size.y; });
+
+		auto& track = impl->tracks.emplace_back(TrackState{ output.track });
+		if (!frame_pts.empty())
+		{
+			track.box_pts.assign(frame_pts.begin(), frame_pts.end());
+			output.track->keyframes.evaluate(frame_pts, track.boxes);
+		}
+		for (const auto& rendition : renditions)
+		{
+			auto& state = *track.renditions.emplace_back(make_unique<RenditionState>(rendition,
+				make_unique<Encoder>(rendition, impl->decoder.time_base(), impl->decoder.frame_rate(), impl->settings)));
+
+			// the gpu scales every rendition straight from the mip mapped source
+			if (impl->gpu_scaler)
+			{
+				state.gpu_target = impl->gpu_scaler->add_target(rendition.size);
+				if (impl->gpu_scaler->output_pixel_format() != state.encoder->codec_context->pix_fmt)
+				{
+					state.gpu_frame = av_frame_alloc();
+					state.gpu_frame->width = rendition.size.x;
+					state.gpu_frame->height = rendition.size.y;
+					state.gpu_frame->format = impl->gpu_scaler->output_pixel_format();
+					CHECK_AV_SUCCESS(av_frame_get_buffer(state.gpu_frame, 32));
+				}
+				continue;
+			}
+
+			// share the scaling pyramid: scale from the smallest larger rendition with the same aspect ratio instead of the full crop
+			for (int index = static_cast<int>(track.renditions.size()) - 2; index >= 0; --index)
+			{
+				const auto& source_size = track.renditions[index]->rendition.size;
+				if (source_size.x >= rendition.size.x && source_size.y >= rendition.size.y && same_aspect_ratio(source_size, rendition.size))
+				{
+					state.source_rendition = index;
+					break;
+				}
+			}
+		}
+	}
+
+	// runs the export, returns the number of source frames processed, the outputs are finished and dropped after it so the
+	// same exporter, and the source it has open, can run again on another range with other outputs
+	int64_t run(const function<void(double)>& progress = {})
+	{
+		auto& decoder = impl->decoder;
+		const auto frame_size = decoder.frame_size();
+		const auto start_pts = decoder.start_pts(), duration_pts = decoder.duration_pts();
+
+		if (impl->range_from_pts != INT64_MIN)
+			decoder.seek_pts(impl->range_from_pts);
+
+		int64_t frames{};
+		while (const auto frame = decoder.next_frame())
+		{
+			const auto pts = frame->best_effort_timestamp;
+			if (pts < impl->range_from_pts) continue;
+			if (pts >= impl->range_to_pts) break;
+			const auto pixel_format = static_cast<AVPixelFormat>(frame->format);
+
+			if (impl->gpu_scaler)
+			{
+				auto& gpu_scaler = *impl->gpu_scaler;
+				gpu_scaler.upload(frame);
+
+				for (auto& track : impl->tracks)
+				{
+					// the same ordered, clamped and aligned box the cpu path crops to, so both backends agree
+					const auto pixel_box = crop_pixel_box(track.box_at(pts), frame_size, pixel_format);
+					const box2 crop_box{ vec2(pixel_box.v0) / vec2(frame_size), vec2(pixel_box.v1) / vec2(frame_size) };
+					for (auto& state : track.renditions)
+					{
+						if (gpu_scaler.full(state->gpu_target))
+							encode_gpu_readback(gpu_scaler, *state);
+						gpu_scaler.render(state->gpu_target, crop_box, pts - start_pts);
+					}
+				}
+			}
+			else for (auto& track : impl->tracks)
+			{
+				const auto crop_box = crop_pixel_box(track.box_at(pts), frame_size, pixel_format);
+				const uint8_t* crop_data[4];
+				crop_frame_planes(frame, crop_box, crop_data);
+
+				for (auto& state : track.renditions)
+				{
+					if (state->source_rendition < 0)
+						scale_into(state->sws_context, crop_data, frame->linesize, crop_box.v1 - crop_box.v0, pixel_format, state->frame);
+					else
+					{
+						const auto source = track.renditions[state->source_rendition]->frame;
+						scale_into(state->sws_context, source->data, source->linesize, { source->width, source->height },
+							static_cast<AVPixelFormat>(source->format), state->frame);
+					}
+
+					state->frame->pts = state->encoder->frame_pts(pts - start_pts);
+					state->encoder->encode(state->frame);
+				}
+			}
+
+			++frames;
+			if (progress && duration_pts > 0)
+				progress(static_cast<double>(pts - start_pts) / duration_pts);
+		}
+
+		for (auto& track : impl->tracks)
+			for (auto& state : track.renditions)
+			{
+				if (impl->gpu_scaler)
+					while (impl->gpu_scaler->pending(state->gpu_target))
+						encode_gpu_readback(*impl->gpu_scaler, *state);
+				state->encoder->finish();
+			}
+		impl->tracks.clear();
+		if (impl->gpu_scaler) impl->gpu_scaler->clear_targets();
+
+		return frames;
+	}
+};
@@ -14,11 +14,12 @@
 #include <mutex>
 #include <string>
 #include <array>
+#include <chrono>
 
 extern "C"
 {
-#include <gl/glew.h>
-#include <glfw/glfw3.h>
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
 }
 #pragma comment(lib, "opengl32")
 
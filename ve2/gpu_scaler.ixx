@@ -0,0 +1,336 @@
+module;
+
+#include "libav.h"
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <memory>
+#include <vector>
+#include <string>
+#include <array>
+#include <optional>
+#include <cmath>
+#include <stdexcept>
+
+export module gpu_scaler;
+
+import shader_program;
+import utilities;
+
+using namespace std;
+using namespace glm;
+
+#define CHECK_SUCCESS(cmd, errormsg) if(!(cmd)) { throw runtime_error(errormsg); }
+
+export enum class GpuScalerOutput { Yuv, Rgb };
+
+struct ReadbackSlot
+{
+	GLuint pixel_buffer_name{};
+	GLsync fence{};
+	int64_t pts{};
+};
+
+struct GpuScalerTarget
+{
+	ivec2 size;
+	int planes_count;
+	array<ivec2, 3> plane_sizes{};
+	size_t frame_bytes{};
+	array<GLuint, 3> texture_names{}, framebuffer_names{};
+
+	// the read back ring, the pixel buffers are filled asynchronously and only mapped once their fence signals
+	vector<ReadbackSlot> ring;
+	size_t next_slot{}, pending{};
+};
+
+struct GpuScalerImpl
+{
+	GpuScalerOutput output;
+	ivec2 source_size, source_chroma_shift;
+	array<GLuint, 3> source_texture_names{};
+	GLuint empty_vertex_array_name{};
+	unique_ptr<ShaderProgram> plane_shader_program, rgb_shader_program;
+	size_t ring_size;
+	vector<GpuScalerTarget> targets;
+};
+
+// a full screen triangle generated from the vertex index, the uv origin is the first row of the crop which ends up
+// as the first row read back, so no flip is needed
+const char* const full_screen_vertex_shader_source = "\
+	#version 450 core \n\
+	out vec2 fs_uv; \n\
+	\n\
+	void main() \n\
+	{ \n\
+		const vec2 position = vec2((gl_VertexID & 1) * 4 - 1, (gl_VertexID & 2) * 2 - 1); \n\
+		fs_uv = (position + 1) / 2; \n\
+		gl_Position = vec4(position, 0, 1); \n\
+	}";
+
+// crops and scales the planes of the source texture to the current target in one or more draw calls on the gpu, and
+// reads the results back through a ring of pixel buffer objects without stalling the pipeline
+export class GpuScaler
+{
+	unique_ptr<GpuScalerImpl> impl{ make_unique<GpuScalerImpl>() };
+
+public:
+	GpuScaler(const ivec2& source_size, const AVPixelFormat source_pixel_format, const GpuScalerOutput output, const bool colorspace_is_bt709,
+		const size_t ring_size = 3)
+	{
+		const auto desc = av_pix_fmt_desc_get(source_pixel_format);
+		CHECK_SUCCESS((desc->flags & AV_PIX_FMT_FLAG_PLANAR) && desc->nb_components >= 3 && desc->comp[0].depth == 8,
+			"GPU export only supports 8-bit planar YUV sources.");
+
+		impl->output = output;
+		impl->source_size = source_size;
+		impl->source_chroma_shift = { desc->log2_chroma_w, desc->log2_chroma_h };
+		impl->ring_size = ring_size;
+
+		// the source planes are mip mapped so downscaling by large factors doesn't alias
+		glCreateTextures(GL_TEXTURE_2D, static_cast<GLsizei>(impl->source_texture_names.size()), impl->source_texture_names.data());
+		for (int plane = 0; plane < 3; ++plane)
+		{
+			const auto plane_size = source_plane_size(plane);
+			const auto levels = 1 + static_cast<int>(log2(static_cast<float>(std::max(plane_size.x, plane_size.y))));
+
+			const auto texture_name = impl->source_texture_names[plane];
+			glTextureParameteri(texture_name, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+			glTextureParameteri(texture_name, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			glTextureParameteri(texture_name, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTextureParameteri(texture_name, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+			glTextureStorage2D(texture_name, levels, GL_R8, plane_size.x, plane_size.y);
+		}
+
+		// the core profile needs a bound vertex array even if the vertices are generated
+		glCreateVertexArrays(1, &impl->empty_vertex_array_name);
+
+		impl->plane_shader_program = link_shader_program_from_shader_objects(
+			{
+				compile_shader_from_source(full_screen_vertex_shader_source, ShaderType::Vertex),
+				compile_shader_from_source("\
+					#version 450 core \n\
+					uniform sampler2D plane_texture; \n\
+					uniform vec4 crop_box; \n\
+					in vec2 fs_uv; \n\
+					out vec4 color; \n\
+					\n\
+					void main() \n\
+					{ \n\
+						color = vec4(texture(plane_texture, mix(crop_box.xy, crop_box.zw, fs_uv)).r); \n\
+					}", ShaderType::Fragment)
+			});
+		CHECK_SUCCESS(impl->plane_shader_program, "Could not link the plane scaling shader program.");
+		glProgramUniform1i(impl->plane_shader_program->program_name, impl->plane_shader_program->uniform_locations["plane_texture"], 0);
+
+		const string yuv_rgb_color_transform_matrix = colorspace_is_bt709
+			? "1, 1, 1, 0, -0.21482, 2.12798, 1.28033, -0.38059, 0"
+			: "1, 1, 1, 0, -0.39465, 2.03211, 1.13983, -0.58060, 0";
+		impl->rgb_shader_program = link_shader_program_from_shader_objects(
+			{
+				compile_shader_from_source(full_screen_vertex_shader_source, ShaderType::Vertex),
+				compile_shader_from_source(("\
+					#version 450 core \n\
+					uniform sampler2D y_texture, u_texture, v_texture; \n\
+					uniform vec4 crop_box; \n\
+					in vec2 fs_uv; \n\
+					out vec4 color; \n\
+					\n\
+					void main() \n\
+					{ \n\
+						const vec2 uv = mix(crop_box.xy, crop_box.zw, fs_uv); \n\
+						vec3 yuv; \n\
+						yuv.x = texture(y_texture, uv).r; \n\
+						yuv.y = texture(u_texture, uv).r - 0.5; \n\
+						yuv.z = texture(v_texture, uv).r - 0.5; \n\
+						color = vec4(mat3(" + yuv_rgb_color_transform_matrix + ") * yuv, 1); \n\
+					}").c_str(), ShaderType::Fragment)
+			});
+		CHECK_SUCCESS(impl->rgb_shader_program, "Could not link the rgb scaling shader program.");
+		glProgramUniform1i(impl->rgb_shader_program->program_name, impl->rgb_shader_program->uniform_locations["y_texture"], 0);
+		glProgramUniform1i(impl->rgb_shader_program->program_name, impl->rgb_shader_program->uniform_locations["u_texture"], 1);
+		glProgramUniform1i(impl->rgb_shader_program->program_name, impl->rgb_shader_program->uniform_locations["v_texture"], 2);
+
+		glPixelStorei(GL_PACK_ALIGNMENT, 1);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	}
+
+	GpuScaler(const GpuScaler&) = delete;
+	GpuScaler& operator=(const GpuScaler&) = delete;
+
+	~GpuScaler()
+	{
+		clear_targets();
+
+		glDeleteVertexArrays(1, &impl->empty_vertex_array_name);
+		glDeleteTextures(static_cast<GLsizei>(impl->source_texture_names.size()), impl->source_texture_names.data());
+	}
+
+	// the pixel format of the frames read back
+	AVPixelFormat output_pixel_format() const { return impl->output == GpuScalerOutput::Yuv ? AV_PIX_FMT_YUV420P : AV_PIX_FMT_RGBA; }
+
+	// adds an output size, returns the target index
+	int add_target(const ivec2& size)
+	{
+		auto& target = impl->targets.emplace_back();
+		target.size = size;
+
+		GLenum internal_format;
+		if (impl->output == GpuScalerOutput::Yuv)
+		{
+			target.planes_count = 3;
+			target.plane_sizes = { size, size / 2, size / 2 };
+			internal_format = GL_R8;
+			for (const auto& plane_size : target.plane_sizes)
+				target.frame_bytes += static_cast<size_t>(plane_size.x) * plane_size.y;
+		}
+		else
+		{
+			target.planes_count = 1;
+			target.plane_sizes[0] = size;
+			internal_format = GL_RGBA8;
+			target.frame_bytes = static_cast<size_t>(size.x) * size.y * 4;
+		}
+
+		glCreateTextures(GL_TEXTURE_2D, target.planes_count, target.texture_names.data());
+		glCreateFramebuffers(target.planes_count, target.framebuffer_names.data());
+		for (int plane = 0; plane < target.planes_count; ++plane)
+		{
+			glTextureStorage2D(target.texture_names[plane], 1, internal_format, target.plane_sizes[plane].x, target.plane_sizes[plane].y);
+			glNamedFramebufferTexture(target.framebuffer_names[plane], GL_COLOR_ATTACHMENT0, target.texture_names[plane], 0);
+			CHECK_SUCCESS(glCheckNamedFramebufferStatus(target.framebuffer_names[plane], GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE,
+				"Could not create the export framebuffer.");
+		}
+
+		target.ring.resize(impl->ring_size);
+		for (auto& slot : target.ring)
+		{
+			glCreateBuffers(1, &slot.pixel_buffer_name);
+			glNamedBufferStorage(slot.pixel_buffer_name, target.frame_bytes, nullptr, GL_MAP_READ_BIT);
+		}
+
+		return static_cast<int>(impl->targets.size() - 1);
+	}
+
+	// removes every output size, the targets added after this are numbered from 0 again
+	void clear_targets()
+	{
+		for (auto& target : impl->targets)
+		{
+			for (auto& slot : target.ring)
+			{
+				if (slot.fence) glDeleteSync(slot.fence);
+				glDeleteBuffers(1, &slot.pixel_buffer_name);
+			}
+			glDeleteFramebuffers(target.planes_count, target.framebuffer_names.data());
+			glDeleteTextures(target.planes_count, target.texture_names.data());
+		}
+		impl->targets.clear();
+	}
+
+	// uploads the planes of a new source frame, every target renders from it until the next upload
+	void upload(const AVFrame* frame)
+	{
+		for (int plane = 0; plane < 3; ++plane)
+		{
+			const auto plane_size = source_plane_size(plane);
+			glPixelStorei(GL_UNPACK_ROW_LENGTH, frame->linesize[plane]);
+			glTextureSubImage2D(impl->source_texture_names[plane], 0, 0, 0, plane_size.x, plane_size.y, GL_RED, GL_UNSIGNED_BYTE, frame->data[plane]);
+			glGenerateTextureMipmap(impl->source_texture_names[plane]);
+		}
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	}
+
+	// true if every read back slot of the target is in flight, read() has to be called before the next render()
+	bool full(const int target_index) const { const auto& target = impl->targets[target_index]; return target.pending == target.ring.size(); }
+	size_t pending(const int target_index) const { return impl->targets[target_index].pending; }
+
+	// renders the crop of the current source frame into the target and starts reading it back asynchronously
+	void render(const int target_index, const box2& normalized_crop_box, const int64_t pts)
+	{
+		auto& target = impl->targets[target_index];
+		CHECK_SUCCESS(target.pending < target.ring.size(), "GPU read back ring overflow.");
+
+		glBindVertexArray(impl->empty_vertex_array_name);
+		if (impl->output == GpuScalerOutput::Yuv)
+		{
+			impl->plane_shader_program->use();
+			glUniform4f(impl->plane_shader_program->uniform_locations["crop_box"],
+				normalized_crop_box.v0.x, normalized_crop_box.v0.y, normalized_crop_box.v1.x, normalized_crop_box.v1.y);
+
+			for (int plane = 0; plane < 3; ++plane)
+			{
+				glBindFramebuffer(GL_DRAW_FRAMEBUFFER, target.framebuffer_names[plane]);
+				glViewport(0, 0, target.plane_sizes[plane].x, target.plane_sizes[plane].y);
+				glBindTextureUnit(0, impl->source_texture_names[plane]);
+				glDrawArrays(GL_TRIANGLES, 0, 3);
+			}
+		}
+		else
+		{
+			impl->rgb_shader_program->use();
+			glUniform4f(impl->rgb_shader_program->uniform_locations["crop_box"],
+				normalized_crop_box.v0.x, normalized_crop_box.v0.y, normalized_crop_box.v1.x, normalized_crop_box.v1.y);
+
+			glBindFramebuffer(GL_DRAW_FRAMEBUFFER, target.framebuffer_names[0]);
+			glViewport(0, 0, target.size.x, target.size.y);
+			for (int plane = 0; plane < 3; ++plane)
+				glBindTextureUnit(plane, impl->source_texture_names[plane]);
+			glDrawArrays(GL_TRIANGLES, 0, 3);
+		}
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+
+		// queue the read back into the next pixel buffer, this returns immediately
+		auto& slot = target.ring[target.next_slot];
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pixel_buffer_name);
+		size_t offset{};
+		for (int plane = 0; plane < target.planes_count; ++plane)
+		{
+			const auto& plane_size = target.plane_sizes[plane];
+			glBindFramebuffer(GL_READ_FRAMEBUFFER, target.framebuffer_names[plane]);
+			glReadPixels(0, 0, plane_size.x, plane_size.y, target.planes_count == 3 ? GL_RED : GL_RGBA, GL_UNSIGNED_BYTE, reinterpret_cast<void*>(offset));
+			offset += static_cast<size_t>(plane_size.x) * plane_size.y * (target.planes_count == 3 ? 1 : 4);
+		}
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+		slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		slot.pts = pts;
+		target.next_slot = (target.next_slot + 1) % target.ring.size();
+		++target.pending;
+	}
+
+	// copies the oldest frame in flight into destination, waiting for the gpu if it's not done yet, returns its pts
+	optional<int64_t> read(const int target_index, AVFrame* destination)
+	{
+		auto& target = impl->targets[target_index];
+		if (!target.pending) return {};
+
+		auto& slot = target.ring[(target.next_slot + target.ring.size() - target.pending) % target.ring.size()];
+		while (glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1'000'000'000) == GL_TIMEOUT_EXPIRED) {}
+		glDeleteSync(slot.fence);
+		slot.fence = {};
+
+		const auto data = static_cast<const uint8_t*>(glMapNamedBufferRange(slot.pixel_buffer_name, 0, target.frame_bytes, GL_MAP_READ_BIT));
+		CHECK_SUCCESS(data, "Could not map the read back buffer.");
+
+		size_t offset{};
+		for (int plane = 0; plane < target.planes_count; ++plane)
+		{
+			const auto& plane_size = target.plane_sizes[plane];
+			const auto line_bytes = plane_size.x * (target.planes_count == 3 ? 1 : 4);
+			av_image_copy_plane(destination->data[plane], destination->linesize[plane], data + offset, line_bytes, line_bytes, plane_size.y);
+			offset += static_cast<size_t>(line_bytes) * plane_size.y;
+		}
+		glUnmapNamedBuffer(slot.pixel_buffer_name);
+
+		--target.pending;
+		return slot.pts;
+	}
+
+private:
+	ivec2 source_plane_size(const int plane) const
+	{
+		if (!plane) return impl->source_size;
+		return { -((-impl->source_size.x) >> impl->source_chroma_shift.x), -((-impl->source_size.y) >> impl->source_chroma_shift.y) };
+	}
+};
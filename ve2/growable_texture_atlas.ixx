@@ -1,6 +1,6 @@
 module;
 
-#include <gl/glew.h>
+#include <GL/glew.h>
 #include <glm/glm.hpp>
 #include <memory>
 #include <vector>
@@ -1,5 +1,6 @@
 module;
 #include <string>
+#include <string_view>
 #include <memory>
 #include <vector>
 #include <optional>
@@ -8,12 +9,14 @@ module;
 #include <variant>
 #include "sdf_font.h"
 
+#ifdef _MSC_VER
 #include <CppCoreCheck\Warnings.h>
+#endif
 #pragma warning(push)
 #pragma warning(disable : ALL_CPPCORECHECK_WARNINGS)
 #include <glm/glm.hpp>
-#include <gl/glew.h>
-#include <glfw/glfw3.h>
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
 #pragma warning(pop)
 
 export module gui;
@@ -216,6 +219,7 @@ GLFWcursor* load_cursor(const char* path, const vec2& hotspot)
 	return glfwCreateCursor(&image, static_cast<int>(hotspot.x * image.width), static_cast<int>(hotspot.y * image.height));
 }
 
+// the window can be null to build and render the gui offscreen, without input or cursors (benchmarks)
 export int gui_init(GLFWwindow* window, unique_ptr<Font> _font)
 {
 	gui_priv::window = window;
@@ -273,21 +277,24 @@ export int gui_init(GLFWwindow* window, unique_ptr<Font> _font)
 		});
 	glProgramUniform1i(shader_program->program_name, shader_program->uniform_locations["tex"], 0);
 
-	// register a callback to keep the window size updated
-	previous_framebuffer_size_callback = glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
+	if (window)
+	{
+		// register a callback to keep the window size updated
+		previous_framebuffer_size_callback = glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
 
-	// register i/o callbacks
-	previous_cursor_pos_callback = glfwSetCursorPosCallback(window, cursor_pos_callback);
-	previous_mouse_button_callback = glfwSetMouseButtonCallback(window, mouse_button_callback);
+		// register i/o callbacks
+		previous_cursor_pos_callback = glfwSetCursorPosCallback(window, cursor_pos_callback);
+		previous_mouse_button_callback = glfwSetMouseButtonCallback(window, mouse_button_callback);
 
-	int x, y;
-	glfwGetFramebufferSize(window, &x, &y);
-	framebuffer_size = { x, y };
+		int x, y;
+		glfwGetFramebufferSize(window, &x, &y);
+		framebuffer_size = { x, y };
 
-	// load cursors
-	cursor_move = load_cursor("cursor_move.png", { .5f, .5f });
-	cursor_v = load_cursor("cursor_resizenorthsouth.png", { .5f, .5f });
-	cursor_h = load_cursor("cursor_resizeeastwest.png", { .5f, .5f });
+		// load cursors
+		cursor_move = load_cursor("cursor_move.png", { .5f, .5f });
+		cursor_v = load_cursor("cursor_resizenorthsouth.png", { .5f, .5f });
+		cursor_h = load_cursor("cursor_resizeeastwest.png", { .5f, .5f });
+	}
 
 	// cold cache some useful characters
 	font->get_glyph_data(u8"0123456789");
@@ -323,7 +330,8 @@ export int gui_render()
 
 	vertex_cache.clear();
 
-	glfwSetCursor(window, next_cursor);
+	if (window)
+		glfwSetCursor(window, next_cursor);
 	next_cursor = nullptr;
 
 	return 0;
@@ -354,7 +362,8 @@ void quad(const box2& box, const box2& uv, const vec4& color)
 	vertex_cache.emplace_back(vec2(box.v0.x, box.v0.y), uv.v0, color);
 }
 
-export int gui_slider(const box2& box, const double min, const double max, const double val, const function<void(const double)> clicked)
+// draws the slider, returns the clicked position if it was clicked this frame
+optional<double> slider(const box2& box, const double min, const double max, const double val)
 {
 	// the outer rectangle
 	quad(box, uv_no_texture, vec4(0, 1, 0, 1));
@@ -370,17 +379,28 @@ export int gui_slider(const box2& box, const double min, const double max, const
 	// handle a click
 	if (box.contains(mouse_position) && left_mouse && !gui_state.selected_object && !gui_state.left_mouse_handled)
 	{
-		clicked((mouse_position.x - box.v0.x) / (box.v1.x - box.v0.x));
 		gui_state.left_mouse_handled = true;
+		return (mouse_position.x - box.v0.x) / (box.v1.x - box.v0.x);
 	}
 
+	return {};
+}
+
+// the callbacks are template arguments rather than std::function, so building the gui every frame doesn't allocate
+export template<typename TClicked>
+int gui_slider(const box2& box, const double min, const double max, const double val, TClicked&& clicked)
+{
+	if (const auto position = slider(box, min, max, val))
+		clicked(*position);
+
 	return 0;
 }
 
-export int gui_label(const box2& box, const u8string& s, const float scale, const vec4& color)
+export int gui_label(const box2& box, const u8string_view s, const float scale, const vec4& color)
 {
 	float x = box.v0.x;
-	const auto glyphs = font->get_glyph_data(s);
+	const auto& glyphs = font->get_glyph_data(s);
+	if (glyphs.empty()) return 0;
 
 	// find the max bearing
 	auto max_bearing_y = max_element(glyphs.begin(), glyphs.end(), [](auto& x, auto& y) {return x.bearing_y < y.bearing_y; })->bearing_y;
@@ -407,19 +427,23 @@ export int gui_label(const box2& box, const u8string& s, const float scale, cons
 	return 0;
 }
 
-export int gui_label(const box2& box, const u8string& s, const float scale = 1.f) { return gui_label(box, s, scale, color_label_text); }
+export int gui_label(const box2& box, const u8string_view s, const float scale = 1.f) { return gui_label(box, s, scale, color_label_text); }
 
-export int gui_button(const box2& box, const u8string& s, const function<void()>& clicked, const float font_scale = 1.0f)
+bool button_clicked(const box2& box)
 {
-	const auto inside = box.contains(mouse_position);
-	if (inside && left_mouse && !gui_state.selected_object && !gui_state.left_mouse_handled)
+	if (box.contains(mouse_position) && left_mouse && !gui_state.selected_object && !gui_state.left_mouse_handled)
 	{
-		clicked();
 		gui_state.left_mouse_handled = true;
+		return true;
 	}
 
+	return false;
+}
+
+int button(const box2& box, const u8string_view s, const float font_scale)
+{
 	// background
-	quad(box, uv_no_texture, inside ? color_button_face_highlight : color_button_face);
+	quad(box, uv_no_texture, box.contains(mouse_position) ? color_button_face_highlight : color_button_face);
 
 	// text
 	auto ret = gui_label(box.with_offset(-5), s, font_scale, color_button_text);
@@ -428,6 +452,15 @@ export int gui_button(const box2& box, const u8string& s, const function<void()>
 	return 0;
 }
 
+export template<typename TClicked>
+int gui_button(const box2& box, const u8string_view s, TClicked&& clicked, const float font_scale = 1.0f)
+{
+	if (button_clicked(box))
+		clicked();
+
+	return button(box, s, font_scale);
+}
+
 export int gui_selection_box(box2& normalized_box, const box2& full_pixel_box, const bool read_only, const vec4& base_color,
 	const optional<float>& aspect_ratio, const function<void()>& changed, SelectionBoxState& state)
 {
@@ -0,0 +1,90 @@
+module;
+
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+#ifndef _WIN32
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+#include <stdexcept>
+
+export module headless_context;
+
+using namespace std;
+
+#define CHECK_SUCCESS(cmd, errormsg) if(!(cmd)) { throw runtime_error(errormsg); }
+
+// an offscreen OpenGL 4.5 core context for the passes that render without a window (gpu export, benchmarks)
+// on Windows this is a hidden GLFW window, everywhere else it's a surfaceless EGL context, which Mesa's software
+// rasterizer provides on machines without a GPU
+export class HeadlessContext
+{
+#ifdef _WIN32
+	GLFWwindow* window{};
+#else
+	EGLDisplay display{ EGL_NO_DISPLAY };
+	EGLContext context{ EGL_NO_CONTEXT };
+#endif
+
+public:
+	HeadlessContext()
+	{
+#ifdef _WIN32
+		CHECK_SUCCESS(glfwInit(), "Could not initialize GLFW.");
+
+		glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 5);
+		glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+		glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+
+		window = glfwCreateWindow(1, 1, "", nullptr, nullptr);
+		CHECK_SUCCESS(window, "Could not create the headless window.");
+		glfwMakeContextCurrent(window);
+
+		glewExperimental = GL_TRUE;
+		CHECK_SUCCESS(!glewInit(), "Could not initialize GLEW.");
+#else
+		const auto get_platform_display = reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXTPROC>(eglGetProcAddress("eglGetPlatformDisplayEXT"));
+		CHECK_SUCCESS(get_platform_display, "EGL does not support platform displays.");
+		display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+		CHECK_SUCCESS(display != EGL_NO_DISPLAY && eglInitialize(display, nullptr, nullptr), "Could not initialize the surfaceless EGL display.");
+		CHECK_SUCCESS(eglBindAPI(EGL_OPENGL_API), "Could not bind the OpenGL API.");
+
+		const EGLint config_attributes[] = { EGL_SURFACE_TYPE, EGL_PBUFFER_BIT, EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+		EGLConfig config{};
+		EGLint config_count{};
+		CHECK_SUCCESS(eglChooseConfig(display, config_attributes, &config, 1, &config_count) && config_count, "Could not find an EGL config.");
+
+		const EGLint context_attributes[] =
+		{
+			EGL_CONTEXT_MAJOR_VERSION, 4,
+			EGL_CONTEXT_MINOR_VERSION, 5,
+			EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+			EGL_NONE
+		};
+		context = eglCreateContext(display, config, EGL_NO_CONTEXT, context_attributes);
+		CHECK_SUCCESS(context != EGL_NO_CONTEXT, "Could not create the EGL context.");
+		CHECK_SUCCESS(eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context), "Could not make the EGL context current.");
+
+		// glewInit also initializes GLX, which fails without an X display, so only load the GL entry points
+		glewExperimental = GL_TRUE;
+		CHECK_SUCCESS(!glewContextInit(), "Could not initialize GLEW.");
+#endif
+	}
+
+	HeadlessContext(const HeadlessContext&) = delete;
+	HeadlessContext& operator=(const HeadlessContext&) = delete;
+
+	~HeadlessContext()
+	{
+#ifdef _WIN32
+		glfwDestroyWindow(window);
+#else
+		eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+		eglDestroyContext(display, context);
+		eglTerminate(display);
+#endif
+	}
+};
@@ -0,0 +1,223 @@
+module;
+
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <vector>
+#include <fstream>
+#include <functional>
+#include <charconv>
+#include <limits>
+#include <cstdio>
+#include <stdexcept>
+
+#ifdef _MSC_VER
+#include <CppCoreCheck\Warnings.h>
+#endif
+#pragma warning(push)
+#pragma warning(disable : ALL_CPPCORECHECK_WARNINGS)
+#include <GLFW/glfw3.h>
+#pragma warning(pop)
+
+export module input_session;
+
+using namespace std;
+
+#define CHECK_SUCCESS(cmd, errormsg) if(!(cmd)) { throw runtime_error(errormsg); }
+
+constexpr string_view input_recording_header = "ve2-input 1";
+
+// how long an event recorded during playback waits for the replay to reach its frame, past its time, before it's
+// dispatched anyway, so a replay that can't keep up (or ran out of frames) still finishes
+constexpr double replay_media_slack_sec = 1.;
+
+export enum class InputEventType { FramebufferSize, CursorPos, MouseButton, Key };
+
+export struct InputEvent
+{
+	double time_sec{};				// since the start of the recording
+	int64_t media_pts{};			// the last displayed frame when the event came in
+	bool playing{};
+	InputEventType type{};
+	double x{}, y{};				// the cursor position, or the framebuffer size
+	int code{}, scancode{}, action{}, mods{};	// the key or mouse button
+};
+
+// the recorder sits in front of every other callback, so it sees the input exactly as glfw delivered it
+namespace input_recording_priv
+{
+	ofstream file;
+	double start_time_sec;
+	function<pair<int64_t, bool>()> media_position;
+
+	GLFWframebuffersizefun previous_framebuffer_size_callback;
+	GLFWcursorposfun previous_cursor_pos_callback;
+	GLFWmousebuttonfun previous_mouse_button_callback;
+	GLFWkeyfun previous_key_callback;
+}
+
+using namespace input_recording_priv;
+
+void record(InputEvent event)
+{
+	if (!file.is_open()) return;
+
+	event.time_sec = glfwGetTime() - start_time_sec;
+	tie(event.media_pts, event.playing) = media_position();
+
+	char line[256];
+	const auto length = snprintf(line, sizeof(line), "%.6f %lld %d %d %.3f %.3f %d %d %d %d\n", event.time_sec, static_cast<long long>(event.media_pts),
+		event.playing, static_cast<int>(event.type), event.x, event.y, event.code, event.scancode, event.action, event.mods);
+	file.write(line, length);
+}
+
+void recording_framebuffer_size_callback(GLFWwindow* window, int width, int height)
+{
+	record({ .type = InputEventType::FramebufferSize, .x = static_cast<double>(width), .y = static_cast<double>(height) });
+	if (previous_framebuffer_size_callback) previous_framebuffer_size_callback(window, width, height);
+}
+
+void recording_cursor_pos_callback(GLFWwindow* window, double x, double y)
+{
+	record({ .type = InputEventType::CursorPos, .x = x, .y = y });
+	if (previous_cursor_pos_callback) previous_cursor_pos_callback(window, x, y);
+}
+
+void recording_mouse_button_callback(GLFWwindow* window, int button, int action, int mods)
+{
+	record({ .type = InputEventType::MouseButton, .code = button, .action = action, .mods = mods });
+	if (previous_mouse_button_callback) previous_mouse_button_callback(window, button, action, mods);
+}
+
+void recording_key_callback(GLFWwindow* window, int key, int scancode, int action, int mods)
+{
+	record({ .type = InputEventType::Key, .code = key, .scancode = scancode, .action = action, .mods = mods });
+	if (previous_key_callback) previous_key_callback(window, key, scancode, action, mods);
+}
+
+// records the window's input to a file until input_recording_stop, the media position is sampled with every event
+// install it after everything else has registered its callbacks
+export void input_recording_start(GLFWwindow* window, const char* path, function<pair<int64_t, bool>()> media_position)
+{
+	file.open(path, ios::binary);
+	CHECK_SUCCESS(file, "Could not create the input recording.");
+	file << input_recording_header << "\n";
+
+	start_time_sec = glfwGetTime();
+	input_recording_priv::media_position = move(media_position);
+
+	previous_framebuffer_size_callback = glfwSetFramebufferSizeCallback(window, recording_framebuffer_size_callback);
+	previous_cursor_pos_callback = glfwSetCursorPosCallback(window, recording_cursor_pos_callback);
+	previous_mouse_button_callback = glfwSetMouseButtonCallback(window, recording_mouse_button_callback);
+	previous_key_callback = glfwSetKeyCallback(window, recording_key_callback);
+
+	// the replay starts from the same window size
+	int width, height;
+	glfwGetFramebufferSize(window, &width, &height);
+	record({ .type = InputEventType::FramebufferSize, .x = static_cast<double>(width), .y = static_cast<double>(height) });
+}
+
+export void input_recording_stop() { file.close(); }
+
+template<typename T>
+bool parse_field(string_view& line, T& value)
+{
+	while (!line.empty() && line.front() == ' ') line.remove_prefix(1);
+	const auto [end, error] = from_chars(line.data(), line.data() + line.size(), value);
+	if (error != errc()) return false;
+	line.remove_prefix(end - line.data());
+	return true;
+}
+
+// feeds a recording back through the window's callbacks, as if the input came from glfw, each event once its time has
+// come and, if it was recorded during playback, once the replay has displayed its frame as well
+export class InputReplay
+{
+	GLFWwindow* window;
+	vector<InputEvent> events;
+	size_t next_event{};
+	double wake_time_sec{};
+
+	GLFWframebuffersizefun framebuffer_size_callback;
+	GLFWcursorposfun cursor_pos_callback;
+	GLFWmousebuttonfun mouse_button_callback;
+	GLFWkeyfun key_callback;
+
+public:
+	// the callbacks are picked up here, so create it after everything has registered them
+	InputReplay(GLFWwindow* window, const char* path) :window(window)
+	{
+		ifstream file(path, ios::binary);
+		CHECK_SUCCESS(file, "Could not open the input recording.");
+
+		string line;
+		CHECK_SUCCESS(getline(file, line) && line == input_recording_header, "Not an input recording.");
+		while (getline(file, line))
+		{
+			if (line.empty()) continue;
+
+			string_view fields = line;
+			InputEvent event;
+			int playing, type;
+			CHECK_SUCCESS(parse_field(fields, event.time_sec) && parse_field(fields, event.media_pts) && parse_field(fields, playing)
+				&& parse_field(fields, type) && parse_field(fields, event.x) && parse_field(fields, event.y) && parse_field(fields, event.code)
+				&& parse_field(fields, event.scancode) && parse_field(fields, event.action) && parse_field(fields, event.mods),
+				"Invalid input recording event.");
+			event.playing = playing;
+			event.type = static_cast<InputEventType>(type);
+			events.push_back(event);
+		}
+
+		// glfw has no getters for the callbacks, setting returns the current one
+		framebuffer_size_callback = glfwSetFramebufferSizeCallback(window, nullptr);
+		glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
+		cursor_pos_callback = glfwSetCursorPosCallback(window, nullptr);
+		glfwSetCursorPosCallback(window, cursor_pos_callback);
+		mouse_button_callback = glfwSetMouseButtonCallback(window, nullptr);
+		glfwSetMouseButtonCallback(window, mouse_button_callback);
+		key_callback = glfwSetKeyCallback(window, nullptr);
+		glfwSetKeyCallback(window, key_callback);
+
+		wake_time_sec = events.empty() ? 0 : events[0].time_sec;
+	}
+
+	bool finished() const { return next_event == events.size(); }
+
+	// when the next event could become due, the main loop shouldn't sleep past it
+	double next_wake_time_sec() const { return finished() ? numeric_limits<double>::infinity() : wake_time_sec; }
+
+	void dispatch(const double time_sec, const int64_t media_pts, const bool playing)
+	{
+		for (; next_event < events.size(); ++next_event)
+		{
+			const auto& event = events[next_event];
+			if (time_sec < event.time_sec)
+			{
+				wake_time_sec = event.time_sec;
+				return;
+			}
+			if (event.playing && playing && media_pts < event.media_pts && time_sec < event.time_sec + replay_media_slack_sec)
+			{
+				wake_time_sec = event.time_sec + replay_media_slack_sec;
+				return;
+			}
+
+			switch (event.type)
+			{
+			case InputEventType::FramebufferSize:
+				glfwSetWindowSize(window, static_cast<int>(event.x), static_cast<int>(event.y));
+				if (framebuffer_size_callback) framebuffer_size_callback(window, static_cast<int>(event.x), static_cast<int>(event.y));
+				break;
+			case InputEventType::CursorPos:
+				if (cursor_pos_callback) cursor_pos_callback(window, event.x, event.y);
+				break;
+			case InputEventType::MouseButton:
+				if (mouse_button_callback) mouse_button_callback(window, event.code, event.action, event.mods);
+				break;
+			case InputEventType::Key:
+				if (key_callback) key_callback(window, event.code, event.scancode, event.action, event.mods);
+				break;
+			}
+		}
+	}
+};
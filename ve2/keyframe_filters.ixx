@@ -0,0 +1,215 @@
+module;
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+export module keyframe_filters;
+
+import utilities;
+import keyframes;
+import easing;
+
+using namespace std;
+using namespace glm;
+
+export struct SmoothSettings
+{
+	float measurement_noise = .005f;		// how far the boxes jitter around the path, as a fraction of the frame
+	float acceleration_noise = .05f;		// how quickly the path may change its speed, in frames per second squared
+	float margin = .1f;						// how far the path may stray from the boxes, as a fraction of their size
+};
+
+export struct SimplifySettings
+{
+	float tolerance_pixels = 1;
+	bool use_easing = true;					// try the easing presets on a segment before splitting it
+};
+
+// the dense track, flattened for the error scans
+struct DenseTrack
+{
+	vector<int64_t> pts;
+	vector<box2> boxes;
+};
+
+// the largest distance, in pixels along either axis, between any corner of the dense boxes strictly inside the segment and
+// the box interpolated between its ends, and where it is
+pair<float, size_t> segment_error(const DenseTrack& track, const size_t first, const size_t last, const EasingCurve* easing, const vec2& frame_size)
+{
+	const auto& from = track.boxes[first];
+	const auto& to = track.boxes[last];
+	const auto from_pts = track.pts[first];
+	const auto length = static_cast<double>(track.pts[last] - from_pts);
+
+	float max_error{};
+	size_t max_index = first;
+	for (auto index = first + 1; index < last; ++index)
+	{
+		auto progress = static_cast<float>(static_cast<double>(track.pts[index] - from_pts) / length);
+		if (easing) progress = (*easing)(progress);
+
+		const auto& box = track.boxes[index];
+		const auto error0 = abs(mix(from.v0, to.v0, progress) - box.v0) * frame_size;
+		const auto error1 = abs(mix(from.v1, to.v1, progress) - box.v1) * frame_size;
+		const auto error = std::max(std::max(error0.x, error0.y), std::max(error1.x, error1.y));
+		if (error > max_error)
+		{
+			max_error = error;
+			max_index = index;
+		}
+	}
+	return { max_error, max_index };
+}
+
+// ramer-douglas-peucker over the box corners in time: a segment between two kept key frames is accepted once every dense
+// box in between is within the tolerance of the interpolation (linear, or one of the easing presets), otherwise it's
+// split at the box furthest from the linear interpolation
+// the first and last key frames are always kept, the dense track is taken as linear between its own key frames
+export KeyFrames simplify_keyframes(const KeyFrames& dense, const ivec2& frame_size, const SimplifySettings& settings = {})
+{
+	DenseTrack track;
+	for (const auto& [pts, keyframe] : dense)
+	{
+		track.pts.push_back(pts);
+		track.boxes.push_back(keyframe.box);
+	}
+
+	KeyFrames simplified;
+	if (track.pts.size() <= 2)
+	{
+		for (size_t index = 0; index < track.pts.size(); ++index)
+			simplified.append(track.pts[index], { track.boxes[index] });
+		return simplified;
+	}
+
+	const array<EasingCurve, 3> presets{ easing_preset(EasingType::EaseIn), easing_preset(EasingType::EaseOut), easing_preset(EasingType::EaseInOut) };
+
+	// the kept key frames by dense index, with the easing into the next one
+	vector<pair<size_t, const EasingCurve*>> kept;
+	vector<pair<size_t, size_t>> pending{ { 0, track.pts.size() - 1 } };
+	while (!pending.empty())
+	{
+		const auto [first, last] = pending.back();
+		pending.pop_back();
+
+		const auto [linear_error, split_index] = segment_error(track, first, last, nullptr, vec2(frame_size));
+		const EasingCurve* accepted_easing{};
+		auto accepted = linear_error <= settings.tolerance_pixels;
+		if (!accepted && settings.use_easing)
+			for (const auto& preset : presets)
+				if (segment_error(track, first, last, &preset, vec2(frame_size)).first <= settings.tolerance_pixels)
+				{
+					accepted = true;
+					accepted_easing = &preset;
+					break;
+				}
+
+		if (accepted)
+			kept.emplace_back(first, accepted_easing);
+		else
+		{
+			// the later half goes first, so the earlier one is popped next
+			pending.emplace_back(split_index, last);
+			pending.emplace_back(first, split_index);
+		}
+	}
+
+	// the segments were accepted in order, so the kept key frames come out sorted
+	for (const auto& [index, easing] : kept)
+		simplified.append(track.pts[index], { track.boxes[index], easing ? *easing : EasingCurve() });
+	simplified.append(track.pts.back(), { track.boxes.back() });
+	return simplified;
+}
+
+// the fixed interval smoothing of one coordinate of the boxes, as a constant velocity kalman filter run forward and
+// rauch-tung-striebel back over it, the time between samples is free so sparse hand placed key frames work as well as
+// dense tracked ones, replaces the samples with the smoothed positions
+export void smooth_channel(const vector<double>& times, vector<double>& values, const double process_noise, const double measurement_noise)
+{
+	const auto count = values.size();
+	vector<dvec2> predicted_states(count), states(count);
+	vector<dmat2> predicted_covariances(count), covariances(count);
+
+	// the state is the position and its speed, unknown speed at first
+	states[0] = { values[0], 0 };
+	covariances[0] = dmat2(measurement_noise, 0, 0, 1e6);
+	predicted_states[0] = states[0];
+	predicted_covariances[0] = covariances[0];
+
+	for (size_t index = 1; index < count; ++index)
+	{
+		const auto dt = times[index] - times[index - 1];
+		const dmat2 transition(1, 0, dt, 1);
+		const dmat2 noise = process_noise * dmat2(dt * dt * dt / 3, dt * dt / 2, dt * dt / 2, dt);
+
+		const auto predicted_state = transition * states[index - 1];
+		const auto predicted_covariance = transition * covariances[index - 1] * transpose(transition) + noise;
+
+		// the boxes only measure the position
+		const auto gain = dvec2(predicted_covariance[0][0], predicted_covariance[0][1]) / (predicted_covariance[0][0] + measurement_noise);
+		states[index] = predicted_state + gain * (values[index] - predicted_state.x);
+		covariances[index] = (dmat2(1) - dmat2(gain.x, gain.y, 0, 0)) * predicted_covariance;
+
+		predicted_states[index] = predicted_state;
+		predicted_covariances[index] = predicted_covariance;
+	}
+
+	values[count - 1] = states[count - 1].x;
+	auto smoothed_state = states[count - 1];
+	for (auto index = count - 1; index-- > 0;)
+	{
+		const auto dt = times[index + 1] - times[index];
+		const dmat2 transition(1, 0, dt, 1);
+		const auto smoother_gain = covariances[index] * transpose(transition) * inverse(predicted_covariances[index + 1]);
+		smoothed_state = states[index] + smoother_gain * (smoothed_state - predicted_states[index + 1]);
+		values[index] = smoothed_state.x;
+	}
+}
+
+// a steadier path for the virtual camera through the track's boxes, at the same pts: the centers and the heights are
+// smoothed, the widths follow at the track's aspect ratio, then the path is pulled back to within the margin of the boxes
+// and the boxes into the frame, time_base is the seconds per pts
+export KeyFrames smooth_keyframes(const KeyFrames& track, const double time_base, const SmoothSettings& settings = {})
+{
+	vector<int64_t> pts;
+	vector<double> times, center_x, center_y, height;
+	vector<const KeyFrame*> keyframes;
+	for (const auto& [keyframe_pts, keyframe] : track)
+	{
+		const auto& box = keyframe.box;
+		pts.push_back(keyframe_pts);
+		keyframes.push_back(&keyframe);
+		times.push_back(keyframe_pts * time_base);
+		center_x.push_back((box.v0.x + box.v1.x) * .5);
+		center_y.push_back((box.v0.y + box.v1.y) * .5);
+		height.push_back(abs(box.v1.y - box.v0.y));
+	}
+	if (pts.size() < 3) return track;
+
+	const auto process_noise = static_cast<double>(settings.acceleration_noise) * settings.acceleration_noise;
+	const auto measurement_noise = static_cast<double>(settings.measurement_noise) * settings.measurement_noise;
+	smooth_channel(times, center_x, process_noise, measurement_noise);
+	smooth_channel(times, center_y, process_noise, measurement_noise);
+	smooth_channel(times, height, process_noise, measurement_noise);
+
+	KeyFrames smoothed;
+	const auto aspect_ratio = static_cast<double>(*track.aspect_ratio());
+	for (size_t index = 0; index < pts.size(); ++index)
+	{
+		const auto& box = keyframes[index]->box;
+		const dvec2 original_center = dvec2(box.v0 + box.v1) * .5;
+		const dvec2 original_size = abs(dvec2(box.v1 - box.v0));
+
+		const auto size = glm::min(dvec2(height[index] * aspect_ratio, height[index]), dvec2(1));
+		const auto margin = original_size * static_cast<double>(settings.margin);
+		auto center = glm::clamp(dvec2(center_x[index], center_y[index]), original_center - margin, original_center + margin);
+		center = glm::clamp(center, size * .5, dvec2(1) - size * .5);
+
+		smoothed.append(pts[index], { { vec2(center - size * .5), vec2(center + size * .5) }, keyframes[index]->easing });
+	}
+	return smoothed;
+}
@@ -1,96 +1,259 @@
 module;
 
+#include <map>
 #include <vector>
+#include <span>
 #include <algorithm>
+#include <atomic>
 #include <optional>
+#include <string>
+#include <cstdint>
 
 export module keyframes;
 
 import utilities;
+import easing;
 
 using namespace std;
 using namespace glm;
 
+const box2 default_box{ {}, {1, 1} };
+
+// the batch evaluation eases the progress of this many frames at a time, in a buffer on the stack
+constexpr size_t evaluate_chunk_frames = 256;
+
+// unique across every track, so a cursor can't mistake another track (or this one after it moved) for the one it was
+// made on
+atomic<uint64_t> next_revision{ 1 };
+
+// a key frame's box, and how the box moves from it to the next key frame's
 export struct KeyFrame
 {
-	double frame_time{};
-	box2 box{};
+	box2 box;
+	EasingCurve easing;
+};
 
-	KeyFrame(double frame_time, const box2& box) :frame_time(frame_time), box(box) {}
+// remembers where the last lookup landed, so callers asking for increasing pts (playback, export) step forward from there
+// instead of searching again, keep one per reader
+export struct KeyFrameCursor
+{
+	uint64_t revision{};
+	map<int64_t, KeyFrame>::const_iterator next;
 };
 
-const box2 default_box{ {}, {1, 1} };
+// the crop boxes of a run of frames as a structure of arrays, one entry per frame, so filling them vectorizes
+export struct CropBoxes
+{
+	vector<float> x0, y0, x1, y1;
 
+	size_t size() const { return x0.size(); }
+	box2 operator[](const size_t index) const { return { { x0[index], y0[index] }, { x1[index], y1[index] } }; }
+
+	void resize(const size_t count)
+	{
+		x0.resize(count);
+		y0.resize(count);
+		x1.resize(count);
+		y1.resize(count);
+	}
+};
+
+// crop boxes keyed by the exact pts of the source's video stream, interpolated along each key frame's easing in between,
+// lookups, inserts and removals are all logarithmic
 export struct KeyFrames
 {
-	box2 at(double frame_time)
-	{
-		if (keyframes.empty()) return default_box;
+	KeyFrames() = default;
+	KeyFrames(const KeyFrames& other) :keyframes(other.keyframes) {}
+	KeyFrames(KeyFrames&& other) noexcept :keyframes(move(other.keyframes)) { other.revision = next_revision++; }
+	KeyFrames& operator=(const KeyFrames& other) { keyframes = other.keyframes; revision = next_revision++; return *this; }
+	KeyFrames& operator=(KeyFrames&& other) noexcept { keyframes = move(other.keyframes); revision = next_revision++; other.revision = next_revision++; return *this; }
 
-		auto last_box = &default_box;
-		double last_box_frame_time = 0;
-		for (const auto& keyframe : keyframes)
+	box2 at(const int64_t pts) const { return box_between(keyframes.upper_bound(pts), pts); }
+
+	// the same, in constant time while the pts only moves forward by a key frame or less between calls
+	box2 at(const int64_t pts, KeyFrameCursor& cursor) const
+	{
+		auto next = keyframes.end();
+		if (cursor.revision == revision)
 		{
-			if (keyframe.frame_time == frame_time)
-				return keyframe.box;
+			next = cursor.next;
+			if (next != keyframes.end() && next->first <= pts) ++next;
+			if (!is_next(next, pts)) next = keyframes.upper_bound(pts);
+		}
+		else
+			next = keyframes.upper_bound(pts);
 
-			if (keyframe.frame_time > frame_time)
-				if (last_box_frame_time == frame_time)
-					return *last_box;
-				else
-					return mix(*last_box, keyframe.box, static_cast<float>((frame_time - last_box_frame_time) / (keyframe.frame_time - last_box_frame_time)));
+		cursor = { revision, next };
+		return box_between(next, pts);
+	}
 
-			last_box = &keyframe.box;
-			last_box_frame_time = keyframe.frame_time;
+	// the same as at() for every pts, which have to be increasing, in one sweep: a search per key frame segment, then a few
+	// multiply-adds per frame
+	void evaluate(const span<const int64_t> pts, CropBoxes& boxes) const
+	{
+		boxes.resize(pts.size());
+		if (keyframes.empty())
+		{
+			fill_boxes(boxes, 0, pts.size(), default_box);
+			return;
 		}
 
-		return *last_box;
+		for (size_t index{}; index < pts.size();)
+		{
+			const auto next = keyframes.upper_bound(pts[index]);
+			if (next == keyframes.begin())
+			{
+				// before the first key frame it holds
+				const auto end = static_cast<size_t>(lower_bound(pts.begin() + index, pts.end(), next->first) - pts.begin());
+				fill_boxes(boxes, index, end, next->second.box);
+				index = end;
+				continue;
+			}
+			if (next == keyframes.end())
+			{
+				fill_boxes(boxes, index, pts.size(), prev(next)->second.box);
+				return;
+			}
+
+			const auto end = static_cast<size_t>(lower_bound(pts.begin() + index, pts.end(), next->first) - pts.begin());
+			interpolate_boxes(pts, index, end, *prev(next), *next, boxes);
+			index = end;
+		}
 	}
 
 	optional<float> aspect_ratio() const
 	{
 		if (keyframes.empty()) return {};
-		const auto& first_box_size = keyframes[0].box.size();
+		const auto& first_box_size = keyframes.begin()->second.box.size();
 		return first_box_size.x / first_box_size.y;
 	}
 
-	bool contains(const double frame_time) const { return find_if(keyframes.begin(), keyframes.end(), [&](const auto& kf) {return kf.frame_time == frame_time; }) != keyframes.end(); }
+	// the box the track starts with, it holds until the first key frame
+	box2 first() const { return keyframes.empty() ? default_box : keyframes.begin()->second.box; }
 
-	bool is_first(const double frame_time) const { return !keyframes.empty() && keyframes[0].frame_time == frame_time; }
+	bool contains(const int64_t pts) const { return keyframes.contains(pts); }
 
-	bool add(const double frame_time, const box2& box)
-	{
-		const auto next_it = find_if(keyframes.begin(), keyframes.end(), [&](const auto& kf) {return kf.frame_time >= frame_time; });
+	bool is_first(const int64_t pts) const { return !keyframes.empty() && keyframes.begin()->first == pts; }
 
-		if (next_it == keyframes.end())
-		{
-			// nothing past the frame index we want, but is the last frame index the one we need to add?
-			if (!keyframes.empty() && keyframes.back().frame_time == frame_time)
-			{
-				keyframes.back().box = box;
-				return false;
-			}
+	// returns whether a new key frame was added, rather than an existing one moved, which keeps its easing
+	bool add(const int64_t pts, const box2& box)
+	{
+		const auto [it, inserted] = keyframes.try_emplace(pts);
+		it->second.box = box;
+		if (inserted) revision = next_revision++;
+		return inserted;
+	}
 
-			keyframes.emplace_back(frame_time, box);
-		}
-		else if (next_it->frame_time == frame_time)
-			next_it->box = box;
-		else
-		{
-			// insert before the found iterator
-			keyframes.emplace(next_it, frame_time, box);
-		}
+	// the key frame starting the interpolation pts falls in, or null before the first one
+	const pair<const int64_t, KeyFrame>* segment_at(const int64_t pts) const
+	{
+		const auto next = keyframes.upper_bound(pts);
+		return next == keyframes.begin() ? nullptr : &*prev(next);
+	}
 
+	// sets the easing from the key frame at pts to the next one, returns false if there's no key frame there
+	bool set_easing(const int64_t pts, EasingCurve easing)
+	{
+		const auto it = keyframes.find(pts);
+		if (it == keyframes.end()) return false;
+		it->second.easing = move(easing);
 		return true;
 	}
 
-	void remove(const double frame_time)
+	// adds a key frame past the last one without searching for its place, for loading tracks that were saved in order
+	void append(const int64_t pts, KeyFrame keyframe)
 	{
-		keyframes.erase(remove_if(keyframes.begin(), keyframes.end(), [&](const auto& kf) { return kf.frame_time == frame_time; }));
+		keyframes.emplace_hint(keyframes.end(), pts, move(keyframe));
+		revision = next_revision++;
 	}
 
-	void clear() { keyframes.clear(); }
+	void remove(const int64_t pts)
+	{
+		if (keyframes.erase(pts)) revision = next_revision++;
+	}
+
+	void clear() { keyframes.clear(); revision = next_revision++; }
+
+	// the key frames that affect the boxes in [from_pts, to_pts]: the ones inside it and the closest on either side
+	auto affecting(const int64_t from_pts, const int64_t to_pts) const
+	{
+		auto first = keyframes.upper_bound(from_pts), last = keyframes.lower_bound(to_pts);
+		if (first != keyframes.begin()) --first;
+		if (last != keyframes.end()) ++last;
+		return pair{ first, last };
+	}
+
+	auto begin() const noexcept { return keyframes.cbegin(); }
+	auto end() const noexcept { return keyframes.cend(); }
 
 private:
-	vector<KeyFrame> keyframes;
-};
\ No newline at end of file
+	map<int64_t, KeyFrame> keyframes;
+
+	// renewed whenever a key frame is added or removed, the cursors from before can't be trusted anymore
+	uint64_t revision = next_revision++;
+
+	bool is_next(const map<int64_t, KeyFrame>::const_iterator next, const int64_t pts) const
+	{
+		return (next == keyframes.end() || pts < next->first) && (next == keyframes.begin() || prev(next)->first <= pts);
+	}
+
+	static void fill_boxes(CropBoxes& boxes, const size_t begin, const size_t end, const box2& box)
+	{
+		fill(boxes.x0.begin() + begin, boxes.x0.begin() + end, box.v0.x);
+		fill(boxes.y0.begin() + begin, boxes.y0.begin() + end, box.v0.y);
+		fill(boxes.x1.begin() + begin, boxes.x1.begin() + end, box.v1.x);
+		fill(boxes.y1.begin() + begin, boxes.y1.begin() + end, box.v1.y);
+	}
+
+	// the frames in [begin, end) all fall between the two key frames, the loops are kept simple enough to vectorize and
+	// round the same way at() does
+	static void interpolate_boxes(const span<const int64_t> pts, const size_t begin, const size_t end,
+		const pair<const int64_t, KeyFrame>& from, const pair<const int64_t, KeyFrame>& to, CropBoxes& boxes)
+	{
+		const auto from_pts = from.first;
+		const auto length = static_cast<double>(to.first - from_pts);
+		const auto& easing = from.second.easing;
+		const auto& from_box = from.second.box;
+		const auto& to_box = to.second.box;
+
+		float progress[evaluate_chunk_frames];
+		for (auto chunk_begin = begin; chunk_begin < end; chunk_begin += evaluate_chunk_frames)
+		{
+			const auto count = std::min(end - chunk_begin, evaluate_chunk_frames);
+			for (size_t index = 0; index < count; ++index)
+				progress[index] = static_cast<float>(static_cast<double>(pts[chunk_begin + index] - from_pts) / length);
+
+			if (easing.spec().type != EasingType::Linear)
+				for (size_t index = 0; index < count; ++index)
+					progress[index] = easing(progress[index]);
+
+			const auto interpolate = [&](float* values, const float from_value, const float to_value)
+			{
+				for (size_t index = 0; index < count; ++index)
+					values[index] = from_value * (1 - progress[index]) + to_value * progress[index];
+			};
+			interpolate(boxes.x0.data() + chunk_begin, from_box.v0.x, to_box.v0.x);
+			interpolate(boxes.y0.data() + chunk_begin, from_box.v0.y, to_box.v0.y);
+			interpolate(boxes.x1.data() + chunk_begin, from_box.v1.x, to_box.v1.x);
+			interpolate(boxes.y1.data() + chunk_begin, from_box.v1.y, to_box.v1.y);
+		}
+	}
+
+	// next is the first key frame past pts, before the first key frame and after the last one the boxes hold
+	box2 box_between(const map<int64_t, KeyFrame>::const_iterator next, const int64_t pts) const
+	{
+		if (keyframes.empty()) return default_box;
+		if (next == keyframes.begin()) return next->second.box;
+
+		const auto& [previous_pts, previous] = *prev(next);
+		if (next == keyframes.end() || previous_pts == pts) return previous.box;
+		return mix(previous.box, next->second.box, previous.easing(static_cast<float>(static_cast<double>(pts - previous_pts) / (next->first - previous_pts))));
+	}
+};
+
+// a named set of key frames, multiple tracks over the same source describe the different crops exported from it
+export struct CropTrack
+{
+	string name;
+	KeyFrames keyframes;
+};
@@ -0,0 +1,84 @@
+module;
+
+#include "libav.h"
+#include <glm/glm.hpp>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+
+export module luma_pyramid;
+
+using namespace std;
+using namespace glm;
+
+// levels stop halving before their smaller side drops under this, in pixels
+constexpr int pyramid_min_level_size = 32;
+
+// 8 bit brightness, tightly packed
+export struct LumaPlane
+{
+	ivec2 size{};
+	vector<uint8_t> pixels;
+
+	const uint8_t* row(const int y) const { return &pixels[static_cast<size_t>(y) * size.x]; }
+
+	// bilinear, clamped to the edges
+	float sample(const vec2& position) const
+	{
+		const auto clamped = glm::clamp(position, vec2(0), vec2(size - 1));
+		const ivec2 p0(clamped);
+		const auto p1 = glm::min(p0 + 1, size - 1);
+		const auto fraction = clamped - vec2(p0);
+
+		const auto row0 = row(p0.y), row1 = row(p1.y);
+		const auto top = mix(static_cast<float>(row0[p0.x]), static_cast<float>(row0[p1.x]), fraction.x);
+		const auto bottom = mix(static_cast<float>(row1[p0.x]), static_cast<float>(row1[p1.x]), fraction.x);
+		return mix(top, bottom, fraction.y);
+	}
+};
+
+// whether the brightness of the format is its own plane of bytes, which is all the pyramids read
+export bool has_planar_luma(const AVPixelFormat pixel_format)
+{
+	const auto desc = av_pix_fmt_desc_get(pixel_format);
+	return desc && !(desc->flags & AV_PIX_FMT_FLAG_RGB) && desc->comp[0].plane == 0 && desc->comp[0].step == 1 && desc->comp[0].depth == 8;
+}
+
+// how many levels, up to max_levels, a frame of this size halves into
+export int pyramid_level_count(const ivec2& frame_size, const int max_levels)
+{
+	int count = 1;
+	while (count < max_levels && (std::min(frame_size.x, frame_size.y) >> count) >= pyramid_min_level_size) ++count;
+	return count;
+}
+
+// the frame's luma at halving resolutions, level 0 is the source's, only the luma plane is read, for y4m sources that's
+// the only part of the mapping touched
+export void build_pyramid(const AVFrame* frame, const int level_count, vector<LumaPlane>& levels)
+{
+	levels.resize(level_count);
+
+	auto& base = levels[0];
+	base.size = { frame->width, frame->height };
+	base.pixels.resize(static_cast<size_t>(base.size.x) * base.size.y);
+	for (int y = 0; y < base.size.y; ++y)
+		memcpy(&base.pixels[static_cast<size_t>(y) * base.size.x], frame->data[0] + static_cast<ptrdiff_t>(y) * frame->linesize[0], base.size.x);
+
+	for (int level = 1; level < level_count; ++level)
+	{
+		const auto& source = levels[level - 1];
+		auto& target = levels[level];
+		target.size = source.size / 2;
+		target.pixels.resize(static_cast<size_t>(target.size.x) * target.size.y);
+
+		// a 2x2 box filter, kept simple enough for the compiler to vectorize
+		for (int y = 0; y < target.size.y; ++y)
+		{
+			const auto row0 = source.row(2 * y), row1 = row0 + source.size.x;
+			const auto output = &target.pixels[static_cast<size_t>(y) * target.size.x];
+			for (int x = 0; x < target.size.x; ++x)
+				output[x] = static_cast<uint8_t>((row0[2 * x] + row0[2 * x + 1] + row1[2 * x] + row1[2 * x + 1] + 2) >> 2);
+		}
+	}
+}
@@ -0,0 +1,83 @@
+module;
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <cstdint>
+#include <span>
+#include <stdexcept>
+
+export module mapped_file;
+
+using namespace std;
+
+#define CHECK_SUCCESS(cmd, errormsg) if(!(cmd)) { throw runtime_error(errormsg); }
+
+// a read only view of a whole file, reads are plain memory accesses that the os pages in on demand
+export class MappedFile
+{
+#ifdef _WIN32
+	HANDLE file{ INVALID_HANDLE_VALUE };
+	HANDLE mapping{};
+#else
+	int file{ -1 };
+#endif
+	const uint8_t* view{};
+	size_t size{};
+
+public:
+	MappedFile(const char* path)
+	{
+#ifdef _WIN32
+		file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		CHECK_SUCCESS(file != INVALID_HANDLE_VALUE, "Could not open the file to map.");
+
+		LARGE_INTEGER file_size{};
+		CHECK_SUCCESS(GetFileSizeEx(file, &file_size), "Could not get the size of the file to map.");
+		size = static_cast<size_t>(file_size.QuadPart);
+		if (!size) return;
+
+		mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		CHECK_SUCCESS(mapping, "Could not create the file mapping.");
+		view = static_cast<const uint8_t*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+		CHECK_SUCCESS(view, "Could not map the file.");
+#else
+		file = open(path, O_RDONLY);
+		CHECK_SUCCESS(file >= 0, "Could not open the file to map.");
+
+		struct stat file_stat {};
+		CHECK_SUCCESS(!fstat(file, &file_stat), "Could not get the size of the file to map.");
+		size = static_cast<size_t>(file_stat.st_size);
+		if (!size) return;
+
+		const auto address = mmap(nullptr, size, PROT_READ, MAP_SHARED, file, 0);
+		CHECK_SUCCESS(address != MAP_FAILED, "Could not map the file.");
+		view = static_cast<const uint8_t*>(address);
+#endif
+	}
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	~MappedFile()
+	{
+#ifdef _WIN32
+		if (view) UnmapViewOfFile(view);
+		if (mapping) CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+#else
+		if (view) munmap(const_cast<uint8_t*>(view), size);
+		if (file >= 0) close(file);
+#endif
+	}
+
+	span<const uint8_t> data() const { return { view, size }; }
+};
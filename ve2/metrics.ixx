@@ -0,0 +1,187 @@
+module;
+
+#include <algorithm>
+#include <atomic>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdio>
+
+export module metrics;
+
+using namespace std;
+
+// latencies land in buckets spaced a quarter octave apart starting at 1us, the last one catches everything past ~4.5 minutes
+constexpr int histogram_bucket_count = 112;
+constexpr int histogram_buckets_per_octave = 4;
+constexpr double histogram_first_bucket_sec = 1e-6;
+
+export class Counter
+{
+	atomic<uint64_t> count{};
+
+public:
+	void add(const uint64_t n = 1) { count.fetch_add(n, memory_order_relaxed); }
+	uint64_t value() const { return count.load(memory_order_relaxed); }
+};
+
+export class Gauge
+{
+	atomic<double> current{};
+
+public:
+	void set(const double value) { current.store(value, memory_order_relaxed); }
+	double value() const { return current.load(memory_order_relaxed); }
+};
+
+// a fixed bucket latency histogram, recording is a couple of relaxed atomic adds so it can sit on any thread's hot path
+export class Histogram
+{
+	array<atomic<uint64_t>, histogram_bucket_count> buckets{};
+	atomic<uint64_t> count{};
+	atomic<double> sum_sec{}, max_sec{};
+
+	static double bucket_upper_bound_sec(const int bucket) { return histogram_first_bucket_sec * exp2(static_cast<double>(bucket) / histogram_buckets_per_octave); }
+
+public:
+	void record(const double sec)
+	{
+		const auto bucket = sec <= histogram_first_bucket_sec ? 0
+			: std::min(static_cast<int>(ceil(log2(sec / histogram_first_bucket_sec) * histogram_buckets_per_octave)), histogram_bucket_count - 1);
+		buckets[bucket].fetch_add(1, memory_order_relaxed);
+		count.fetch_add(1, memory_order_relaxed);
+
+		for (auto current_sum = sum_sec.load(memory_order_relaxed); !sum_sec.compare_exchange_weak(current_sum, current_sum + sec, memory_order_relaxed);) {}
+		for (auto current_max = max_sec.load(memory_order_relaxed); sec > current_max && !max_sec.compare_exchange_weak(current_max, sec, memory_order_relaxed);) {}
+	}
+
+	uint64_t samples() const { return count.load(memory_order_relaxed); }
+	double mean() const { const auto n = samples(); return n ? sum_sec.load(memory_order_relaxed) / n : 0; }
+	double max() const { return max_sec.load(memory_order_relaxed); }
+
+	// the upper bound of the bucket holding the given fraction of the samples, clamped to the largest sample
+	double percentile(const double fraction) const
+	{
+		const auto n = samples();
+		if (!n) return 0;
+
+		const auto rank = static_cast<uint64_t>(ceil(fraction * n));
+		uint64_t seen{};
+		for (int bucket = 0; bucket < histogram_bucket_count; ++bucket)
+			if ((seen += buckets[bucket].load(memory_order_relaxed)) >= rank)
+				return std::min(bucket_upper_bound_sec(bucket), max());
+		return max();
+	}
+};
+
+// records the lifetime of the scope into a histogram
+export class ScopedTimer
+{
+	Histogram& histogram;
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+public:
+	ScopedTimer(Histogram& histogram) :histogram(histogram) {}
+	ScopedTimer(const ScopedTimer&) = delete;
+	ScopedTimer& operator=(const ScopedTimer&) = delete;
+	~ScopedTimer() { histogram.record(chrono::duration<double>(chrono::steady_clock::now() - start).count()); }
+};
+
+struct MetricsRegistry
+{
+	mutex registry_mutex;
+	map<string, unique_ptr<Counter>, less<>> counters;
+	map<string, unique_ptr<Gauge>, less<>> gauges;
+	map<string, unique_ptr<Histogram>, less<>> histograms;
+};
+
+MetricsRegistry& registry()
+{
+	static MetricsRegistry instance;
+	return instance;
+}
+
+template<typename TMetric>
+TMetric& find_or_add(map<string, unique_ptr<TMetric>, less<>>& metrics, const string_view name)
+{
+	lock_guard lock(registry().registry_mutex);
+	auto it = metrics.find(name);
+	if (it == metrics.end())
+		it = metrics.emplace(string(name), make_unique<TMetric>()).first;
+	return *it->second;
+}
+
+// the metrics live as long as the process and never move, so the hot paths look them up once and keep the reference
+export Counter& metrics_counter(const string_view name) { return find_or_add(registry().counters, name); }
+export Gauge& metrics_gauge(const string_view name) { return find_or_add(registry().gauges, name); }
+export Histogram& metrics_histogram(const string_view name) { return find_or_add(registry().histograms, name); }
+
+// one line per metric, for the on-screen overlay, written over the previous lines so the strings keep their capacity
+// and refreshing the overlay every frame doesn't allocate
+export void metrics_summary_lines(vector<string>& lines)
+{
+	lock_guard lock(registry().registry_mutex);
+	size_t count{};
+	char line[256];
+
+	const auto set_line = [&](const int length)
+	{
+		if (count == lines.size()) lines.emplace_back();
+		lines[count++].assign(line, std::min<size_t>(length, sizeof(line) - 1));
+	};
+
+	for (const auto& [name, counter] : registry().counters)
+		set_line(snprintf(line, sizeof(line), "%s: %llu", name.c_str(), static_cast<unsigned long long>(counter->value())));
+	for (const auto& [name, gauge] : registry().gauges)
+		set_line(snprintf(line, sizeof(line), "%s: %.2f", name.c_str(), gauge->value()));
+	for (const auto& [name, histogram] : registry().histograms)
+		set_line(snprintf(line, sizeof(line), "%s: p50 %.2fms p99 %.2fms max %.2fms (%llu)", name.c_str(), histogram->percentile(.5) * 1000,
+			histogram->percentile(.99) * 1000, histogram->max() * 1000, static_cast<unsigned long long>(histogram->samples())));
+
+	lines.resize(count);
+}
+
+// a snapshot of every metric, histogram latencies in milliseconds
+export string metrics_json()
+{
+	lock_guard lock(registry().registry_mutex);
+	string json = "{\n\t\"counters\": {";
+	char value[256];
+
+	const char* separator = "";
+	for (const auto& [name, counter] : registry().counters)
+	{
+		snprintf(value, sizeof(value), "%s\n\t\t\"%s\": %llu", separator, name.c_str(), static_cast<unsigned long long>(counter->value()));
+		json += value;
+		separator = ",";
+	}
+
+	json += "\n\t},\n\t\"gauges\": {";
+	separator = "";
+	for (const auto& [name, gauge] : registry().gauges)
+	{
+		snprintf(value, sizeof(value), "%s\n\t\t\"%s\": %g", separator, name.c_str(), gauge->value());
+		json += value;
+		separator = ",";
+	}
+
+	json += "\n\t},\n\t\"histograms\": {";
+	separator = "";
+	for (const auto& [name, histogram] : registry().histograms)
+	{
+		snprintf(value, sizeof(value), "%s\n\t\t\"%s\": { \"count\": %llu, \"mean_ms\": %g, \"p50_ms\": %g, \"p99_ms\": %g, \"max_ms\": %g }",
+			separator, name.c_str(), static_cast<unsigned long long>(histogram->samples()), histogram->mean() * 1000,
+			histogram->percentile(.5) * 1000, histogram->percentile(.99) * 1000, histogram->max() * 1000);
+		json += value;
+		separator = ",";
+	}
+
+	json += "\n\t}\n}\n";
+	return json;
+}
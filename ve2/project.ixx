@@ -0,0 +1,949 @@
+module;
+
+#include <glm/glm.hpp>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <array>
+#include <iterator>
+#include <span>
+#include <memory>
+#include <filesystem>
+#include <fstream>
+#include <charconv>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <iostream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <stdexcept>
+
+export module project;
+
+import utilities;
+import keyframes;
+import easing;
+import composition;
+import mapped_file;
+
+using namespace std;
+using namespace glm;
+
+#define CHECK_SUCCESS(cmd, errormsg) if(!(cmd)) { throw runtime_error(errormsg); }
+
+// bump on any change to the binary layout, older files are rejected rather than misread
+constexpr uint32_t project_version = 2;
+constexpr char project_magic[4] = { 'v', 'e', '2', 'p' };
+constexpr int project_json_schema = 1;
+
+// every this many key frames the pts index holds an absolute pts, the ones in between are varint deltas from the previous
+constexpr uint32_t pts_index_interval = 64;
+
+// the box corners are stored as 16 bit fractions of the frame, a thirtieth of a pixel at 1080p
+constexpr float box_quantization_scale = 65535;
+
+// the journal is folded into a fresh snapshot once it's past both of these, so replaying it on load stays cheap
+constexpr uint64_t compaction_min_journal_bytes = 1 << 20;
+constexpr uint64_t compaction_snapshot_divisor = 4;
+
+constexpr pair<string_view, EasingType> easing_names[] =
+{
+	{ "linear", EasingType::Linear }, { "ease_in", EasingType::EaseIn }, { "ease_out", EasingType::EaseOut }, { "ease_in_out", EasingType::EaseInOut },
+};
+
+// the binary layout, little endian like every platform we build for, with every section aligned to 8 bytes so the mapped
+// file can be read in place
+struct ProjectFileHeader
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t track_count;
+	uint32_t part_count;
+	int64_t composition_duration_pts;			// negative when there's no composition
+	uint64_t parts_offset;						// part_count Parts
+	uint64_t tracks_offset;						// track_count ProjectFileTracks
+	uint64_t journal_offset;					// the edits since the snapshot are appended from here to the end of the file
+};
+
+struct ProjectFileTrack
+{
+	uint64_t name_offset;
+	uint32_t name_length;
+	uint32_t keyframe_count;
+	uint64_t pts_index_offset;					// a PtsIndexEntry for every pts_index_interval key frames
+	uint64_t pts_deltas_offset, pts_deltas_size;
+	uint64_t boxes_offset;						// keyframe_count QuantizedBoxes
+	uint64_t easings_offset;					// easing_count EasingEntries, by increasing key frame index, linear ones are left out
+	uint32_t easing_count;
+	uint32_t reserved;
+};
+
+struct PtsIndexEntry
+{
+	int64_t pts;
+	uint64_t deltas_offset;						// where the delta of the key frame after this one starts
+};
+
+struct QuantizedBox
+{
+	uint16_t x0, y0, x1, y1;
+};
+
+struct EasingEntry
+{
+	uint32_t keyframe_index;
+	Easing easing;
+};
+
+QuantizedBox quantize(const box2& box)
+{
+	const auto fraction = [](const float value) { return static_cast<uint16_t>(std::clamp(value, 0.f, 1.f) * box_quantization_scale + .5f); };
+	return { fraction(box.v0.x), fraction(box.v0.y), fraction(box.v1.x), fraction(box.v1.y) };
+}
+
+box2 dequantize(const QuantizedBox& box)
+{
+	return { vec2(box.x0, box.y0) / box_quantization_scale, vec2(box.x1, box.y1) / box_quantization_scale };
+}
+
+void append_varint(vector<uint8_t>& buffer, uint64_t value)
+{
+	for (; value >= 0x80; value >>= 7)
+		buffer.push_back(static_cast<uint8_t>(value | 0x80));
+	buffer.push_back(static_cast<uint8_t>(value));
+}
+
+uint64_t read_varint(const span<const uint8_t> data, size_t& offset)
+{
+	uint64_t value{};
+	for (int shift = 0; shift < 64; shift += 7)
+	{
+		CHECK_SUCCESS(offset < data.size(), "Invalid project file.");
+		const auto byte = data[offset++];
+		value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+		if (!(byte & 0x80)) return value;
+	}
+	throw runtime_error("Invalid project file.");
+}
+
+// appends a section at the next aligned offset, returns the offset
+uint64_t append_section(vector<uint8_t>& buffer, const void* data, const size_t size)
+{
+	buffer.resize((buffer.size() + 7) & ~size_t{ 7 });
+	const auto offset = buffer.size();
+	buffer.insert(buffer.end(), static_cast<const uint8_t*>(data), static_cast<const uint8_t*>(data) + size);
+	return offset;
+}
+
+template<typename T>
+span<const T> file_section(const span<const uint8_t> data, const uint64_t offset, const uint64_t count)
+{
+	CHECK_SUCCESS(offset % alignof(T) == 0 && offset <= data.size() && count <= (data.size() - offset) / sizeof(T), "Invalid project file.");
+	return { reinterpret_cast<const T*>(data.data() + offset), static_cast<size_t>(count) };
+}
+
+// the flattened curves by easing, the tracks reuse the same few easings over and over
+class EasingCurves
+{
+	vector<EasingCurve> curves;
+
+public:
+	const EasingCurve& operator[](const Easing& easing)
+	{
+		const auto it = find_if(curves.begin(), curves.end(), [&](const auto& curve) { return curve.spec() == easing; });
+		return it != curves.end() ? *it : curves.emplace_back(easing);
+	}
+};
+
+export struct Project
+{
+	vector<CropTrack> crop_tracks;
+	unique_ptr<Composition> composition;		// none until the source is cut, every frame is kept
+};
+
+// the journal records, each a JournalRecordHeader and its payload, written as is
+enum class JournalRecordType : uint32_t { AddTrack, AddKeyFrame, RemoveKeyFrame, SetEasing, SetComposition, EraseRange };
+
+struct JournalRecordHeader
+{
+	JournalRecordType type;
+	uint32_t size;								// of the payload
+	uint64_t checksum;							// of the type and the payload, a torn record at the end of the file fails it
+};
+
+struct KeyFrameRecord
+{
+	uint32_t track;
+	uint32_t reserved;
+	int64_t pts;
+	box2 box;
+};
+
+struct EasingRecord
+{
+	int64_t pts;
+	uint32_t track;
+	Easing easing;
+};
+
+struct RangeRecord
+{
+	int64_t from_pts, to_pts;
+};
+
+uint64_t record_checksum(const JournalRecordType type, const span<const uint8_t> payload)
+{
+	Hasher hasher;
+	hasher.add(type).add(payload.data(), payload.size());
+	return hasher.value;
+}
+
+template<typename T>
+T read_record(const span<const uint8_t> payload)
+{
+	CHECK_SUCCESS(payload.size() == sizeof(T), "Invalid project journal record.");
+	T record;
+	memcpy(&record, payload.data(), sizeof(T));
+	return record;
+}
+
+CropTrack& record_track(Project& project, const uint32_t track)
+{
+	CHECK_SUCCESS(track < project.crop_tracks.size(), "Invalid project journal record.");
+	return project.crop_tracks[track];
+}
+
+void apply_record(Project& project, const JournalRecordType type, const span<const uint8_t> payload, EasingCurves& curves)
+{
+	switch (type)
+	{
+	case JournalRecordType::AddTrack:
+		project.crop_tracks.push_back({ string(reinterpret_cast<const char*>(payload.data()), payload.size()) });
+		break;
+	case JournalRecordType::AddKeyFrame:
+	{
+		const auto record = read_record<KeyFrameRecord>(payload);
+		record_track(project, record.track).keyframes.add(record.pts, record.box);
+		break;
+	}
+	case JournalRecordType::RemoveKeyFrame:
+	{
+		const auto record = read_record<KeyFrameRecord>(payload);
+		record_track(project, record.track).keyframes.remove(record.pts);
+		break;
+	}
+	case JournalRecordType::SetEasing:
+	{
+		const auto record = read_record<EasingRecord>(payload);
+		record_track(project, record.track).keyframes.set_easing(record.pts, curves[record.easing]);
+		break;
+	}
+	case JournalRecordType::SetComposition:
+		project.composition = make_unique<Composition>(read_record<RangeRecord>(payload).to_pts);
+		break;
+	case JournalRecordType::EraseRange:
+	{
+		const auto record = read_record<RangeRecord>(payload);
+		CHECK_SUCCESS(project.composition, "Invalid project journal record.");
+		project.composition->erase(record.from_pts, record.to_pts);
+		break;
+	}
+	default:
+		throw runtime_error("Invalid project journal record.");
+	}
+}
+
+// replays the records up to the end of the data, or up to the first one that didn't make it to the disk whole
+void replay_journal(Project& project, const span<const uint8_t> journal, EasingCurves& curves)
+{
+	for (size_t offset = 0; journal.size() - offset >= sizeof(JournalRecordHeader);)
+	{
+		JournalRecordHeader header;
+		memcpy(&header, journal.data() + offset, sizeof(header));
+		offset += sizeof(header);
+		if (header.size > journal.size() - offset) return;
+
+		const auto payload = journal.subspan(offset, header.size);
+		if (record_checksum(header.type, payload) != header.checksum) return;
+		apply_record(project, header.type, payload, curves);
+		offset += header.size;
+	}
+}
+
+Project copy_project(const Project& project)
+{
+	Project copy{ project.crop_tracks };
+	if (project.composition)
+		copy.composition = make_unique<Composition>(project.composition->duration_pts(),
+			vector<Part>(project.composition->begin(), project.composition->end()));
+	return copy;
+}
+
+// whether every record made it to the disk whole, or the journal ends in a torn one
+bool journal_intact(const span<const uint8_t> journal)
+{
+	size_t offset{};
+	while (journal.size() - offset >= sizeof(JournalRecordHeader))
+	{
+		JournalRecordHeader header;
+		memcpy(&header, journal.data() + offset, sizeof(header));
+		offset += sizeof(header);
+		if (header.size > journal.size() - offset || record_checksum(header.type, journal.subspan(offset, header.size)) != header.checksum)
+			return false;
+		offset += header.size;
+	}
+	return offset == journal.size();
+}
+
+// a crop track in a mapped project file, read in place
+export class ProjectTrackView
+{
+	string_view track_name;
+	span<const PtsIndexEntry> pts_index;
+	span<const uint8_t> pts_deltas;
+	span<const QuantizedBox> boxes;
+	span<const EasingEntry> easings;
+
+public:
+	ProjectTrackView(const span<const uint8_t> data, const ProjectFileTrack& track)
+		:track_name(file_section<char>(data, track.name_offset, track.name_length).data(), track.name_length),
+		pts_index(file_section<PtsIndexEntry>(data, track.pts_index_offset, (static_cast<uint64_t>(track.keyframe_count) + pts_index_interval - 1) / pts_index_interval)),
+		pts_deltas(file_section<uint8_t>(data, track.pts_deltas_offset, track.pts_deltas_size)),
+		boxes(file_section<QuantizedBox>(data, track.boxes_offset, track.keyframe_count)),
+		easings(file_section<EasingEntry>(data, track.easings_offset, track.easing_count))
+	{
+	}
+
+	string_view name() const { return track_name; }
+	size_t keyframe_count() const { return boxes.size(); }
+
+	// from the closest index entry, at most pts_index_interval - 1 deltas away
+	int64_t pts(const size_t index) const
+	{
+		const auto& entry = pts_index[index / pts_index_interval];
+		auto pts = entry.pts;
+		auto offset = static_cast<size_t>(entry.deltas_offset);
+		for (auto remaining = index % pts_index_interval; remaining; --remaining)
+			pts += static_cast<int64_t>(read_varint(pts_deltas, offset));
+		return pts;
+	}
+
+	box2 box(const size_t index) const { return dequantize(boxes[index]); }
+
+	KeyFrames keyframes() const
+	{
+		EasingCurves curves;
+		return keyframes(curves);
+	}
+
+	// decodes the whole track in one pass over the file, flattening every distinct easing once
+	KeyFrames keyframes(EasingCurves& curves) const
+	{
+		KeyFrames keyframes;
+		int64_t pts{};
+		size_t offset{};
+		auto easing = easings.begin();
+		for (size_t index = 0; index < boxes.size(); ++index)
+		{
+			if (index % pts_index_interval == 0)
+			{
+				pts = pts_index[index / pts_index_interval].pts;
+				offset = static_cast<size_t>(pts_index[index / pts_index_interval].deltas_offset);
+			}
+			else
+				pts += static_cast<int64_t>(read_varint(pts_deltas, offset));
+
+			KeyFrame keyframe{ dequantize(boxes[index]) };
+			if (easing != easings.end() && easing->keyframe_index == index)
+				keyframe.easing = curves[(easing++)->easing];
+			keyframes.append(pts, move(keyframe));
+		}
+		return keyframes;
+	}
+};
+
+// a project file mapped read only, validated once when it's opened, after which the names, pts and boxes can be read in
+// place without decoding the tracks, loading the project to edit or export it still decodes every track into key frames
+export class ProjectView
+{
+	MappedFile file;
+	const ProjectFileHeader* header{};
+	vector<ProjectTrackView> track_views;
+
+public:
+	ProjectView(const char* path) :file(path)
+	{
+		const auto data = file.data();
+		CHECK_SUCCESS(data.size() >= sizeof(ProjectFileHeader) && !memcmp(data.data(), project_magic, sizeof(project_magic)), "Not a project file.");
+		header = reinterpret_cast<const ProjectFileHeader*>(data.data());
+		CHECK_SUCCESS(header->version == project_version, "Unsupported project file version.");
+
+		file_section<Part>(data, header->parts_offset, header->part_count);
+		file_section<uint8_t>(data, header->journal_offset, 0);
+		for (const auto& track : file_section<ProjectFileTrack>(data, header->tracks_offset, header->track_count))
+			track_views.emplace_back(data, track);
+	}
+
+	// the in place views are of the snapshot, the edits journaled since come on top of it
+	span<const uint8_t> journal() const { return file.data().subspan(static_cast<size_t>(header->journal_offset)); }
+
+	span<const ProjectTrackView> tracks() const { return track_views; }
+
+	unique_ptr<Composition> composition() const
+	{
+		if (header->composition_duration_pts < 0) return {};
+		const auto parts = file_section<Part>(file.data(), header->parts_offset, header->part_count);
+		return make_unique<Composition>(header->composition_duration_pts, vector<Part>(parts.begin(), parts.end()));
+	}
+
+	// the snapshot with the journal replayed over it
+	Project project() const
+	{
+		Project project;
+		EasingCurves curves;
+		for (const auto& track : track_views)
+			project.crop_tracks.push_back({ string(track.name()), track.keyframes(curves) });
+		project.composition = composition();
+		replay_journal(project, journal(), curves);
+		return project;
+	}
+};
+
+// told apart from the json format by the signature
+bool is_binary_project(const filesystem::path& path)
+{
+	char magic[sizeof(project_magic)]{};
+	ifstream file(path, ios::binary);
+	CHECK_SUCCESS(file, "Could not open the project file.");
+	file.read(magic, sizeof(magic));
+	return !memcmp(magic, project_magic, sizeof(magic));
+}
+
+// writes a snapshot of the binary layout, with an empty journal, next to the path and renames it over, so an interrupted
+// save never leaves a truncated project
+export void save_project(const Project& project, const filesystem::path& path)
+{
+	vector<uint8_t> buffer(sizeof(ProjectFileHeader));
+	ProjectFileHeader header{ { project_magic[0], project_magic[1], project_magic[2], project_magic[3] }, project_version };
+	header.composition_duration_pts = -1;
+
+	if (project.composition)
+	{
+		const vector<Part> parts(project.composition->begin(), project.composition->end());
+		header.part_count = static_cast<uint32_t>(parts.size());
+		header.composition_duration_pts = project.composition->duration_pts();
+		header.parts_offset = append_section(buffer, parts.data(), parts.size() * sizeof(Part));
+	}
+
+	vector<ProjectFileTrack> tracks;
+	vector<PtsIndexEntry> pts_index;
+	vector<uint8_t> pts_deltas;
+	vector<QuantizedBox> boxes;
+	vector<EasingEntry> easings;
+	for (const auto& crop_track : project.crop_tracks)
+	{
+		pts_index.clear();
+		pts_deltas.clear();
+		boxes.clear();
+		easings.clear();
+
+		int64_t previous_pts{};
+		for (const auto& [pts, keyframe] : crop_track.keyframes)
+		{
+			const auto index = static_cast<uint32_t>(boxes.size());
+			if (index % pts_index_interval == 0)
+				pts_index.push_back({ pts, pts_deltas.size() });
+			else
+				append_varint(pts_deltas, static_cast<uint64_t>(pts - previous_pts));
+			previous_pts = pts;
+
+			boxes.push_back(quantize(keyframe.box));
+			if (keyframe.easing.spec().type != EasingType::Linear)
+				easings.push_back({ index, keyframe.easing.spec() });
+		}
+
+		auto& track = tracks.emplace_back();
+		track.name_offset = append_section(buffer, crop_track.name.data(), crop_track.name.size());
+		track.name_length = static_cast<uint32_t>(crop_track.name.size());
+		track.keyframe_count = static_cast<uint32_t>(boxes.size());
+		track.pts_index_offset = append_section(buffer, pts_index.data(), pts_index.size() * sizeof(PtsIndexEntry));
+		track.pts_deltas_offset = append_section(buffer, pts_deltas.data(), pts_deltas.size());
+		track.pts_deltas_size = pts_deltas.size();
+		track.boxes_offset = append_section(buffer, boxes.data(), boxes.size() * sizeof(QuantizedBox));
+		track.easings_offset = append_section(buffer, easings.data(), easings.size() * sizeof(EasingEntry));
+		track.easing_count = static_cast<uint32_t>(easings.size());
+	}
+
+	header.track_count = static_cast<uint32_t>(tracks.size());
+	header.tracks_offset = append_section(buffer, tracks.data(), tracks.size() * sizeof(ProjectFileTrack));
+	header.journal_offset = buffer.size();
+	memcpy(buffer.data(), &header, sizeof(header));
+
+	auto partial_path = path;
+	partial_path += ".partial";
+	{
+		ofstream file(partial_path, ios::binary);
+		CHECK_SUCCESS(file.write(reinterpret_cast<const char*>(buffer.data()), buffer.size()), "Could not write the project file.");
+	}
+	filesystem::rename(partial_path, path);
+}
+
+// autosaves a project as it's edited: every edit is queued as a journal record in constant time, and a background thread
+// appends the records to the project file and folds them into a fresh snapshot once the journal grows, so the thread
+// making the edits never waits on the disk
+// the writer keeps its own copy of the project, the edits are applied to it as they're written
+// nothing is written until the first edit, unless the file has a torn tail, which a snapshot drops right away
+export class ProjectJournal
+{
+	filesystem::path path;
+	Project shadow;
+	EasingCurves curves;
+
+	mutex queue_mutex;
+	condition_variable queue_cv, written_cv;
+	vector<uint8_t> queued, writing;			// swapped by the writer, so both keep their capacity
+	uint64_t records_queued{}, records_written{};
+	bool compaction_requested{};
+	bool stopping{};
+	bool appendable{};							// the file is a binary project with a whole journal, the edits go on its end
+	uint64_t journal_bytes{}, snapshot_bytes{};	// of the file, owned by the writer once it runs
+	thread writer;
+
+	void queue(const JournalRecordType type, const void* payload, const size_t size)
+	{
+		JournalRecordHeader header{ type, static_cast<uint32_t>(size),
+			record_checksum(type, { static_cast<const uint8_t*>(payload), size }) };
+		{
+			lock_guard lock(queue_mutex);
+			queued.insert(queued.end(), reinterpret_cast<const uint8_t*>(&header), reinterpret_cast<const uint8_t*>(&header) + sizeof(header));
+			queued.insert(queued.end(), static_cast<const uint8_t*>(payload), static_cast<const uint8_t*>(payload) + size);
+			++records_queued;
+		}
+		queue_cv.notify_one();
+	}
+
+	template<typename T>
+	void queue(const JournalRecordType type, const T& record) { queue(type, &record, sizeof(T)); }
+
+	void write_loop()
+	{
+		ofstream file;
+		bool snapshot_stale = !appendable;			// after a failed write, or with no file to append to, the next batch goes out as a snapshot instead
+		if (appendable)
+			file.open(path, ios::binary | ios::app);
+
+		while (true)
+		{
+			uint64_t records;
+			bool compact;
+			{
+				unique_lock lock(queue_mutex);
+				queue_cv.wait(lock, [&] { return !queued.empty() || compaction_requested || stopping; });
+				if (queued.empty() && !compaction_requested) return;
+
+				swap(queued, writing);
+				queued.clear();
+				records = records_queued;
+				compact = compaction_requested;
+				compaction_requested = false;
+			}
+
+			try
+			{
+				for (size_t offset = 0; offset < writing.size();)
+				{
+					JournalRecordHeader header;
+					memcpy(&header, writing.data() + offset, sizeof(header));
+					apply_record(shadow, header.type, span<const uint8_t>(writing).subspan(offset + sizeof(header), header.size), curves);
+					offset += sizeof(header) + header.size;
+				}
+
+				compact = compact || snapshot_stale || (journal_bytes + writing.size() >= compaction_min_journal_bytes
+					&& journal_bytes + writing.size() >= snapshot_bytes / compaction_snapshot_divisor);
+				if (compact)
+				{
+					file.close();
+					save_project(shadow, path);
+					snapshot_bytes = filesystem::file_size(path);
+					journal_bytes = 0;
+					snapshot_stale = false;
+				}
+				else
+				{
+					file.write(reinterpret_cast<const char*>(writing.data()), writing.size());
+					file.flush();
+					CHECK_SUCCESS(file, "Could not append to the project journal.");
+					journal_bytes += writing.size();
+				}
+				if (!file.is_open())
+					file.open(path, ios::binary | ios::app);
+			}
+			catch (const exception& e)
+			{
+				cerr << "autosave failed: " << e.what() << "\n";
+				file.close();
+				snapshot_stale = true;
+			}
+
+			{
+				lock_guard lock(queue_mutex);
+				records_written = records;
+			}
+			written_cv.notify_all();
+		}
+	}
+
+public:
+	// the project has to be what's in the file (or what should be), the journal starts from it
+	ProjectJournal(filesystem::path path, const Project& project) :path(move(path)), shadow(copy_project(project))
+	{
+		// a json project, or none yet, is replaced by a snapshot on the first edit
+		if (filesystem::exists(this->path) && is_binary_project(this->path))
+		{
+			const ProjectView view(this->path.string().c_str());
+			appendable = journal_intact(view.journal());
+			compaction_requested = !appendable;
+			journal_bytes = view.journal().size();
+			snapshot_bytes = filesystem::file_size(this->path) - journal_bytes;
+		}
+		writer = thread([this] { write_loop(); });
+	}
+
+	ProjectJournal(const ProjectJournal&) = delete;
+	ProjectJournal& operator=(const ProjectJournal&) = delete;
+
+	// writes out whatever is still queued
+	~ProjectJournal()
+	{
+		{
+			lock_guard lock(queue_mutex);
+			stopping = true;
+		}
+		queue_cv.notify_one();
+		writer.join();
+	}
+
+	void add_track(const string_view name) { queue(JournalRecordType::AddTrack, name.data(), name.size()); }
+	void add_keyframe(const uint32_t track, const int64_t pts, const box2& box) { queue(JournalRecordType::AddKeyFrame, KeyFrameRecord{ track, 0, pts, box }); }
+	void remove_keyframe(const uint32_t track, const int64_t pts) { queue(JournalRecordType::RemoveKeyFrame, KeyFrameRecord{ track, 0, pts }); }
+	void set_easing(const uint32_t track, const int64_t pts, const Easing& easing) { queue(JournalRecordType::SetEasing, EasingRecord{ pts, track, easing }); }
+	void set_composition(const int64_t duration_pts) { queue(JournalRecordType::SetComposition, RangeRecord{ 0, duration_pts }); }
+	void erase_range(const int64_t from_pts, const int64_t to_pts) { queue(JournalRecordType::EraseRange, RangeRecord{ from_pts, to_pts }); }
+
+	// folds the journal into a fresh snapshot on the writer thread, without waiting for it
+	void request_compaction()
+	{
+		{
+			lock_guard lock(queue_mutex);
+			compaction_requested = true;
+		}
+		queue_cv.notify_one();
+	}
+
+	// waits until every edit queued so far is on the disk
+	void flush()
+	{
+		unique_lock lock(queue_mutex);
+		const auto records = records_queued;
+		written_cv.wait(lock, [&] { return records_written >= records && !compaction_requested; });
+	}
+};
+
+export string project_json(const Project& project)
+{
+	string json = "{\n\t\"schema\": 1";
+	char value[256];
+
+	if (project.composition)
+	{
+		snprintf(value, sizeof(value), ",\n\t\"composition\": { \"duration_pts\": %lld, \"parts\": [", static_cast<long long>(project.composition->duration_pts()));
+		json += value;
+		const char* separator = " ";
+		for (const auto& part : *project.composition)
+		{
+			snprintf(value, sizeof(value), "%s[%lld, %lld]", separator, static_cast<long long>(part.from_pts), static_cast<long long>(part.to_pts));
+			json += value;
+			separator = ", ";
+		}
+		json += " ] }";
+	}
+
+	json += ",\n\t\"tracks\": [";
+	const char* track_separator = "\n";
+	for (const auto& track : project.crop_tracks)
+	{
+		json += track_separator;
+		json += "\t\t{ \"name\": \"" + json_escape(track.name) + "\", \"keyframes\": [";
+		track_separator = ",\n";
+
+		const char* separator = "\n";
+		for (const auto& [pts, keyframe] : track.keyframes)
+		{
+			const auto& box = keyframe.box;
+			snprintf(value, sizeof(value), "%s\t\t\t{ \"pts\": %lld, \"box\": [%.9g, %.9g, %.9g, %.9g]", separator, static_cast<long long>(pts),
+				box.v0.x, box.v0.y, box.v1.x, box.v1.y);
+			json += value;
+			separator = ",\n";
+
+			const auto& easing = keyframe.easing.spec();
+			if (easing.type == EasingType::Custom)
+				snprintf(value, sizeof(value), ", \"easing\": [%.9g, %.9g, %.9g, %.9g] }", easing.handle0.x, easing.handle0.y, easing.handle1.x, easing.handle1.y);
+			else if (easing.type != EasingType::Linear)
+				snprintf(value, sizeof(value), ", \"easing\": \"%s\" }", find_if(begin(easing_names), end(easing_names),
+					[&](const auto& name) { return name.second == easing.type; })->first.data());
+			else
+				snprintf(value, sizeof(value), " }");
+			json += value;
+		}
+		json += "\n\t\t] }";
+	}
+
+	json += "\n\t]\n}\n";
+	return json;
+}
+
+// just enough json for the project files, the values it doesn't know are skipped
+class JsonReader
+{
+	string_view text;
+	size_t position{};
+
+	void skip_whitespace()
+	{
+		while (position < text.size() && (text[position] == ' ' || text[position] == '\t' || text[position] == '\n' || text[position] == '\r'))
+			++position;
+	}
+
+public:
+	JsonReader(const string_view text) :text(text) {}
+
+	bool peek(const char c)
+	{
+		skip_whitespace();
+		return position < text.size() && text[position] == c;
+	}
+
+	bool consume(const char c)
+	{
+		if (!peek(c)) return false;
+		++position;
+		return true;
+	}
+
+	void expect(const char c) { CHECK_SUCCESS(consume(c), "Invalid project json."); }
+
+	string read_string()
+	{
+		expect('"');
+		string s;
+		while (true)
+		{
+			CHECK_SUCCESS(position < text.size(), "Invalid project json.");
+			const auto c = text[position++];
+			if (c == '"') return s;
+			if (c != '\\')
+			{
+				s += c;
+				continue;
+			}
+
+			CHECK_SUCCESS(position < text.size(), "Invalid project json.");
+			switch (const auto escaped = text[position++])
+			{
+			case 'n': s += '\n'; break;
+			case 't': s += '\t'; break;
+			case 'r': s += '\r'; break;
+			case 'b': s += '\b'; break;
+			case 'f': s += '\f'; break;
+			case 'u':
+			{
+				// basic multilingual plane only, as utf-8
+				unsigned code_point{};
+				CHECK_SUCCESS(position + 4 <= text.size() && from_chars(text.data() + position, text.data() + position + 4, code_point, 16).ptr == text.data() + position + 4,
+					"Invalid project json.");
+				position += 4;
+				if (code_point < 0x80)
+					s += static_cast<char>(code_point);
+				else if (code_point < 0x800)
+				{
+					s += static_cast<char>(0xc0 | code_point >> 6);
+					s += static_cast<char>(0x80 | (code_point & 0x3f));
+				}
+				else
+				{
+					s += static_cast<char>(0xe0 | code_point >> 12);
+					s += static_cast<char>(0x80 | (code_point >> 6 & 0x3f));
+					s += static_cast<char>(0x80 | (code_point & 0x3f));
+				}
+				break;
+			}
+			default: s += escaped; break;
+			}
+		}
+	}
+
+	template<typename T>
+	T read_number()
+	{
+		skip_whitespace();
+		T value{};
+		const auto [end, error] = from_chars(text.data() + position, text.data() + text.size(), value);
+		CHECK_SUCCESS(error == errc(), "Invalid project json.");
+		position = end - text.data();
+		return value;
+	}
+
+	// calls member with every key, which has to read (or skip) its value
+	template<typename TMember>
+	void read_object(TMember&& member)
+	{
+		expect('{');
+		if (consume('}')) return;
+		do
+		{
+			const auto key = read_string();
+			expect(':');
+			member(key);
+		} while (consume(','));
+		expect('}');
+	}
+
+	// calls element for every element, which has to read (or skip) it
+	template<typename TElement>
+	void read_array(TElement&& element)
+	{
+		expect('[');
+		if (consume(']')) return;
+		do element(); while (consume(','));
+		expect(']');
+	}
+
+	template<size_t N>
+	array<float, N> read_floats()
+	{
+		array<float, N> values;
+		expect('[');
+		for (size_t index = 0; index < N; ++index)
+		{
+			if (index) expect(',');
+			values[index] = read_number<float>();
+		}
+		expect(']');
+		return values;
+	}
+
+	void skip_value()
+	{
+		if (peek('{')) read_object([&](const string&) { skip_value(); });
+		else if (peek('[')) read_array([&] { skip_value(); });
+		else if (peek('"')) read_string();
+		else
+		{
+			const auto start = position;
+			while (position < text.size() && !strchr(",}] \t\r\n", text[position])) ++position;
+			CHECK_SUCCESS(position > start, "Invalid project json.");
+		}
+	}
+};
+
+export Project project_from_json(const string_view json)
+{
+	Project project;
+	EasingCurves curves;
+	JsonReader reader(json);
+	int schema{};
+
+	reader.read_object([&](const string& key)
+		{
+			if (key == "schema")
+				schema = reader.read_number<int>();
+			else if (key == "composition")
+			{
+				int64_t duration_pts{};
+				vector<Part> parts;
+				reader.read_object([&](const string& composition_key)
+					{
+						if (composition_key == "duration_pts")
+							duration_pts = reader.read_number<int64_t>();
+						else if (composition_key == "parts")
+							reader.read_array([&]
+								{
+									reader.expect('[');
+									auto& part = parts.emplace_back();
+									part.from_pts = reader.read_number<int64_t>();
+									reader.expect(',');
+									part.to_pts = reader.read_number<int64_t>();
+									reader.expect(']');
+								});
+						else
+							reader.skip_value();
+					});
+				project.composition = make_unique<Composition>(duration_pts, move(parts));
+			}
+			else if (key == "tracks")
+				reader.read_array([&]
+					{
+						auto& track = project.crop_tracks.emplace_back();
+						reader.read_object([&](const string& track_key)
+							{
+								if (track_key == "name")
+									track.name = reader.read_string();
+								else if (track_key == "keyframes")
+									reader.read_array([&]
+										{
+											int64_t pts{};
+											box2 box{};
+											Easing easing{};
+											reader.read_object([&](const string& keyframe_key)
+												{
+													if (keyframe_key == "pts")
+														pts = reader.read_number<int64_t>();
+													else if (keyframe_key == "box")
+													{
+														const auto values = reader.read_floats<4>();
+														box = { { values[0], values[1] }, { values[2], values[3] } };
+													}
+													else if (keyframe_key == "easing" && reader.peek('"'))
+													{
+														const auto name = reader.read_string();
+														const auto it = find_if(begin(easing_names), end(easing_names), [&](const auto& entry) { return entry.first == name; });
+														CHECK_SUCCESS(it != end(easing_names), "Unknown easing in the project json.");
+														easing = easing_preset(it->second);
+													}
+													else if (keyframe_key == "easing")
+													{
+														const auto values = reader.read_floats<4>();
+														easing = easing_custom({ values[0], values[1] }, { values[2], values[3] });
+													}
+													else
+														reader.skip_value();
+												});
+
+											track.keyframes.add(pts, box);
+											if (easing.type != EasingType::Linear)
+												track.keyframes.set_easing(pts, curves[easing]);
+										});
+								else
+									reader.skip_value();
+							});
+					});
+			else
+				reader.skip_value();
+		});
+
+	CHECK_SUCCESS(schema == project_json_schema, "Unsupported project json schema.");
+	return project;
+}
+
+// either format, told apart by the binary signature
+export Project load_project(const filesystem::path& path)
+{
+	if (is_binary_project(path))
+		return ProjectView(path.string().c_str()).project();
+
+	ifstream file(path, ios::binary);
+	const string json{ istreambuf_iterator<char>(file), istreambuf_iterator<char>() };
+	return project_from_json(json);
+}
@@ -1,8 +1,6 @@
-#define _SILENCE_ALL_CXX17_DEPRECATION_WARNINGS
-#include <locale>
-#include <codecvt>
 #include <optional>
 #include <span>
+#include <stdexcept>
 #include "sdf_font.h"
 
 #pragma warning(push)
@@ -30,20 +28,40 @@ Font::Font(const vector<const char*>& font_face_paths, int render_size, int sdf_
 	for (const auto& font_face_path : font_face_paths)
 	{
 		auto& ft_face = ft_faces[index++];
-		if (FT_New_Face(ft_library, font_face_path, 0, &ft_face)) throw exception("Could not open font file.");
+		if (FT_New_Face(ft_library, font_face_path, 0, &ft_face)) throw runtime_error("Could not open font file.");
 		FT_Set_Char_Size(ft_face, 0, static_cast<FT_F26Dot6>(render_size * (1 << 6)), 0, 0);
 	}
 }
 
-vector<FontGlyph> Font::get_glyph_data(const u8string& s)
+constexpr char32_t replacement_character = 0xfffd;
+
+// decodes the code point starting at index and moves index past it, malformed sequences decode to the replacement character
+char32_t decode_utf8(const u8string_view s, size_t& index) noexcept
 {
-	wstring_convert<std::codecvt_utf8<char32_t>, char32_t> ucs4conv;
-	auto u32s = ucs4conv.from_bytes(reinterpret_cast<const char*>(&*s.begin()));
+	const auto lead = s[index++];
+	int continuation_bytes;
+	char32_t c32;
+	if (lead < 0x80) return lead;
+	else if ((lead & 0xe0) == 0xc0) { continuation_bytes = 1; c32 = lead & 0x1f; }
+	else if ((lead & 0xf0) == 0xe0) { continuation_bytes = 2; c32 = lead & 0x0f; }
+	else if ((lead & 0xf8) == 0xf0) { continuation_bytes = 3; c32 = lead & 0x07; }
+	else return replacement_character;
+
+	for (; continuation_bytes; --continuation_bytes)
+	{
+		if (index >= s.size() || (s[index] & 0xc0) != 0x80) return replacement_character;
+		c32 = (c32 << 6) | (s[index++] & 0x3f);
+	}
+	return c32;
+}
 
-	vector<FontGlyph> glyphs;
+const vector<FontGlyph>& Font::get_glyph_data(const u8string_view s)
+{
+	glyphs.clear();
 
-	for (const auto c32 : u32s)
+	for (size_t index = 0; index < s.size();)
 	{
+		const auto c32 = decode_utf8(s, index);
 		const auto font_data_iterator = character_font_data.find(c32);
 		optional<FontGlyph> font_datum;
 		if (font_data_iterator == character_font_data.end())
@@ -79,7 +97,7 @@ vector<FontGlyph> Font::get_glyph_data(const u8string& s)
 		else
 			font_datum = font_data_iterator->second;
 
-		if (!font_datum) throw exception("Could not find character in any font");
+		if (!font_datum) throw runtime_error("Could not find character in any font");
 		glyphs.push_back(*font_datum);
 	}
 
@@ -1,16 +1,19 @@
 #pragma once
 
+#ifdef _MSC_VER
 #include <CppCoreCheck\Warnings.h>
+#endif
 #pragma warning(push)
 #pragma warning(disable : ALL_CPPCORECHECK_WARNINGS)
 #include "mapbox/glyph_foundry.hpp"
 #include <glm/glm.hpp>
-#include <gl/glew.h>
+#include <GL/glew.h>
 #pragma warning(pop)
 
 #include <memory>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 
 import growable_texture_atlas;
@@ -28,7 +31,10 @@ struct FontGlyph
 struct Font
 {
 	Font(const std::vector<const char*> &font_face_paths, int render_size = 512, int sdf_size = 32);
-	std::vector<FontGlyph> get_glyph_data(const std::u8string& s);
+
+	// the glyphs of the string, valid until the next call, the vector is reused so warm lookups don't allocate
+	const std::vector<FontGlyph>& get_glyph_data(std::u8string_view s);
+
 	void bind() const noexcept { glBindTexture(GL_TEXTURE_2D, atlas->texture_name); }
 
 private:
@@ -37,5 +43,6 @@ private:
 	std::vector<FT_Face> ft_faces;
 
 	std::unordered_map<char32_t, FontGlyph> character_font_data;
+	std::vector<FontGlyph> glyphs;
 	std::unique_ptr<GrowableTextureAtlas> atlas;
 };
\ No newline at end of file
@@ -0,0 +1,373 @@
+module;
+
+#include "libav.h"
+#include <glm/glm.hpp>
+#include <memory>
+#include <vector>
+#include <string>
+#include <span>
+#include <optional>
+#include <filesystem>
+#include <fstream>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <cstdio>
+#include <stdexcept>
+
+export module segment_cache;
+
+import utilities;
+import keyframes;
+import exporter;
+
+using namespace std;
+using namespace glm;
+
+#define CHECK_SUCCESS(cmd, errormsg) if(!(cmd)) { throw runtime_error(errormsg); }
+#define CHECK_AV_SUCCESS(cmd) [[gsl::suppress(bounds.3)]] { const int __res = (cmd); if(__res < 0) { char av_error_buffer[AV_ERROR_MAX_STRING_SIZE]; av_strerror(__res, av_error_buffer, sizeof(av_error_buffer)); throw runtime_error(av_error_buffer); } }
+
+// bump when the layout of the cached segments or their keys changes, so stale entries are never reused
+constexpr uint32_t segment_cache_version = 3;
+
+// the minimum length of a segment, segments are extended to the next key frame past it
+constexpr double min_segment_length_sec = 2.;
+
+// a directory of rendered segments and source key frame indices named after their content key, least recently used first
+// out once over the size cap, the last write time doubles as the last use time
+export class SegmentCache
+{
+	filesystem::path directory;
+	uintmax_t size_cap_bytes;
+
+public:
+	SegmentCache(filesystem::path _directory, const uintmax_t size_cap_bytes)
+		:directory(move(_directory)), size_cap_bytes(size_cap_bytes)
+	{
+		filesystem::create_directories(directory);
+	}
+
+	filesystem::path path_for(const uint64_t key, const char* extension = ".nut") const
+	{
+		char name[32];
+		snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(key));
+		return directory / (string(name) + extension);
+	}
+
+	// returns true if the entry is cached, and marks it as used
+	bool lookup(const uint64_t key, const char* extension = ".nut") const
+	{
+		const auto path = path_for(key, extension);
+		error_code error;
+		if (!filesystem::exists(path, error)) return false;
+
+		filesystem::last_write_time(path, filesystem::file_time_type::clock::now(), error);
+		return true;
+	}
+
+	// moves a fully rendered segment into the cache
+	void insert(const uint64_t key, const filesystem::path& rendered_path) const
+	{
+		filesystem::rename(rendered_path, path_for(key));
+	}
+
+	// removes the least recently used entries until the cache fits in its size cap
+	void evict() const
+	{
+		struct Entry { filesystem::path path; uintmax_t size; filesystem::file_time_type last_use; };
+		vector<Entry> entries;
+		uintmax_t total_size{};
+
+		for (const auto& directory_entry : filesystem::directory_iterator(directory))
+			if (directory_entry.is_regular_file() && (directory_entry.path().extension() == ".nut" || directory_entry.path().extension() == ".index"))
+			{
+				entries.push_back({ directory_entry.path(), directory_entry.file_size(), directory_entry.last_write_time() });
+				total_size += entries.back().size;
+			}
+
+		sort(entries.begin(), entries.end(), [](const auto& a, const auto& b) { return a.last_use < b.last_use; });
+		for (const auto& entry : entries)
+		{
+			if (total_size <= size_cap_bytes) break;
+
+			error_code error;
+			if (filesystem::remove(entry.path, error))
+				total_size -= entry.size;
+		}
+	}
+};
+
+export struct CachedExportStats
+{
+	size_t segments{}, rendered{}, reused{};
+	size_t shared{};						// segments rendered in this run once for several identical renditions
+	int64_t frames{};						// source frames decoded for the rendered segments
+};
+
+struct Segment
+{
+	int64_t from_pts, to_pts;
+};
+
+// where the frames and the key frames of the source are, scanned from the packets without decoding
+struct SourceIndex
+{
+	vector<int64_t> key_frames, frames;			// sorted pts
+	int64_t end_pts = INT64_MIN;
+};
+
+vector<int64_t> read_pts_list(ifstream& index_file)
+{
+	uint64_t count{};
+	index_file.read(reinterpret_cast<char*>(&count), sizeof(count));
+	if (!index_file) return {};
+	vector<int64_t> pts(count);
+	index_file.read(reinterpret_cast<char*>(pts.data()), count * sizeof(int64_t));
+	return pts;
+}
+
+void write_pts_list(ofstream& index_file, const vector<int64_t>& pts)
+{
+	const uint64_t count = pts.size();
+	index_file.write(reinterpret_cast<const char*>(&count), sizeof(count));
+	index_file.write(reinterpret_cast<const char*>(pts.data()), count * sizeof(int64_t));
+}
+
+// the index of the source, cached next to the segments
+SourceIndex source_index(const char* url, const SegmentCache& cache, const uint64_t source_key)
+{
+	const auto index_path = cache.path_for(source_key, ".index");
+	if (cache.lookup(source_key, ".index"))
+	{
+		ifstream index_file{ index_path, ios::binary };
+		SourceIndex index;
+		index_file.read(reinterpret_cast<char*>(&index.end_pts), sizeof(index.end_pts));
+		index.key_frames = read_pts_list(index_file);
+		index.frames = read_pts_list(index_file);
+		if (index_file) return index;
+	}
+
+	AVFormatContext* format_context{};
+	CHECK_AV_SUCCESS(avformat_open_input(&format_context, url, nullptr, nullptr));
+	CHECK_AV_SUCCESS(avformat_find_stream_info(format_context, nullptr));
+	const int video_stream_index = av_find_best_stream(format_context, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+	CHECK_SUCCESS(video_stream_index >= 0, "Could not find a video stream.");
+
+	SourceIndex index;
+	auto packet = av_packet_alloc();
+	while (av_read_frame(format_context, packet) >= 0)
+	{
+		if (packet->stream_index == video_stream_index && packet->pts != AV_NOPTS_VALUE)
+		{
+			if (packet->flags & AV_PKT_FLAG_KEY)
+				index.key_frames.push_back(packet->pts);
+			index.frames.push_back(packet->pts);
+			index.end_pts = std::max(index.end_pts, packet->pts + packet->duration);
+		}
+		av_packet_unref(packet);
+	}
+	av_packet_free(&packet);
+	avformat_close_input(&format_context);
+
+	// the packets come in decoding order
+	for (auto pts : { &index.key_frames, &index.frames })
+	{
+		sort(pts->begin(), pts->end());
+		pts->erase(unique(pts->begin(), pts->end()), pts->end());
+	}
+
+	ofstream index_file{ index_path, ios::binary };
+	index_file.write(reinterpret_cast<const char*>(&index.end_pts), sizeof(index.end_pts));
+	write_pts_list(index_file, index.key_frames);
+	write_pts_list(index_file, index.frames);
+
+	return index;
+}
+
+// groups the key frames in segments of at least min_segment_length_sec
+vector<Segment> split_segments(const vector<int64_t>& key_frames, const int64_t end_pts, const double time_base)
+{
+	vector<Segment> segments;
+	for (const auto key_frame : key_frames)
+		if (segments.empty() || (key_frame - segments.back().from_pts) * time_base >= min_segment_length_sec)
+		{
+			if (!segments.empty()) segments.back().to_pts = key_frame;
+			segments.push_back({ key_frame, end_pts });
+		}
+	return segments;
+}
+
+// the key frames a segment's crop boxes are interpolated from: the ones inside it and the closest on either side
+void hash_affecting_keyframes(Hasher& hasher, const KeyFrames& keyframes, const int64_t from_pts, const int64_t to_pts)
+{
+	const auto [first, last] = keyframes.affecting(from_pts, to_pts);
+	for (auto it = first; it != last; ++it)
+		hasher.add(it->first).add(it->second.box).add(it->second.easing.spec());
+}
+
+// copies the segments of one output, in order, into the final file
+void stitch_segments(const vector<filesystem::path>& segment_paths, const string& output_path)
+{
+	AVFormatContext* output_format_context{};
+	CHECK_AV_SUCCESS(avformat_alloc_output_context2(&output_format_context, nullptr, nullptr, output_path.c_str()));
+	AVStream* output_stream{};
+	AVCodecParameters* first_codecpar = avcodec_parameters_alloc();
+	auto packet = av_packet_alloc();
+
+	for (const auto& segment_path : segment_paths)
+	{
+		AVFormatContext* input_format_context{};
+		CHECK_AV_SUCCESS(avformat_open_input(&input_format_context, segment_path.string().c_str(), nullptr, nullptr));
+		CHECK_AV_SUCCESS(avformat_find_stream_info(input_format_context, nullptr));
+		const auto input_stream = input_format_context->streams[0];
+
+		if (!output_stream)
+		{
+			CHECK_AV_SUCCESS(avcodec_parameters_copy(first_codecpar, input_stream->codecpar));
+			output_stream = avformat_new_stream(output_format_context, nullptr);
+			CHECK_SUCCESS(output_stream, "Could not create the output stream.");
+			CHECK_AV_SUCCESS(avcodec_parameters_copy(output_stream->codecpar, input_stream->codecpar));
+			output_stream->codecpar->codec_tag = 0;
+			output_stream->time_base = input_stream->time_base;
+
+			if (!(output_format_context->oformat->flags & AVFMT_NOFILE))
+				CHECK_AV_SUCCESS(avio_open(&output_format_context->pb, output_path.c_str(), AVIO_FLAG_WRITE));
+			CHECK_AV_SUCCESS(avformat_write_header(output_format_context, nullptr));
+		}
+		else
+		{
+			// the output keeps the first segment's headers, which only holds if the encoder settings are unchanged
+			const auto codecpar = input_stream->codecpar;
+			CHECK_SUCCESS(codecpar->extradata_size == first_codecpar->extradata_size
+				&& (!codecpar->extradata_size || !memcmp(codecpar->extradata, first_codecpar->extradata, codecpar->extradata_size)),
+				"Cached segments were encoded with different codec headers.");
+		}
+
+		while (av_read_frame(input_format_context, packet) >= 0)
+		{
+			packet->stream_index = output_stream->index;
+			packet->pos = -1;
+			av_packet_rescale_ts(packet, input_stream->time_base, output_stream->time_base);
+			CHECK_AV_SUCCESS(av_interleaved_write_frame(output_format_context, packet));
+		}
+
+		avformat_close_input(&input_format_context);
+	}
+
+	if (output_stream)
+		CHECK_AV_SUCCESS(av_write_trailer(output_format_context));
+
+	av_packet_free(&packet);
+	avcodec_parameters_free(&first_codecpar);
+	if (output_stream && !(output_format_context->oformat->flags & AVFMT_NOFILE))
+		avio_closep(&output_format_context->pb);
+	avformat_free_context(output_format_context);
+}
+
+// exports through the segment cache: the source is split in key frame aligned segments, each keyed by the source
+// identity, its range, the key frames that affect it and the output settings, and only the segments whose key isn't
+// cached are rendered before all the segments are stitched into the outputs, progress gets the position in the source
+export CachedExportStats export_with_cache(const char* url, span<const ExportOutput> outputs, const SegmentCache& cache,
+	const ExportSettings& settings = {}, const function<void(double)>& progress = {})
+{
+	// the source identity, without hashing gigabytes of media
+	const auto source_path = filesystem::absolute(url);
+	Hasher source_hasher;
+	source_hasher.add(segment_cache_version).add(source_path.string()).add(filesystem::file_size(source_path))
+		.add(filesystem::last_write_time(source_path).time_since_epoch().count());
+	const auto source_key = source_hasher.value;
+
+	const auto index = source_index(url, cache, source_key);
+
+	const auto time_base = [&]
+	{
+		AVFormatContext* format_context{};
+		CHECK_AV_SUCCESS(avformat_open_input(&format_context, url, nullptr, nullptr));
+		CHECK_AV_SUCCESS(avformat_find_stream_info(format_context, nullptr));
+		const auto stream_index = av_find_best_stream(format_context, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+		const auto result = stream_index >= 0 ? av_q2d(format_context->streams[stream_index]->time_base) : 0.;
+		avformat_close_input(&format_context);
+		return result;
+	}();
+	CHECK_SUCCESS(time_base, "Could not find a video stream.");
+
+	const auto segments = split_segments(index.key_frames, index.end_pts, time_base);
+
+	CachedExportStats stats;
+	stats.segments = segments.size();
+
+	// the keys of every segment of every rendition, in output order
+	struct OutputSegments { const CropTrack* track; Rendition rendition; vector<uint64_t> keys; };
+	vector<OutputSegments> output_segments;
+	for (const auto& output : outputs)
+		for (const auto& rendition : output.renditions)
+		{
+			CHECK_SUCCESS(rendition.format == RenditionFormat::Encoded, "Raw renditions are streamed, they can't go through the segment cache.");
+			auto& current = output_segments.emplace_back(OutputSegments{ output.track, rendition });
+			for (const auto& segment : segments)
+			{
+				Hasher hasher{ source_key };
+				hasher.add(segment.from_pts).add(segment.to_pts);
+				hash_affecting_keyframes(hasher, output.track->keyframes, segment.from_pts, segment.to_pts);
+				hasher.add(rendition.size).add(settings.codec_name).add(settings.codec_options).add(settings.backend);
+				current.keys.push_back(hasher.value);
+			}
+		}
+
+	// render the missing segments, one decode per segment for all the renditions that miss it, from the one open source
+	optional<Exporter> exporter;
+	for (size_t segment_index = 0; segment_index < segments.size(); ++segment_index)
+	{
+		vector<ExportOutput> missing_outputs;
+		vector<uint64_t> missing_keys;
+		for (const auto& current : output_segments)
+		{
+			const auto key = current.keys[segment_index];
+			if (find(missing_keys.begin(), missing_keys.end(), key) != missing_keys.end())
+			{
+				++stats.shared;
+				continue;
+			}
+			if (cache.lookup(key))
+			{
+				++stats.reused;
+				continue;
+			}
+
+			// the renditions of a track share its boxes, and the scaling from the larger ones
+			missing_keys.push_back(key);
+			auto missing_output = find_if(missing_outputs.begin(), missing_outputs.end(), [&](const auto& output) { return output.track == current.track; });
+			if (missing_output == missing_outputs.end())
+				missing_output = missing_outputs.insert(missing_outputs.end(), ExportOutput{ current.track });
+			missing_output->renditions.push_back({ cache.path_for(key, ".partial.nut").string(), current.rendition.size });
+			++stats.rendered;
+		}
+		if (missing_outputs.empty()) continue;
+
+		// the frames of the segment are known from the index, so their boxes are evaluated in one batch per track
+		const auto& segment = segments[segment_index];
+		const auto frames_begin = lower_bound(index.frames.begin(), index.frames.end(), segment.from_pts);
+		const span<const int64_t> segment_frames(frames_begin, lower_bound(frames_begin, index.frames.end(), segment.to_pts));
+
+		if (!exporter) exporter.emplace(url, settings);
+		exporter->set_range(segment.from_pts, segment.to_pts);
+		for (const auto& missing_output : missing_outputs)
+			exporter->add_output(missing_output, segment_frames);
+		stats.frames += exporter->run(progress);
+
+		for (const auto key : missing_keys)
+			cache.insert(key, cache.path_for(key, ".partial.nut"));
+	}
+
+	for (const auto& current : output_segments)
+	{
+		vector<filesystem::path> segment_paths;
+		for (const auto key : current.keys)
+			segment_paths.push_back(cache.path_for(key));
+		stitch_segments(segment_paths, current.rendition.path);
+	}
+
+	cache.evict();
+
+	return stats;
+}
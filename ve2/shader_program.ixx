@@ -1,7 +1,7 @@
 ﻿module;
 
-#include <gl/glew.h>
-#include <glfw/glfw3.h>
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
 
 #include <string>
 #include <iostream>
@@ -0,0 +1,504 @@
+module;
+
+#include "libav.h"
+#include <memory>
+#include <vector>
+#include <string>
+#include <span>
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+
+export module smart_cut;
+
+import composition;
+
+using namespace std;
+
+#define CHECK_SUCCESS(cmd, errormsg) if(!(cmd)) { throw runtime_error(errormsg); }
+#define CHECK_AV_SUCCESS(cmd) [[gsl::suppress(bounds.3)]] { const int __res = (cmd); if(__res < 0) { char av_error_buffer[AV_ERROR_MAX_STRING_SIZE]; av_strerror(__res, av_error_buffer, sizeof(av_error_buffer)); throw runtime_error(av_error_buffer); } }
+
+export struct SmartCutSettings
+{
+	string codec_options = "preset=medium:forced-idr=1";		// key=value pairs separated by ':', for the boundary re-encodes
+};
+
+export struct SmartCutStats
+{
+	int64_t copied_gops{}, reencoded_gops{}, reencoded_frames{};
+};
+
+// a kept part of the source, in pts relative to the stream start, and where it starts in the output
+struct KeptPart
+{
+	int64_t from_pts, to_pts, output_pts;
+};
+
+// rewrites an annex b packet (start code delimited, what encoders produce without global headers) to the length
+// prefixed layout of avcC/hvcC streams, since the output keeps the source extradata
+AVPacket* annexb_to_length_prefixed(const AVPacket* packet, const int nal_length_size)
+{
+	const auto data = packet->data;
+	const auto size = static_cast<size_t>(packet->size);
+
+	// find the nal unit boundaries
+	vector<pair<size_t, size_t>> nal_units;
+	size_t position = 0, nal_start = SIZE_MAX;
+	while (position + 3 <= size)
+	{
+		if (data[position] == 0 && data[position + 1] == 0 && data[position + 2] == 1)
+		{
+			if (nal_start != SIZE_MAX)
+			{
+				// a 4 byte start code leaves a trailing zero on the previous unit
+				auto nal_end = position;
+				while (nal_end > nal_start && !data[nal_end - 1]) --nal_end;
+				nal_units.emplace_back(nal_start, nal_end);
+			}
+			position += 3;
+			nal_start = position;
+		}
+		else
+			++position;
+	}
+	if (nal_start != SIZE_MAX)
+		nal_units.emplace_back(nal_start, size);
+
+	size_t output_size{};
+	for (const auto& [from, to] : nal_units)
+		output_size += nal_length_size + to - from;
+
+	auto output = av_packet_alloc();
+	CHECK_AV_SUCCESS(av_new_packet(output, static_cast<int>(output_size)));
+	CHECK_AV_SUCCESS(av_packet_copy_props(output, packet));
+
+	auto out = output->data;
+	for (const auto& [from, to] : nal_units)
+	{
+		const auto length = to - from;
+		for (int byte = nal_length_size - 1; byte >= 0; --byte)
+			*out++ = static_cast<uint8_t>(length >> (byte * 8));
+		memcpy(out, data + from, length);
+		out += length;
+	}
+
+	return output;
+}
+
+// the parameter sets (sps, pps, and vps for hevc) of avcC/hvcC extradata, each prefixed with its length in nal_length_size
+// bytes, or annex b extradata as it is, nothing when there's no extradata
+vector<uint8_t> extradata_parameter_sets(const AVCodecParameters* codecpar, const int nal_length_size)
+{
+	const span<const uint8_t> extradata(codecpar->extradata, codecpar->extradata_size);
+	if (!nal_length_size)
+	{
+		const auto annexb = extradata.size() >= 3 && !extradata[0] && !extradata[1];
+		return annexb ? vector<uint8_t>(extradata.begin(), extradata.end()) : vector<uint8_t>();
+	}
+
+	vector<uint8_t> parameter_sets;
+	size_t position{};
+	const auto read_nal_unit = [&]
+	{
+		CHECK_SUCCESS(position + 2 <= extradata.size(), "Truncated parameter sets in the source extradata.");
+		const size_t length = (extradata[position] << 8) | extradata[position + 1];
+		position += 2;
+		CHECK_SUCCESS(position + length <= extradata.size(), "Truncated parameter sets in the source extradata.");
+
+		for (int byte = nal_length_size - 1; byte >= 0; --byte)
+			parameter_sets.push_back(static_cast<uint8_t>(length >> (byte * 8)));
+		parameter_sets.insert(parameter_sets.end(), extradata.begin() + position, extradata.begin() + position + length);
+		position += length;
+	};
+
+	if (codecpar->codec_id == AV_CODEC_ID_H264)
+	{
+		// the sequence then the picture parameter sets, each list prefixed with its count
+		const auto sps_count = extradata[5] & 0x1f;
+		position = 6;
+		for (int index = 0; index < sps_count; ++index) read_nal_unit();
+		CHECK_SUCCESS(position < extradata.size(), "Truncated parameter sets in the source extradata.");
+		const auto pps_count = extradata[position++];
+		for (int index = 0; index < pps_count; ++index) read_nal_unit();
+	}
+	else
+	{
+		// arrays of nal units of one type each
+		const auto array_count = extradata[22];
+		position = 23;
+		for (int array_index = 0; array_index < array_count; ++array_index)
+		{
+			CHECK_SUCCESS(position + 3 <= extradata.size(), "Truncated parameter sets in the source extradata.");
+			const auto nal_unit_count = (extradata[position + 1] << 8) | extradata[position + 2];
+			position += 3;
+			for (int index = 0; index < nal_unit_count; ++index) read_nal_unit();
+		}
+	}
+	return parameter_sets;
+}
+
+// a copy of the packet with the parameter sets in front of its own nal units
+AVPacket* prepend_parameter_sets(const AVPacket* packet, const vector<uint8_t>& parameter_sets)
+{
+	auto output = av_packet_alloc();
+	CHECK_AV_SUCCESS(av_new_packet(output, static_cast<int>(parameter_sets.size()) + packet->size));
+	CHECK_AV_SUCCESS(av_packet_copy_props(output, packet));
+	memcpy(output->data, parameter_sets.data(), parameter_sets.size());
+	memcpy(output->data + parameter_sets.size(), packet->data, packet->size);
+	return output;
+}
+
+class SmartCutter
+{
+	AVFormatContext* input_format_context{}, * output_format_context{};
+	AVStream* video_stream{};
+	vector<int> output_stream_indices;						// per input stream, -1 if the stream is dropped
+	AVCodecContext* decoder_context{}, * encoder_context{};
+	AVFrame* frame{};
+	AVPacket* packet{}, * encoded_packet{};
+
+	const SmartCutSettings& settings;
+	vector<KeptPart> parts;
+	int64_t start_pts{};
+	int64_t reorder_delay = -1;								// the largest pts - dts of the source, all the video output is shifted by it
+	int nal_length_size{};									// non zero if the output needs length prefixed nal units
+	vector<uint8_t> parameter_sets;							// the source's, in the layout of its packets
+	int gop_length{};
+
+	vector<AVPacket*> gop;									// the packets of the group of pictures being read
+	vector<AVPacket*> pending_audio;						// audio read before the reorder delay is known
+	bool first_frame_of_run{};
+	bool restore_parameter_sets{};							// the last run left the encoder's parameter sets in the stream
+
+public:
+	SmartCutStats stats;
+
+	SmartCutter(const char* url, const string& output_path, const Composition& composition, const SmartCutSettings& settings)
+		:settings(settings)
+	{
+		CHECK_AV_SUCCESS(avformat_open_input(&input_format_context, url, nullptr, nullptr));
+		CHECK_AV_SUCCESS(avformat_find_stream_info(input_format_context, nullptr));
+		CHECK_AV_SUCCESS(avformat_alloc_output_context2(&output_format_context, nullptr, nullptr, output_path.c_str()));
+
+		// keep the first video stream and every audio stream
+		for (const auto input_stream : span<AVStream*>(input_format_context->streams, input_format_context->nb_streams))
+		{
+			const auto codec_type = input_stream->codecpar->codec_type;
+			if ((codec_type != AVMEDIA_TYPE_VIDEO || video_stream) && codec_type != AVMEDIA_TYPE_AUDIO)
+			{
+				output_stream_indices.push_back(-1);
+				continue;
+			}
+			if (codec_type == AVMEDIA_TYPE_VIDEO)
+				video_stream = input_stream;
+
+			const auto output_stream = avformat_new_stream(output_format_context, nullptr);
+			CHECK_SUCCESS(output_stream, "Could not create the output stream.");
+			CHECK_AV_SUCCESS(avcodec_parameters_copy(output_stream->codecpar, input_stream->codecpar));
+			output_stream->codecpar->codec_tag = 0;
+			output_stream->time_base = input_stream->time_base;
+			output_stream_indices.push_back(output_stream->index);
+		}
+		CHECK_SUCCESS(video_stream, "Could not find a video stream.");
+		start_pts = video_stream->start_time == AV_NOPTS_VALUE ? 0 : video_stream->start_time;
+
+		const auto codecpar = video_stream->codecpar;
+		if (codecpar->extradata_size > 0 && codecpar->extradata[0] == 1)
+		{
+			if (codecpar->codec_id == AV_CODEC_ID_H264 && codecpar->extradata_size >= 7)
+				nal_length_size = (codecpar->extradata[4] & 3) + 1;
+			else if (codecpar->codec_id == AV_CODEC_ID_HEVC && codecpar->extradata_size >= 23)
+				nal_length_size = (codecpar->extradata[21] & 3) + 1;
+		}
+		if (codecpar->codec_id == AV_CODEC_ID_H264 || codecpar->codec_id == AV_CODEC_ID_HEVC)
+			parameter_sets = extradata_parameter_sets(codecpar, nal_length_size);
+
+		// the decoder for the partial groups of pictures
+		AVCodec const* codec_decoder = avcodec_find_decoder(codecpar->codec_id);
+		CHECK_SUCCESS(codec_decoder, "Could not find decoder codec.");
+		decoder_context = avcodec_alloc_context3(codec_decoder);
+		CHECK_AV_SUCCESS(avcodec_parameters_to_context(decoder_context, codecpar));
+		decoder_context->thread_count = 4;
+		decoder_context->thread_type = FF_THREAD_FRAME;
+		CHECK_AV_SUCCESS(avcodec_open2(decoder_context, codec_decoder, nullptr));
+
+		int64_t output_pts{};
+		for (const auto& part : composition)
+		{
+			parts.push_back({ part.from_pts, part.to_pts, output_pts });
+			output_pts += part.to_pts - part.from_pts;
+		}
+
+		if (!(output_format_context->oformat->flags & AVFMT_NOFILE))
+			CHECK_AV_SUCCESS(avio_open(&output_format_context->pb, output_path.c_str(), AVIO_FLAG_WRITE));
+		CHECK_AV_SUCCESS(avformat_write_header(output_format_context, nullptr));
+
+		frame = av_frame_alloc();
+		packet = av_packet_alloc();
+		encoded_packet = av_packet_alloc();
+	}
+
+	SmartCutter(const SmartCutter&) = delete;
+	SmartCutter& operator=(const SmartCutter&) = delete;
+
+	~SmartCutter()
+	{
+		for (auto& gop_packet : gop) av_packet_free(&gop_packet);
+		for (auto& audio_packet : pending_audio) av_packet_free(&audio_packet);
+		av_frame_free(&frame);
+		av_packet_free(&packet);
+		av_packet_free(&encoded_packet);
+		avcodec_free_context(&decoder_context);
+		avcodec_free_context(&encoder_context);
+		if (!(output_format_context->oformat->flags & AVFMT_NOFILE))
+			avio_closep(&output_format_context->pb);
+		avformat_free_context(output_format_context);
+		avformat_close_input(&input_format_context);
+	}
+
+	void run()
+	{
+		while (av_read_frame(input_format_context, packet) >= 0)
+		{
+			const auto input_stream = input_format_context->streams[packet->stream_index];
+			if (input_stream == video_stream)
+			{
+				// a key frame closes the previous group of pictures, which can now be copied or re-encoded as a whole
+				if ((packet->flags & AV_PKT_FLAG_KEY) && !gop.empty())
+					flush_gop(packet->pts - start_pts);
+				gop.push_back(av_packet_clone(packet));
+			}
+			else if (output_stream_indices[packet->stream_index] >= 0 && packet->pts != AV_NOPTS_VALUE)
+			{
+				if (reorder_delay < 0)
+					pending_audio.push_back(av_packet_clone(packet));
+				else
+					copy_audio_packet(packet);
+			}
+
+			av_packet_unref(packet);
+		}
+
+		if (!gop.empty())
+			flush_gop(INT64_MAX);
+		finish_run();
+
+		CHECK_AV_SUCCESS(av_write_trailer(output_format_context));
+	}
+
+private:
+	const KeptPart* find_part(const int64_t pts) const
+	{
+		auto part_it = upper_bound(parts.begin(), parts.end(), pts, [](const int64_t pts, const auto& part) { return pts < part.from_pts; });
+		if (part_it == parts.begin()) return nullptr;
+		--part_it;
+		return pts < part_it->to_pts ? &*part_it : nullptr;
+	}
+
+	bool overlaps_any_part(const int64_t from_pts, const int64_t to_pts) const
+	{
+		return any_of(parts.begin(), parts.end(), [&](const auto& part) { return part.from_pts < to_pts && part.to_pts > from_pts; });
+	}
+
+	void write_video_packet(AVPacket* output_packet, const int64_t pts, const int64_t dts)
+	{
+		const auto output_stream = output_format_context->streams[output_stream_indices[video_stream->index]];
+		output_packet->pts = pts;
+		output_packet->dts = dts;
+		output_packet->stream_index = output_stream->index;
+		output_packet->pos = -1;
+		av_packet_rescale_ts(output_packet, video_stream->time_base, output_stream->time_base);
+		CHECK_AV_SUCCESS(av_interleaved_write_frame(output_format_context, output_packet));
+	}
+
+	// audio packets are all key frames, they're kept if they start inside a kept part
+	void copy_audio_packet(AVPacket* audio_packet)
+	{
+		const auto input_stream = input_format_context->streams[audio_packet->stream_index];
+		const auto pts = av_rescale_q(audio_packet->pts, input_stream->time_base, video_stream->time_base) - start_pts;
+		const auto part = find_part(pts);
+		if (!part) return;
+
+		const auto offset = av_rescale_q(part->output_pts - part->from_pts - start_pts + reorder_delay, video_stream->time_base, input_stream->time_base);
+		const auto output_stream = output_format_context->streams[output_stream_indices[audio_packet->stream_index]];
+		audio_packet->pts += offset;
+		if (audio_packet->dts != AV_NOPTS_VALUE) audio_packet->dts += offset;
+		audio_packet->stream_index = output_stream->index;
+		audio_packet->pos = -1;
+		av_packet_rescale_ts(audio_packet, input_stream->time_base, output_stream->time_base);
+		CHECK_AV_SUCCESS(av_interleaved_write_frame(output_format_context, audio_packet));
+	}
+
+	void flush_gop(int64_t gop_to_pts)
+	{
+		const auto gop_from_pts = gop.front()->pts - start_pts;
+
+		// the last group of pictures ends with its last frame
+		if (gop_to_pts == INT64_MAX)
+		{
+			gop_to_pts = gop_from_pts;
+			for (const auto gop_packet : gop)
+				gop_to_pts = max(gop_to_pts, gop_packet->pts - start_pts + gop_packet->duration);
+		}
+
+		// the reorder delay is fixed from the first group of pictures, so the copied and re-encoded dts stay monotonic
+		if (reorder_delay < 0)
+		{
+			reorder_delay = 0;
+			for (const auto gop_packet : gop)
+				if (gop_packet->pts != AV_NOPTS_VALUE && gop_packet->dts != AV_NOPTS_VALUE)
+					reorder_delay = max(reorder_delay, gop_packet->pts - gop_packet->dts);
+			gop_length = static_cast<int>(gop.size());
+
+			for (auto& audio_packet : pending_audio)
+			{
+				copy_audio_packet(audio_packet);
+				av_packet_free(&audio_packet);
+			}
+			pending_audio.clear();
+		}
+
+		const auto part = find_part(gop_from_pts);
+		if (part && gop_to_pts <= part->to_pts)
+		{
+			// entirely inside a kept part, copy the packets as they are
+			finish_run();
+			const auto offset = part->output_pts - part->from_pts - start_pts;
+
+			// the re-encoded frames carry the encoder's parameter sets in band, under the same ids as the source's, so the
+			// copied key frame right after them has to bring the source's back
+			if (restore_parameter_sets && !parameter_sets.empty())
+			{
+				auto key_packet = prepend_parameter_sets(gop.front(), parameter_sets);
+				av_packet_free(&gop.front());
+				gop.front() = key_packet;
+			}
+			restore_parameter_sets = false;
+
+			for (const auto gop_packet : gop)
+				write_video_packet(gop_packet, gop_packet->pts + offset + reorder_delay, gop_packet->dts + offset + reorder_delay);
+			++stats.copied_gops;
+		}
+		else if (overlaps_any_part(gop_from_pts, gop_to_pts))
+		{
+			// straddles a cut, decode it and re-encode the frames that are kept
+			for (const auto gop_packet : gop)
+			{
+				CHECK_AV_SUCCESS(avcodec_send_packet(decoder_context, gop_packet));
+				receive_decoded_frames();
+			}
+			CHECK_AV_SUCCESS(avcodec_send_packet(decoder_context, nullptr));
+			receive_decoded_frames();
+			avcodec_flush_buffers(decoder_context);
+			++stats.reencoded_gops;
+		}
+
+		for (auto& gop_packet : gop) av_packet_free(&gop_packet);
+		gop.clear();
+	}
+
+	void receive_decoded_frames()
+	{
+		while (true)
+		{
+			const int res = avcodec_receive_frame(decoder_context, frame);
+			if (res == AVERROR(EAGAIN) || res == AVERROR_EOF) break;
+			CHECK_AV_SUCCESS(res);
+
+			const auto pts = frame->best_effort_timestamp - start_pts;
+			if (const auto part = find_part(pts))
+			{
+				if (!encoder_context) start_run();
+
+				frame->pts = pts - part->from_pts + part->output_pts;
+				frame->pict_type = first_frame_of_run ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+				first_frame_of_run = false;
+				encode(frame);
+				++stats.reencoded_frames;
+			}
+
+			av_frame_unref(frame);
+		}
+	}
+
+	// a run is a sequence of re-encoded frames between copied groups of pictures, it gets its own encoder so it can
+	// be fully flushed before the copied packets continue the stream
+	void start_run()
+	{
+		const auto codecpar = video_stream->codecpar;
+		AVCodec const* codec = avcodec_find_encoder(codecpar->codec_id);
+		CHECK_SUCCESS(codec, "Could not find an encoder matching the source codec.");
+
+		// match the source parameters so the re-encoded frames can be spliced between the copied ones, without b frames
+		// so their dts can be placed right before the next copied key frame
+		encoder_context = avcodec_alloc_context3(codec);
+		encoder_context->width = codecpar->width;
+		encoder_context->height = codecpar->height;
+		encoder_context->pix_fmt = static_cast<AVPixelFormat>(codecpar->format);
+		encoder_context->sample_aspect_ratio = codecpar->sample_aspect_ratio;
+		encoder_context->time_base = video_stream->time_base;
+		encoder_context->framerate = av_guess_frame_rate(input_format_context, video_stream, nullptr);
+		encoder_context->profile = codecpar->profile;
+		encoder_context->level = codecpar->level;
+		encoder_context->bit_rate = codecpar->bit_rate;
+		encoder_context->color_range = codecpar->color_range;
+		encoder_context->color_primaries = codecpar->color_primaries;
+		encoder_context->color_trc = codecpar->color_trc;
+		encoder_context->colorspace = codecpar->color_space;
+		encoder_context->chroma_sample_location = codecpar->chroma_location;
+		encoder_context->field_order = codecpar->field_order;
+		encoder_context->gop_size = gop_length;
+		encoder_context->max_b_frames = 0;
+
+		AVDictionary* options{};
+		av_dict_parse_string(&options, settings.codec_options.c_str(), "=", ":", 0);
+		const int open_result = avcodec_open2(encoder_context, codec, &options);
+		av_dict_free(&options);
+		CHECK_AV_SUCCESS(open_result);
+
+		first_frame_of_run = true;
+	}
+
+	void finish_run()
+	{
+		if (!encoder_context) return;
+
+		encode(nullptr);
+		avcodec_free_context(&encoder_context);
+		restore_parameter_sets = true;
+	}
+
+	void encode(const AVFrame* frame)
+	{
+		CHECK_AV_SUCCESS(avcodec_send_frame(encoder_context, frame));
+
+		while (true)
+		{
+			const int res = avcodec_receive_packet(encoder_context, encoded_packet);
+			if (res == AVERROR(EAGAIN) || res == AVERROR_EOF) break;
+			CHECK_AV_SUCCESS(res);
+
+			// without b frames dts == pts, shifted back by the reorder delay to sit before the copied dts
+			const auto pts = encoded_packet->pts;
+			if (nal_length_size)
+			{
+				auto converted_packet = annexb_to_length_prefixed(encoded_packet, nal_length_size);
+				write_video_packet(converted_packet, pts + reorder_delay, pts);
+				av_packet_free(&converted_packet);
+				av_packet_unref(encoded_packet);
+			}
+			else
+				write_video_packet(encoded_packet, pts + reorder_delay, pts);
+		}
+	}
+};
+
+// exports the kept parts of the composition without re-encoding: every group of pictures entirely inside a part is
+// copied as is, only the ones straddling a cut are decoded and re-encoded with matching parameters
+// the source must be closed-gop for the copied groups to decode on their own
+export SmartCutStats smart_cut_export(const char* url, const string& output_path, const Composition& composition, const SmartCutSettings& settings = {})
+{
+	SmartCutter smart_cutter(url, output_path, composition, settings);
+	smart_cutter.run();
+	return smart_cutter.stats;
+}
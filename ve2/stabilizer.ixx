@@ -0,0 +1,321 @@
+module;
+
+#include "libav.h"
+#include "trace.h"
+#include <glm/glm.hpp>
+#include <string>
+#include <vector>
+#include <optional>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <limits>
+#include <cstdlib>
+#include <cstdint>
+#include <stdexcept>
+
+export module stabilizer;
+
+import decoder;
+import luma_pyramid;
+import keyframes;
+import keyframe_filters;
+import metrics;
+import trace;
+import utilities;
+
+using namespace std;
+using namespace glm;
+
+#define CHECK_SUCCESS(cmd, errormsg) if(!(cmd)) { throw runtime_error(errormsg); }
+
+// the frames are matched on a grid of this many blocks, each this many pixels a side on every level
+constexpr ivec2 stabilizer_block_grid{ 8, 6 };
+constexpr int stabilizer_block_size = 16;
+
+// the full search runs this many levels above the analysis level, the levels in between only refine it by a pixel
+constexpr int stabilizer_search_levels = 2;
+
+// blocks whose best match isn't better than the matches around it by this much per pixel are too flat to tell
+constexpr int stabilizer_min_texture = 2;
+
+// chunks per job, so the jobs all stay busy to the end when the chunks take uneven times
+constexpr int stabilizer_chunks_per_job = 4;
+
+export struct StabilizerSettings
+{
+	float zoom_margin = .1f;				// the fraction of the frame cropped away on each axis, the room to cancel the shake in
+	float shake_noise = .01f;				// how far the camera shakes around the path it's meant to follow, as a fraction of the frame
+	float acceleration_noise = .02f;		// how quickly that path may change its speed, in frames per second squared
+	int analysis_width = 480;				// the frames are matched on the first pyramid level at most this wide
+	int search_radius = 4;					// the full search's reach, in pixels of its level
+	int job_count = std::max(1, static_cast<int>(thread::hardware_concurrency()));
+};
+
+// how the content of a frame moved from the frame before, as a fraction of the frame
+struct FrameMotion
+{
+	int64_t pts;
+	vec2 motion;
+};
+
+// the pyramid levels the matching runs on, for a source of this size
+struct MatchingLevels
+{
+	int analysis_level{}, search_level{};
+
+	MatchingLevels(const ivec2& frame_size, const StabilizerSettings& settings)
+	{
+		const auto level_count = pyramid_level_count(frame_size, numeric_limits<int>::max());
+		while (analysis_level + 1 < level_count && (frame_size.x >> analysis_level) > settings.analysis_width) ++analysis_level;
+		search_level = std::min(analysis_level + stabilizer_search_levels, level_count - 1);
+	}
+};
+
+bool block_inside(const LumaPlane& plane, const ivec2& origin)
+{
+	return all(greaterThanEqual(origin, ivec2(0))) && all(lessThanEqual(origin + stabilizer_block_size, plane.size));
+}
+
+// the sum of absolute differences of two blocks, plain enough for the compiler to vectorize
+int block_sad(const LumaPlane& a, const ivec2& a_origin, const LumaPlane& b, const ivec2& b_origin)
+{
+	int sad{};
+	for (int y = 0; y < stabilizer_block_size; ++y)
+	{
+		const auto row_a = a.row(a_origin.y + y) + a_origin.x, row_b = b.row(b_origin.y + y) + b_origin.x;
+		for (int x = 0; x < stabilizer_block_size; ++x)
+			sad += abs(row_a[x] - row_b[x]);
+	}
+	return sad;
+}
+
+// how the content of the block centered at position, in fractions of the frame, moved between the frames, in pixels of
+// the analysis level: a full search on the search level refined by a pixel on every level below it, then to a fraction
+// of a pixel on the parabolas through the costs around the best match, nothing for flat blocks or ones leaving the frame
+optional<vec2> block_displacement(const vector<LumaPlane>& previous, const vector<LumaPlane>& current, const vec2& position,
+	const MatchingLevels& levels, const int search_radius)
+{
+	// the blocks near the edges are pulled into the coarser levels, the motion is the same over the whole frame anyway
+	const auto block_origin = [&](const int level)
+	{
+		const auto& plane = current[level];
+		return glm::clamp(ivec2(position * vec2(plane.size)) - stabilizer_block_size / 2, ivec2(0), plane.size - stabilizer_block_size);
+	};
+
+	ivec2 displacement{};
+	for (int level = levels.search_level; level >= levels.analysis_level; --level)
+	{
+		const auto& previous_plane = previous[level];
+		const auto& plane = current[level];
+		const auto origin = block_origin(level);
+
+		if (level != levels.search_level) displacement *= 2;
+		const auto radius = level == levels.search_level ? search_radius : 1;
+
+		auto best_sad = numeric_limits<int>::max();
+		auto best = displacement;
+		for (int dy = -radius; dy <= radius; ++dy)
+			for (int dx = -radius; dx <= radius; ++dx)
+			{
+				const auto candidate = displacement + ivec2(dx, dy);
+				if (!block_inside(plane, origin + candidate)) continue;
+
+				const auto sad = block_sad(previous_plane, origin, plane, origin + candidate);
+				if (sad < best_sad)
+				{
+					best_sad = sad;
+					best = candidate;
+				}
+			}
+		if (best_sad == numeric_limits<int>::max()) return {};
+		displacement = best;
+	}
+
+	const auto& previous_plane = previous[levels.analysis_level];
+	const auto& plane = current[levels.analysis_level];
+	const auto origin = block_origin(levels.analysis_level);
+	const auto cost = [&](const ivec2& candidate) { return block_inside(plane, origin + candidate) ? block_sad(previous_plane, origin, plane, origin + candidate) : -1; };
+
+	const auto center = cost(displacement);
+	const auto left = cost(displacement - ivec2(1, 0)), right = cost(displacement + ivec2(1, 0));
+	const auto up = cost(displacement - ivec2(0, 1)), down = cost(displacement + ivec2(0, 1));
+	if (left < 0 || right < 0 || up < 0 || down < 0) return vec2(displacement);
+	if ((left + right + up + down) / 4 - center < stabilizer_min_texture * stabilizer_block_size * stabilizer_block_size) return {};
+
+	const auto parabola = [](const int before, const int best, const int after)
+	{
+		const auto curvature = before - 2 * best + after;
+		return curvature > 0 ? .5f * static_cast<float>(before - after) / static_cast<float>(curvature) : 0.f;
+	};
+	return vec2(displacement) + vec2(parabola(left, center, right), parabola(up, center, down));
+}
+
+// the median displacement of the blocks, which ignores the few on something moving on its own, as a fraction of the
+// frame, or nothing when no block could be matched, like across a cut to a flat frame
+optional<vec2> global_motion(const vector<LumaPlane>& previous, const vector<LumaPlane>& current, const MatchingLevels& levels,
+	const int search_radius, vector<float>& motions_x, vector<float>& motions_y)
+{
+	motions_x.clear();
+	motions_y.clear();
+	for (int y = 0; y < stabilizer_block_grid.y; ++y)
+		for (int x = 0; x < stabilizer_block_grid.x; ++x)
+			if (const auto displacement = block_displacement(previous, current, (vec2(x, y) + .5f) / vec2(stabilizer_block_grid), levels, search_radius))
+			{
+				motions_x.push_back(displacement->x);
+				motions_y.push_back(displacement->y);
+			}
+	if (motions_x.empty()) return {};
+
+	const auto middle = motions_x.size() / 2;
+	nth_element(motions_x.begin(), motions_x.begin() + middle, motions_x.end());
+	nth_element(motions_y.begin(), motions_y.begin() + middle, motions_y.end());
+	return vec2{ motions_x[middle], motions_y[middle] } / vec2(current[levels.analysis_level].size);
+}
+
+// where the chunks start, about chunk_count of them, all on key frames so every chunk decodes on its own, the first one
+// starts with the source
+vector<int64_t> chunk_starts(Decoder& decoder, const int chunk_count)
+{
+	vector<int64_t> key_pts;
+	if (const auto format_context = decoder.format())
+	{
+		const auto stream_index = decoder.stream()->index;
+		auto packet = av_packet_alloc();
+		while (av_read_frame(format_context, packet) >= 0)
+		{
+			if (packet->stream_index == stream_index && (packet->flags & AV_PKT_FLAG_KEY) && packet->pts != AV_NOPTS_VALUE)
+				key_pts.push_back(packet->pts);
+			av_packet_unref(packet);
+		}
+		av_packet_free(&packet);
+		sort(key_pts.begin(), key_pts.end());
+	}
+	else
+	{
+		// y4m frames all stand on their own, and their pts are their index
+		for (int64_t frame = 0; frame < decoder.duration_pts(); ++frame)
+			key_pts.push_back(frame);
+	}
+
+	vector<int64_t> starts{ numeric_limits<int64_t>::min() };
+	const auto step = std::max<size_t>(key_pts.size() / std::max(chunk_count, 1), 1);
+	for (auto index = step; index < key_pts.size(); index += step)
+		starts.push_back(key_pts[index]);
+	return starts;
+}
+
+// the motion of every frame in [from_pts, to_pts) and of the first one past it, which the chunk after can't measure
+// since it starts with it, the first frame of the source starts the path without moving
+vector<FrameMotion> chunk_motions(const char* url, const int64_t from_pts, const int64_t to_pts, const MatchingLevels& levels,
+	const StabilizerSettings& settings)
+{
+	// the chunks already keep every core busy
+	Decoder decoder(url, 1, true);
+	const auto first_chunk = from_pts == numeric_limits<int64_t>::min();
+	if (!first_chunk) decoder.seek_pts(from_pts);
+
+	vector<FrameMotion> motions;
+	vector<LumaPlane> previous, current;
+	vector<float> motions_x, motions_y;
+	while (const auto frame = decoder.next_frame())
+	{
+		const auto pts = frame->best_effort_timestamp;
+		if (pts < from_pts) continue;
+		CHECK_SUCCESS(has_planar_luma(static_cast<AVPixelFormat>(frame->format)), "The stabilizer only reads 8 bit planar luma.");
+
+		build_pyramid(frame, levels.search_level + 1, current);
+		if (!previous.empty())
+			motions.push_back({ pts, global_motion(previous, current, levels, settings.search_radius, motions_x, motions_y).value_or(vec2(0)) });
+		else if (first_chunk)
+			motions.push_back({ pts, vec2(0) });
+
+		if (pts >= to_pts) break;
+		swap(previous, current);
+	}
+	return motions;
+}
+
+// a crop track that cancels the camera shake of the source: the global motion of every frame is measured by block
+// matching on a downscaled luma pyramid, over chunks of groups of pictures decoded in parallel, summed into the path of
+// the content, and smoothed into the path the camera was meant to follow, the crop then follows the difference between
+// the two, as far as the zoom margin lets it, a key frame per frame
+export KeyFrames stabilize(const char* url, const StabilizerSettings& settings = {})
+{
+	static Histogram& chunk_time = metrics_histogram("stabilizer.chunk");
+
+	ivec2 frame_size;
+	double time_base;
+	vector<int64_t> starts;
+	{
+		Decoder probe(url);
+		frame_size = probe.frame_size();
+		time_base = av_q2d(probe.time_base());
+		starts = chunk_starts(probe, settings.job_count * stabilizer_chunks_per_job);
+	}
+	const MatchingLevels levels(frame_size, settings);
+
+	vector<vector<FrameMotion>> chunks(starts.size());
+	atomic<size_t> next_chunk{};
+	mutex error_mutex;
+	string error;
+	const auto worker = [&]
+	{
+		for (size_t index; (index = next_chunk.fetch_add(1)) < chunks.size();)
+		{
+			try
+			{
+				TRACE_SCOPE("stabilizer_chunk");
+				ScopedTimer timer(chunk_time);
+				chunks[index] = chunk_motions(url, starts[index], index + 1 < starts.size() ? starts[index + 1] : numeric_limits<int64_t>::max(), levels, settings);
+			}
+			catch (const exception& e)
+			{
+				lock_guard lock(error_mutex);
+				error = e.what();
+			}
+		}
+	};
+
+	vector<thread> jobs;
+	for (int job = 1; job < std::min(settings.job_count, static_cast<int>(chunks.size())); ++job)
+		jobs.emplace_back(worker);
+	worker();
+	for (auto& job : jobs)
+		job.join();
+	CHECK_SUCCESS(error.empty(), error.c_str());
+
+	// the path of the content, and the one the camera was meant to follow
+	vector<int64_t> pts;
+	vector<double> times, path_x, path_y;
+	dvec2 position{};
+	for (const auto& chunk : chunks)
+		for (const auto& [frame_pts, motion] : chunk)
+		{
+			position += dvec2(motion);
+			pts.push_back(frame_pts);
+			times.push_back(frame_pts * time_base);
+			path_x.push_back(position.x);
+			path_y.push_back(position.y);
+		}
+
+	auto smooth_x = path_x, smooth_y = path_y;
+	if (pts.size() > 1)
+	{
+		const auto process_noise = static_cast<double>(settings.acceleration_noise) * settings.acceleration_noise;
+		const auto measurement_noise = static_cast<double>(settings.shake_noise) * settings.shake_noise;
+		smooth_channel(times, smooth_x, process_noise, measurement_noise);
+		smooth_channel(times, smooth_y, process_noise, measurement_noise);
+	}
+
+	const auto size = static_cast<double>(1 - settings.zoom_margin);
+	const auto reach = dvec2((1 - size) / 2);
+	KeyFrames keyframes;
+	for (size_t index = 0; index < pts.size(); ++index)
+	{
+		const auto center = dvec2(.5) + glm::clamp(dvec2(path_x[index] - smooth_x[index], path_y[index] - smooth_y[index]), -reach, reach);
+		keyframes.append(pts[index], { { vec2(center - size / 2), vec2(center + size / 2) } });
+	}
+	return keyframes;
+}
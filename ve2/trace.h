@@ -0,0 +1,13 @@
+#pragma once
+
+// scoped trace events for the timeline export in the trace module, the names must be string literals
+// building without VE2_TRACE compiles them out entirely
+#ifdef VE2_TRACE
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#define TRACE_SCOPE(name) const TraceScope TRACE_CONCAT(__trace_scope_, __LINE__)(name)
+#define TRACE_THREAD_NAME(name) trace_thread_name(name)
+#else
+#define TRACE_SCOPE(name)
+#define TRACE_THREAD_NAME(name)
+#endif
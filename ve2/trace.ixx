@@ -0,0 +1,168 @@
+module;
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <algorithm>
+#include <cstdio>
+
+export module trace;
+
+using namespace std;
+
+// events per thread kept between the start and the end of a recording, the oldest are overwritten past that
+constexpr size_t trace_buffer_capacity = 1 << 18;
+
+// a ring slot, the fields are relaxed atomics so that trace_stop can read a slot its thread is overwriting, the sequence
+// tells it whether what it read is whole
+struct TraceEvent
+{
+	atomic<uint64_t> sequence;					// the write index of the event plus one once it's written, 0 while it's being written
+	atomic<const char*> name;
+	atomic<int64_t> start_ns, duration_ns;
+};
+
+// written by its own thread only, the write index is published after the event so the writer never locks
+struct ThreadTraceBuffer
+{
+	unique_ptr<TraceEvent[]> events = make_unique<TraceEvent[]>(trace_buffer_capacity);
+	atomic<uint64_t> write_index{};
+	uint64_t recording_start_index{};
+	string thread_name;
+	int thread_id{};
+};
+
+struct TraceState
+{
+	atomic<bool> recording{};
+	chrono::steady_clock::time_point epoch = chrono::steady_clock::now();
+
+	mutex buffers_mutex;
+	vector<unique_ptr<ThreadTraceBuffer>> buffers;			// never freed, the threads may outlive a recording
+};
+
+TraceState& trace_state()
+{
+	static TraceState instance;
+	return instance;
+}
+
+ThreadTraceBuffer& thread_trace_buffer()
+{
+	thread_local ThreadTraceBuffer* buffer = []
+	{
+		auto& state = trace_state();
+		lock_guard lock(state.buffers_mutex);
+		auto& new_buffer = *state.buffers.emplace_back(make_unique<ThreadTraceBuffer>());
+		new_buffer.thread_id = static_cast<int>(state.buffers.size());
+		new_buffer.recording_start_index = new_buffer.write_index.load(memory_order_relaxed);
+		return &new_buffer;
+	}();
+	return *buffer;
+}
+
+int64_t trace_now_ns() { return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - trace_state().epoch).count(); }
+
+export bool trace_recording() { return trace_state().recording.load(memory_order_relaxed); }
+
+// names the calling thread in the timeline
+export void trace_thread_name(const char* name)
+{
+	auto& buffer = thread_trace_buffer();
+	lock_guard lock(trace_state().buffers_mutex);
+	buffer.thread_name = name;
+}
+
+// times its scope while a recording is running, use through TRACE_SCOPE so it can be compiled out
+export class TraceScope
+{
+	const char* name;
+	int64_t start_ns = -1;
+
+public:
+	TraceScope(const char* name) :name(name)
+	{
+		if (trace_recording())
+			start_ns = trace_now_ns();
+	}
+
+	TraceScope(const TraceScope&) = delete;
+	TraceScope& operator=(const TraceScope&) = delete;
+
+	~TraceScope()
+	{
+		if (start_ns < 0) return;
+
+		auto& buffer = thread_trace_buffer();
+		const auto index = buffer.write_index.load(memory_order_relaxed);
+		auto& event = buffer.events[index % trace_buffer_capacity];
+		event.sequence.store(0, memory_order_relaxed);
+		atomic_thread_fence(memory_order_release);
+		event.name.store(name, memory_order_relaxed);
+		event.start_ns.store(start_ns, memory_order_relaxed);
+		event.duration_ns.store(trace_now_ns() - start_ns, memory_order_relaxed);
+		event.sequence.store(index + 1, memory_order_release);
+		buffer.write_index.store(index + 1, memory_order_release);
+	}
+};
+
+export void trace_start()
+{
+	auto& state = trace_state();
+	{
+		lock_guard lock(state.buffers_mutex);
+		for (auto& buffer : state.buffers)
+			buffer->recording_start_index = buffer->write_index.load(memory_order_acquire);
+	}
+	state.recording.store(true, memory_order_relaxed);
+}
+
+// ends the recording and writes it as chrome trace json, which both chrome://tracing and perfetto open
+export void trace_stop(const char* path)
+{
+	auto& state = trace_state();
+	state.recording.store(false, memory_order_relaxed);
+
+	ofstream output(path);
+	output << "{\"traceEvents\":[";
+
+	const char* separator = "\n";
+	char event_json[512];
+	lock_guard lock(state.buffers_mutex);
+	for (const auto& buffer : state.buffers)
+	{
+		if (!buffer->thread_name.empty())
+		{
+			snprintf(event_json, sizeof(event_json), "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+				separator, buffer->thread_id, buffer->thread_name.c_str());
+			output << event_json;
+			separator = ",\n";
+		}
+
+		// the scopes that were open when the recording stopped still write their events, and may wrap over the oldest
+		// slots while they're read here, those are skipped rather than written out torn
+		const auto end_index = buffer->write_index.load(memory_order_acquire);
+		const auto start_index = std::max(buffer->recording_start_index, end_index > trace_buffer_capacity ? end_index - trace_buffer_capacity : 0);
+		for (auto index = start_index; index < end_index; ++index)
+		{
+			const auto& event = buffer->events[index % trace_buffer_capacity];
+			const auto sequence = event.sequence.load(memory_order_acquire);
+			const auto name = event.name.load(memory_order_relaxed);
+			const auto start_ns = event.start_ns.load(memory_order_relaxed);
+			const auto duration_ns = event.duration_ns.load(memory_order_relaxed);
+			atomic_thread_fence(memory_order_acquire);
+			if (sequence != index + 1 || event.sequence.load(memory_order_relaxed) != sequence) continue;
+
+			snprintf(event_json, sizeof(event_json), "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+				separator, name, buffer->thread_id, start_ns / 1000., duration_ns / 1000.);
+			output << event_json;
+			separator = ",\n";
+		}
+	}
+
+	output << "\n]}\n";
+}
@@ -0,0 +1,498 @@
+module;
+
+#include "libav.h"
+#include "trace.h"
+#include <glm/glm.hpp>
+#include <string>
+#include <vector>
+#include <deque>
+#include <span>
+#include <optional>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+
+export module tracker;
+
+import decoder;
+import luma_pyramid;
+import metrics;
+import trace;
+import utilities;
+
+using namespace std;
+using namespace glm;
+
+#define CHECK_SUCCESS(cmd, errormsg) if(!(cmd)) { throw runtime_error(errormsg); }
+
+// pyramids in flight between the decoding and the tracking threads, they're recycled once tracked
+constexpr int tracker_queue_max_length = 8;
+
+// the box is sampled on a grid this many points a side on every level, whatever its size, so a frame costs the same to
+// track for a small box as for one covering the whole frame
+constexpr int tracker_grid_size = 32;
+
+// the levels where the box spans fewer pixels than this are too coarse to hold its texture and are skipped
+constexpr float tracker_min_box_pixels = 8;
+
+// with fewer motion vectors than this inside the box, it keeps moving the way it did
+constexpr size_t tracker_min_motion_blocks = 4;
+
+// pixels runs lucas-kanade on every frame, motion vectors moves the box along the vectors the decoder found for its
+// blocks and only looks at the pixels every so often, to correct the drift, at close to the cost of decoding alone
+export enum class TrackerMode { Pixels, MotionVectors };
+
+export struct TrackerSettings
+{
+	TrackerMode mode = TrackerMode::Pixels;
+	int reanchor_interval = 30;					// in frames, motion vectors mode also re-anchors on every intra frame
+	int pyramid_levels = 5;
+	int iterations = 20;						// lucas-kanade steps per level, at most
+	float convergence_pixels = .01f;			// a level is done once a step moves the box less than this
+	float min_correlation = .5f;				// below this against the box on the first frame, the target is lost
+	int decoder_thread_count = std::max(2, static_cast<int>(thread::hardware_concurrency()) - 2);
+};
+
+export enum class TrackerState { Running, Finished, Lost, Failed };
+
+// the motion of a block from the frame before, in source pixels
+struct BlockMotion
+{
+	vec2 center, motion;
+};
+
+// a decoded frame as the tracking thread sees it: the luma at halving resolutions of the frames the pixels place the box
+// on, level 0 being the source's, and the motion of the blocks of the others
+struct TrackerFrame
+{
+	int64_t pts{};
+	ivec2 size{};
+	bool anchor{};
+	vector<LumaPlane> levels;
+	vector<BlockMotion> block_motions;
+};
+
+// the vectors of the blocks predicted from an earlier frame, per frame: they span the reference_distance frames back to
+// the reference, which with b frames in between isn't the frame right before, the blocks predicted from later frames would
+// need the distance forward and are left out
+void extract_block_motions(const AVFrame* frame, const int64_t reference_distance, vector<BlockMotion>& block_motions)
+{
+	block_motions.clear();
+	const auto side_data = av_frame_get_side_data(frame, AV_FRAME_DATA_MOTION_VECTORS);
+	if (!side_data) return;
+
+	for (const auto& motion_vector : span(reinterpret_cast<const AVMotionVector*>(side_data->data), side_data->size / sizeof(AVMotionVector)))
+		if (motion_vector.source < 0 && motion_vector.motion_scale)
+			block_motions.push_back({ { motion_vector.dst_x, motion_vector.dst_y },
+				-vec2(motion_vector.motion_x, motion_vector.motion_y) / (static_cast<float>(motion_vector.motion_scale) * static_cast<float>(reference_distance)) });
+}
+
+// the median motion of the blocks centered inside the box, which ignores the few following something else, or nothing
+// when too few of them are
+optional<vec2> box_motion(const vector<BlockMotion>& block_motions, const box2& box, vector<float>& motions_x, vector<float>& motions_y)
+{
+	motions_x.clear();
+	motions_y.clear();
+	for (const auto& block : block_motions)
+		if (all(greaterThanEqual(block.center, box.v0)) && all(lessThan(block.center, box.v1)))
+		{
+			motions_x.push_back(block.motion.x);
+			motions_y.push_back(block.motion.y);
+		}
+	if (motions_x.size() < tracker_min_motion_blocks) return {};
+
+	const auto middle = motions_x.size() / 2;
+	nth_element(motions_x.begin(), motions_x.begin() + middle, motions_x.end());
+	nth_element(motions_y.begin(), motions_y.begin() + middle, motions_y.end());
+	return vec2{ motions_x[middle], motions_y[middle] };
+}
+
+// the spacing of the grid over a box of this size
+vec2 grid_step(const vec2& box_size) { return box_size / static_cast<float>(tracker_grid_size - 1); }
+
+void sample_grid(const LumaPlane& plane, const vec2& origin, const vec2& step, vector<float>& values)
+{
+	values.resize(tracker_grid_size * tracker_grid_size);
+	for (int y = 0; y < tracker_grid_size; ++y)
+		for (int x = 0; x < tracker_grid_size; ++x)
+			values[y * tracker_grid_size + x] = plane.sample(origin + step * vec2(x, y));
+}
+
+// normalized cross correlation, 1 for the same texture whatever the brightness and contrast
+float correlation(const vector<float>& a, const vector<float>& b)
+{
+	float sum_a{}, sum_b{}, sum_aa{}, sum_bb{}, sum_ab{};
+	for (size_t index = 0; index < a.size(); ++index)
+	{
+		sum_a += a[index];
+		sum_b += b[index];
+		sum_aa += a[index] * a[index];
+		sum_bb += b[index] * b[index];
+		sum_ab += a[index] * b[index];
+	}
+
+	const auto count = static_cast<float>(a.size());
+	const auto covariance = sum_ab - sum_a * sum_b / count;
+	const auto variance = (sum_aa - sum_a * sum_a / count) * (sum_bb - sum_b * sum_b / count);
+	return variance > 0 ? covariance / sqrt(variance) : 0;
+}
+
+// the grids of a tracking step, kept across frames to not reallocate them
+struct TrackingScratch
+{
+	vector<float> template_values, gradient_x, gradient_y, values;
+	vector<float> motions_x, motions_y;
+};
+
+// how the box moved from the previous anchor onto the current frame, in source pixels: inverse compositional lucas-kanade
+// on the translation, coarse to fine, starting each level from what the one above found and the coarsest from motion
+vec2 track_motion(const TrackerFrame& previous, const TrackerFrame& current, const box2& box, vec2 motion, const TrackerSettings& settings,
+	TrackingScratch& scratch)
+{
+	const auto level_count = static_cast<int>(std::min(previous.levels.size(), current.levels.size()));
+	for (int level = level_count - 1; level >= 0; --level)
+	{
+		const auto scale = 1.f / static_cast<float>(1 << level);
+		const auto size = box.size() * scale;
+		if (level > 0 && std::min(size.x, size.y) < tracker_min_box_pixels) continue;
+
+		const auto origin = box.v0 * scale;
+		const auto step = grid_step(size);
+		const auto& template_plane = previous.levels[level];
+		const auto& plane = current.levels[level];
+
+		// the template and its central differences, the gradients stay fixed for every step, which is what makes the
+		// hessian a one time cost
+		sample_grid(template_plane, origin, step, scratch.template_values);
+		auto& gradient_x = scratch.gradient_x;
+		auto& gradient_y = scratch.gradient_y;
+		sample_grid(template_plane, origin - vec2(1, 0), step, gradient_x);
+		sample_grid(template_plane, origin + vec2(1, 0), step, scratch.values);
+		for (size_t index = 0; index < gradient_x.size(); ++index)
+			gradient_x[index] = (scratch.values[index] - gradient_x[index]) * .5f;
+		sample_grid(template_plane, origin - vec2(0, 1), step, gradient_y);
+		sample_grid(template_plane, origin + vec2(0, 1), step, scratch.values);
+		for (size_t index = 0; index < gradient_y.size(); ++index)
+			gradient_y[index] = (scratch.values[index] - gradient_y[index]) * .5f;
+
+		float hessian_xx{}, hessian_xy{}, hessian_yy{};
+		for (size_t index = 0; index < gradient_x.size(); ++index)
+		{
+			hessian_xx += gradient_x[index] * gradient_x[index];
+			hessian_xy += gradient_x[index] * gradient_y[index];
+			hessian_yy += gradient_y[index] * gradient_y[index];
+		}
+		const auto determinant = hessian_xx * hessian_yy - hessian_xy * hessian_xy;
+		if (determinant < 1) continue;			// flat at this level, the finer ones may still have texture
+
+		auto offset = motion * scale;
+		for (int iteration = 0; iteration < settings.iterations; ++iteration)
+		{
+			sample_grid(plane, origin + offset, step, scratch.values);
+
+			// the mean difference is a change of brightness rather than motion
+			float mean_error{};
+			for (size_t index = 0; index < scratch.values.size(); ++index)
+				mean_error += scratch.values[index] - scratch.template_values[index];
+			mean_error /= static_cast<float>(scratch.values.size());
+
+			float b_x{}, b_y{};
+			for (size_t index = 0; index < scratch.values.size(); ++index)
+			{
+				const auto error = scratch.values[index] - scratch.template_values[index] - mean_error;
+				b_x += gradient_x[index] * error;
+				b_y += gradient_y[index] * error;
+			}
+
+			const vec2 delta{ (hessian_yy * b_x - hessian_xy * b_y) / determinant, (hessian_xx * b_y - hessian_xy * b_x) / determinant };
+			offset -= delta;
+			if (length(delta) < settings.convergence_pixels) break;
+		}
+		motion = offset / scale;
+	}
+	return motion;
+}
+
+struct TrackerImpl
+{
+	string url;
+	int64_t start_pts;
+	box2 start_box;
+	function<void()> keyframes_available;
+	TrackerSettings settings;
+
+	mutex queue_mutex;
+	condition_variable queue_cv;
+	deque<unique_ptr<TrackerFrame>> decoded;			// in decoding order, a null entry marks the end of the source
+	vector<unique_ptr<TrackerFrame>> free_frames;
+	int allocated_frames{};
+	bool stopping{};
+
+	mutex tracked_mutex;
+	vector<pair<int64_t, box2>> tracked;
+	string error;
+	atomic<TrackerState> state = TrackerState::Running;
+
+	thread decoding_thread, tracking_thread;
+
+	TrackerImpl(const char* url, const int64_t start_pts, const box2& start_box, function<void()> keyframes_available, const TrackerSettings& settings)
+		:url(url), start_pts(start_pts), start_box(start_box), keyframes_available(move(keyframes_available)), settings(settings)
+	{
+	}
+
+	void fail(const char* message)
+	{
+		{
+			lock_guard lock(tracked_mutex);
+			error = message;
+		}
+		state = TrackerState::Failed;
+	}
+
+	void stop()
+	{
+		{
+			lock_guard lock(queue_mutex);
+			stopping = true;
+		}
+		queue_cv.notify_all();
+	}
+
+	// decodes the frames from start_pts on and turns the anchors into pyramids, the decoder spreads over its own threads
+	void decode()
+	{
+		TRACE_THREAD_NAME("tracker decode");
+		static Histogram& pyramid_time = metrics_histogram("tracker.pyramid");
+
+		try
+		{
+			const auto motion_vectors = settings.mode == TrackerMode::MotionVectors;
+			Decoder decoder(url.c_str(), settings.decoder_thread_count, true, motion_vectors);
+			const auto level_count = pyramid_level_count(decoder.frame_size(), settings.pyramid_levels);
+			decoder.seek_pts(start_pts);
+
+			// y4m sources have no motion vectors, every frame is anchored like in pixels mode
+			const auto anchor_every_frame = !motion_vectors || !decoder.codec_context();
+			int64_t frames{};
+
+			// every frame out of the decoder, the skipped ones included, and the last i or p frame among them, taken as the
+			// reference of the frames after it, the vectors don't say which frame they point to when there are several
+			int64_t decoded_frames{}, reference_frame = -1;
+
+			while (const auto frame = decoder.next_frame())
+			{
+				const auto decoded_index = decoded_frames++;
+				const auto reference_distance = reference_frame < 0 ? 1 : decoded_index - reference_frame;
+				if (frame->pict_type != AV_PICTURE_TYPE_B)
+					reference_frame = decoded_index;
+
+				if (frame->best_effort_timestamp < start_pts) continue;
+
+				CHECK_SUCCESS(has_planar_luma(static_cast<AVPixelFormat>(frame->format)), "The tracker only reads 8 bit planar luma.");
+
+				unique_ptr<TrackerFrame> tracker_frame;
+				{
+					unique_lock lock(queue_mutex);
+					queue_cv.wait(lock, [&] { return stopping || !free_frames.empty() || allocated_frames < tracker_queue_max_length; });
+					if (stopping) return;
+
+					if (!free_frames.empty())
+					{
+						tracker_frame = move(free_frames.back());
+						free_frames.pop_back();
+					}
+					else
+					{
+						tracker_frame = make_unique<TrackerFrame>();
+						++allocated_frames;
+					}
+				}
+
+				const auto index = frames++;
+				tracker_frame->pts = frame->best_effort_timestamp;
+				tracker_frame->size = { frame->width, frame->height };
+				tracker_frame->anchor = anchor_every_frame || index % std::max(settings.reanchor_interval, 1) == 0 || frame->pict_type == AV_PICTURE_TYPE_I;
+				if (tracker_frame->anchor)
+				{
+					TRACE_SCOPE("build_pyramid");
+					ScopedTimer timer(pyramid_time);
+					build_pyramid(frame, level_count, tracker_frame->levels);
+				}
+				if (motion_vectors)
+					extract_block_motions(frame, reference_distance, tracker_frame->block_motions);
+
+				{
+					lock_guard lock(queue_mutex);
+					decoded.push_back(move(tracker_frame));
+				}
+				queue_cv.notify_all();
+			}
+		}
+		catch (const exception& e)
+		{
+			fail(e.what());
+		}
+
+		{
+			lock_guard lock(queue_mutex);
+			decoded.push_back(nullptr);
+		}
+		queue_cv.notify_all();
+	}
+
+	// follows the box frame to frame in decoding order, the anchors are placed by their pixels relative to the anchor
+	// before and checked against the first frame, so drifting off the target ends the tracking instead of following the
+	// background
+	void track()
+	{
+		TRACE_THREAD_NAME("tracker");
+		static Histogram& track_time = metrics_histogram("tracker.track");
+
+		unique_ptr<TrackerFrame> anchor;
+		box2 box, anchor_box;									// in source pixels
+		vec2 velocity{};
+		vector<float> reference;
+		TrackingScratch scratch;
+
+		const auto recycle = [&](unique_ptr<TrackerFrame> tracker_frame)
+		{
+			{
+				lock_guard lock(queue_mutex);
+				free_frames.push_back(move(tracker_frame));
+			}
+			queue_cv.notify_all();
+		};
+
+		while (true)
+		{
+			unique_ptr<TrackerFrame> current;
+			{
+				unique_lock lock(queue_mutex);
+				queue_cv.wait(lock, [&] { return stopping || !decoded.empty(); });
+				if (stopping) return;
+
+				current = move(decoded.front());
+				decoded.pop_front();
+			}
+			if (!current) break;
+
+			const vec2 frame_size = current->size;
+			if (!anchor)
+			{
+				box = { glm::min(start_box.v0, start_box.v1) * frame_size, glm::max(start_box.v0, start_box.v1) * frame_size };
+				sample_grid(current->levels[0], box.v0, grid_step(box.size()), reference);
+			}
+			else
+			{
+				TRACE_SCOPE("track_frame");
+				ScopedTimer timer(track_time);
+
+				// the box follows its blocks, or keeps moving the way it did over the last frame
+				auto motion = velocity;
+				if (const auto block_motion = box_motion(current->block_motions, box, scratch.motions_x, scratch.motions_y))
+					motion = *block_motion;
+				box2 moved{ box.v0 + motion, box.v1 + motion };
+
+				if (current->anchor)
+				{
+					const auto anchor_motion = track_motion(*anchor, *current, anchor_box, moved.v0 - anchor_box.v0, settings, scratch);
+					moved = { anchor_box.v0 + anchor_motion, anchor_box.v1 + anchor_motion };
+
+					sample_grid(current->levels[0], moved.v0, grid_step(moved.size()), scratch.values);
+					if (correlation(reference, scratch.values) < settings.min_correlation)
+					{
+						state = TrackerState::Lost;
+						break;
+					}
+				}
+
+				const auto center = (moved.v0 + moved.v1) * .5f;
+				if (any(lessThan(center, vec2(0))) || any(greaterThan(center, frame_size)))
+				{
+					state = TrackerState::Lost;
+					break;
+				}
+
+				velocity = moved.v0 - box.v0;
+				box = moved;
+			}
+
+			{
+				lock_guard lock(tracked_mutex);
+				tracked.emplace_back(current->pts, box2{ box.v0 / frame_size, box.v1 / frame_size });
+			}
+			if (keyframes_available) keyframes_available();
+
+			// the frames go back to the decoding thread once nothing is measured against them anymore
+			if (current->anchor)
+			{
+				if (anchor) recycle(move(anchor));
+				anchor = move(current);
+				anchor_box = box;
+			}
+			else
+				recycle(move(current));
+		}
+
+		auto running = TrackerState::Running;
+		state.compare_exchange_strong(running, TrackerState::Finished);
+		if (keyframes_available) keyframes_available();
+
+		// the decoding thread has nothing left to do either
+		stop();
+	}
+};
+
+// follows a box through the source on background threads, from the frame it was drawn on until the target is lost or
+// the source ends, one box per frame, it runs as far ahead of playback as the decoding allows
+export class Tracker
+{
+	unique_ptr<TrackerImpl> impl;
+
+public:
+	// box is normalized to the frame, keyframes_available is called from the tracking thread whenever it tracks a frame
+	// and once when it stops
+	Tracker(const char* url, const int64_t start_pts, const box2& box, function<void()> keyframes_available = {}, TrackerSettings settings = {})
+		:impl(make_unique<TrackerImpl>(url, start_pts, box, move(keyframes_available), settings))
+	{
+		impl->decoding_thread = thread([impl = impl.get()] { impl->decode(); });
+		impl->tracking_thread = thread([impl = impl.get()] { impl->track(); });
+	}
+
+	Tracker(const Tracker&) = delete;
+	Tracker& operator=(const Tracker&) = delete;
+
+	~Tracker() { stop(); }
+
+	// stops the threads and waits for them, the boxes tracked until then stay for take_tracked
+	void stop()
+	{
+		impl->stop();
+		if (impl->decoding_thread.joinable()) impl->decoding_thread.join();
+		if (impl->tracking_thread.joinable()) impl->tracking_thread.join();
+	}
+
+	TrackerState state() const { return impl->state; }
+
+	// why the tracking failed, once it has
+	string error() const
+	{
+		lock_guard lock(impl->tracked_mutex);
+		return impl->error;
+	}
+
+	// the boxes tracked since the last call, by increasing pts
+	vector<pair<int64_t, box2>> take_tracked()
+	{
+		vector<pair<int64_t, box2>> tracked;
+		lock_guard lock(impl->tracked_mutex);
+		swap(tracked, impl->tracked);
+		return tracked;
+	}
+};
@@ -2,6 +2,9 @@ module;
 #include <glm/glm.hpp>
 #include <memory>
 #include <string>
+#include <string_view>
+#include <type_traits>
+#include <cstdio>
 
 export module utilities;
 
@@ -38,24 +41,55 @@ export u8string u8_to_string(int val)
 	return s;
 }
 
+// appends in place, so a string reused across frames stops allocating once it has grown to fit
+export void u8_append_seconds_to_time_string(u8string& s, const double total_sec, const bool show_decimals = false)
+{
+	const auto mins = static_cast<int>(total_sec / 60);
+	const auto secs = static_cast<int>(total_sec - 60 * mins);
+
+	char buffer[32];
+	auto length = snprintf(buffer, sizeof(buffer), "%d:%02d", mins, secs);
+	if (show_decimals)
+		length += snprintf(buffer + length, sizeof(buffer) - length, ".%04d", static_cast<int>((total_sec - floor(total_sec)) * 1000));
+
+	s.append(reinterpret_cast<const char8_t*>(buffer), length);
+}
+
 export u8string u8_seconds_to_time_string(const double total_sec, const bool show_decimals = false)
 {
-	auto mins = static_cast<int>(total_sec / 60);
-	auto secs = static_cast<int>(total_sec - 60 * mins);
-	auto secs_string = secs < 10 ? u8"0" + u8_to_string(secs) : u8_to_string(secs);
+	u8string res;
+	u8_append_seconds_to_time_string(res, total_sec, show_decimals);
+	return res;
+}
+
+// the inside of a json string, control characters become spaces
+export string json_escape(const string_view s)
+{
+	string escaped;
+	for (const auto c : s)
+		if (c == '"' || c == '\\') { escaped += '\\'; escaped += c; }
+		else if (static_cast<unsigned char>(c) < 0x20) escaped += ' ';
+		else escaped += c;
+	return escaped;
+}
 
-	u8string res = u8_to_string(mins) + u8":" + secs_string;
+// incremental 64-bit FNV-1a, for content keys that have to be stable across runs (unlike std::hash)
+export struct Hasher
+{
+	uint64_t value = 14695981039346656037ull;
 
-	if (show_decimals)
+	Hasher& add(const void* data, const size_t length)
 	{
-		auto decs = static_cast<int>((total_sec - floor(total_sec)) * 1000);
-		auto decs_string = decs < 10 ? u8"000" + u8_to_string(decs) : decs < 100 ? u8"00" + u8_to_string(decs) : decs < 1000 ? u8"0" + u8_to_string(decs) : u8_to_string(decs);
-		res += u8".";
-		res += decs_string;
+		for (auto byte = static_cast<const uint8_t*>(data); byte < static_cast<const uint8_t*>(data) + length; ++byte)
+			value = (value ^ *byte) * 1099511628211ull;
+		return *this;
 	}
 
-	return res;
-}
+	template<typename T> requires is_trivially_copyable_v<T>
+	Hasher& add(const T& data) { return add(&data, sizeof(T)); }
+
+	Hasher& add(const string& s) { add(s.size()); return add(s.data(), s.size()); }
+};
 
 namespace glm
 {
@@ -6,10 +6,33 @@ import vertex_array;
 import gui;
 import utilities;
 import keyframes;
+import easing;
 import video;
+import exporter;
+import composition;
+import decoder;
+import smart_cut;
+import segment_cache;
+import metrics;
+import trace;
+import input_session;
+import analyzer;
+import project;
+import keyframe_filters;
+import tracker;
+import stabilizer;
 
 #include "framework.h"
+#include "libav.h"
 #include "sdf_font.h"
+#include "trace.h"
+#include "allocation_tracking.h"
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <limits>
+#include <thread>
+#include <random>
 
 using namespace std;
 using namespace glm;
@@ -20,25 +43,150 @@ GLFWwindow* window;
 int window_width, window_height;
 GLFWframebuffersizefun previous_framebuffer_size_callback;
 GLFWkeyfun previous_key_callback;
+GLFWcursorposfun previous_cursor_pos_callback;
+GLFWmousebuttonfun previous_mouse_button_callback;
 
-unique_ptr<Video> video;
-int64_t last_frame_pts{};
-constexpr double frame_time_sec_paused{ 1.0 / 30.0 };
-double frame_time_sec, next_frame_time_sec = 0, next_frame_time_sec_remaining_paused{};
+// set by anything that changes what's on screen outside of playback, the main loop sleeps while it's clear and nothing plays
+bool needs_redraw = true;
 
-KeyFrames keyframes;
+// the export renditions, as output heights, the widths follow the crop aspect ratio
+constexpr int export_rendition_heights[] = { 1080, 720, 480 };
+
+// rendered export segments are kept across runs, so re-exporting after a small edit only renders what changed
+constexpr uintmax_t segment_cache_size_cap_bytes = 20ull << 30;
 
 // gui layout constants
 constexpr float gui_left_button_width = 30.f, gui_slider_height = 15.f, gui_slider_margins_x = 5.f, gui_time_position_width = 100.f;
 constexpr float gui_play_bar_height = gui_left_button_width;
 constexpr float gui_composition_height = 30.f;
 constexpr float gui_font_scale = 0.2f;
+constexpr float gui_metrics_line_height = 16.f;
+
+// how far, in source pixels, R lets the simplified crop track stray from the one it replaces
+constexpr float simplify_tolerance_pixels = 1;
+
+unique_ptr<Video> video;
+int64_t last_frame_pts{};
+constexpr double frame_time_sec_paused{ 1.0 / 30.0 };
+double frame_time_sec, next_frame_time_sec = 0, next_frame_time_sec_remaining_paused{};
+
+// the crop tracks and the cuts, saved next to the source
+Project project;
+filesystem::path project_path;
+size_t active_crop_track{};
+KeyFrames& active_keyframes() { return project.crop_tracks[active_crop_track].keyframes; }
+
+// the player autosaves every edit, the headless modes only read the project
+unique_ptr<ProjectJournal> project_journal;
+
+void add_keyframe(const size_t track, const int64_t pts, const box2& box)
+{
+	project.crop_tracks[track].keyframes.add(pts, box);
+	if (project_journal) project_journal->add_keyframe(static_cast<uint32_t>(track), pts, box);
+}
+
+void add_active_keyframe(const int64_t pts, const box2& box) { add_keyframe(active_crop_track, pts, box); }
+
+void set_active_easing(const int64_t pts, const Easing& easing)
+{
+	active_keyframes().set_easing(pts, easing);
+	if (project_journal) project_journal->set_easing(static_cast<uint32_t>(active_crop_track), pts, easing);
+}
+
+// replaces the active track with the fewest key frames that stay within a pixel of it, the kept key frames are a subset of
+// the old ones so the journal only needs their removals and the easings that changed, back to linear included
+void simplify_active_keyframes()
+{
+	auto simplified = simplify_keyframes(active_keyframes(), video->frame_size(), { simplify_tolerance_pixels });
+	if (project_journal)
+	{
+		const auto track = static_cast<uint32_t>(active_crop_track);
+		for (const auto& [pts, keyframe] : active_keyframes())
+			if (!simplified.contains(pts))
+				project_journal->remove_keyframe(track, pts);
+		for (const auto& [pts, keyframe] : simplified)
+			if (active_keyframes().segment_at(pts)->second.easing.spec() != keyframe.easing.spec())
+				project_journal->set_easing(track, pts, keyframe.easing.spec());
+	}
+	active_keyframes() = move(simplified);
+}
+
+// replaces the active track's boxes with a steadier path through them, at the same pts
+void smooth_active_keyframes()
+{
+	auto smoothed = smooth_keyframes(active_keyframes(), video->time_base());
+	if (project_journal)
+		for (const auto& [pts, keyframe] : smoothed)
+			project_journal->add_keyframe(static_cast<uint32_t>(active_crop_track), pts, keyframe.box);
+	active_keyframes() = move(smoothed);
+}
+
+// playback only moves forward between seeks, so the boxes of consecutive frames are found from where the last one was
+KeyFrameCursor active_keyframe_cursor;
+
+// F3 toggles the live metrics over the video, F4 dumps them to this file
+bool show_metrics_overlay = false;
+constexpr const char* metrics_json_path = "ve2_metrics.json";
+
+// F5 starts and stops a timeline recording written to this file, --trace <file> records the whole session instead
+constexpr const char* trace_json_path = "ve2_trace.json";
+const char* session_trace_path{};
+
+// --record-input <file> saves the session's input, --replay-input <file> [report] feeds it back in a hidden window and
+// writes the metrics of the run to the report once the recording is done (and a little after, for the last frames)
+const char* input_recording_path{};
+const char* input_replay_path{};
+const char* input_replay_report_path = "ve2_replay.json";
+constexpr double input_replay_tail_sec = 1.;
+unique_ptr<InputReplay> input_replay;
+double input_replay_start_time_sec;
+optional<double> input_replay_finished_time_sec;				// in replay time, like the events
 
 // gui boxes
 box2 active_selection_box{ {0, 0}, {1, 1} };
 bool active_selection_box_is_keyframe = false;
 double gui_composition_zoom = 1.;
 
+// the source, the tracker decodes it on its own
+const char* source_path;
+
+// follows the selection box from the frame it was started on, into the track that was active then
+unique_ptr<Tracker> tracker;
+size_t tracker_crop_track{};
+
+// moves what the tracker found so far into its track, and drops the tracker once it stopped and everything was moved
+void poll_tracker()
+{
+	if (!tracker) return;
+
+	const auto state = tracker->state();
+	const auto tracked = tracker->take_tracked();
+	for (const auto& [pts, box] : tracked)
+		add_keyframe(tracker_crop_track, pts, box);
+	if (!tracked.empty() && tracker_crop_track == active_crop_track)
+	{
+		active_selection_box = active_keyframes().at(last_frame_pts);
+		active_selection_box_is_keyframe = active_keyframes().contains(last_frame_pts);
+		needs_redraw = true;
+	}
+
+	if (state != TrackerState::Running)
+	{
+		if (state == TrackerState::Lost) cout << "tracking lost the target\n";
+		else if (state == TrackerState::Failed) cout << "tracking failed: " << tracker->error() << "\n";
+		tracker.reset();
+	}
+}
+
+// stops the tracker and moves every box it found until then into its track before dropping it
+void stop_tracker()
+{
+	if (!tracker) return;
+	tracker->stop();
+	poll_tracker();
+	tracker.reset();
+}
+
 #pragma pack(push, 1)
 struct Vertex
 {
@@ -102,11 +250,14 @@ void framebuffer_size_callback(GLFWwindow* window, int width, int height)
 {
 	glViewport(0, 0, window_width = width, window_height = height);
 	update_screen_layout();
+	needs_redraw = true;
 	if (previous_framebuffer_size_callback) previous_framebuffer_size_callback(window, width, height);
 }
 
 void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods)
 {
+	needs_redraw = true;
+
 	// HOME seeks at the beginning
 	if (key == GLFW_KEY_HOME && action == GLFW_PRESS)
 		video->seek_pts(video->start_pts());
@@ -118,6 +269,95 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
 	// SPACE toggles pause
 	else if (key == GLFW_KEY_SPACE && action == GLFW_PRESS)
 		toggle_play(glfwGetTime());
+
+	// TAB cycles through the crop tracks
+	else if (key == GLFW_KEY_TAB && action == GLFW_PRESS)
+	{
+		active_crop_track = (active_crop_track + 1) % project.crop_tracks.size();
+		active_selection_box = active_keyframes().at(last_frame_pts);
+		active_selection_box_is_keyframe = active_keyframes().contains(last_frame_pts);
+	}
+
+	// E cycles the easing into the next key frame through the presets, from the key frame at or before the current frame
+	else if (key == GLFW_KEY_E && action == GLFW_PRESS)
+	{
+		if (const auto segment = active_keyframes().segment_at(last_frame_pts))
+		{
+			const auto type = static_cast<EasingType>((static_cast<int>(segment->second.easing.spec().type) + 1) % static_cast<int>(EasingType::Custom));
+			set_active_easing(segment->first, easing_preset(type));
+			active_selection_box = active_keyframes().at(last_frame_pts);
+		}
+	}
+
+	// R simplifies the active track, for the key frame per frame that tracking leaves behind
+	else if (key == GLFW_KEY_R && action == GLFW_PRESS)
+	{
+		simplify_active_keyframes();
+		active_selection_box = active_keyframes().at(last_frame_pts);
+		active_selection_box_is_keyframe = active_keyframes().contains(last_frame_pts);
+	}
+
+	// P smooths the camera path of the active track, best before R so the simplification fits the steady path
+	else if (key == GLFW_KEY_P && action == GLFW_PRESS)
+	{
+		smooth_active_keyframes();
+		active_selection_box = active_keyframes().at(last_frame_pts);
+	}
+
+	// T starts tracking the selection box from the current frame on, or stops the tracking running, SHIFT+T follows the
+	// decoder's motion vectors instead, much cheaper on large sources
+	else if (key == GLFW_KEY_T && action == GLFW_PRESS)
+	{
+		if (tracker)
+			stop_tracker();
+		else
+		{
+			TrackerSettings settings;
+			settings.mode = mods & GLFW_MOD_SHIFT ? TrackerMode::MotionVectors : TrackerMode::Pixels;
+			tracker_crop_track = active_crop_track;
+			tracker = make_unique<Tracker>(source_path, last_frame_pts, active_selection_box, [] { glfwPostEmptyEvent(); }, settings);
+		}
+	}
+
+	// F3 toggles the metrics overlay
+	else if (key == GLFW_KEY_F3 && action == GLFW_PRESS)
+		show_metrics_overlay = !show_metrics_overlay;
+
+	// F4 writes a snapshot of the metrics
+	else if (key == GLFW_KEY_F4 && action == GLFW_PRESS)
+	{
+		ofstream(metrics_json_path) << metrics_json();
+		cout << "metrics written to " << metrics_json_path << "\n";
+	}
+
+	// F5 toggles the timeline recording
+	else if (key == GLFW_KEY_F5 && action == GLFW_PRESS)
+	{
+		if (!trace_recording())
+			trace_start();
+		else
+		{
+			trace_stop(trace_json_path);
+			cout << "trace written to " << trace_json_path << "\n";
+		}
+	}
+
+	// CTRL+S folds the autosave journal into a fresh snapshot of the project, in the background
+	else if (key == GLFW_KEY_S && action == GLFW_PRESS && (mods & GLFW_MOD_CONTROL) && project_journal)
+		project_journal->request_compaction();
+}
+
+// the gui reacts to the mouse on its next render
+void cursor_pos_callback(GLFWwindow* window, double x, double y)
+{
+	needs_redraw = true;
+	if (previous_cursor_pos_callback) previous_cursor_pos_callback(window, x, y);
+}
+
+void mouse_button_callback(GLFWwindow* window, int button, int action, int mods)
+{
+	needs_redraw = true;
+	if (previous_mouse_button_callback) previous_mouse_button_callback(window, button, action, mods);
 }
 
 void debug_message_callback(GLenum source, GLenum type, GLuint id, GLenum severity, GLsizei length, const GLchar* message, const void* userParam)
@@ -126,19 +366,22 @@ void debug_message_callback(GLenum source, GLenum type, GLuint id, GLenum severi
 		cerr << "GL ERROR " << message << " type " << type << " severity " << severity << " source " << source << "\n";
 }
 
+// glfw is already initialized, main does it before creating the video this sizes the textures from
 int gl_init()
 {
-	CHECK_SUCCESS(glfwInit(), "Could not initialize GLFW.");
-
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 6);
 	glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
 	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+	if (input_replay_path)
+		glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
 
 	window = glfwCreateWindow(800, 600, ApplicationName, nullptr, nullptr);
 	glfwGetFramebufferSize(window, &window_width, &window_height);
 	previous_framebuffer_size_callback = glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
 	previous_key_callback = glfwSetKeyCallback(window, key_callback);
+	previous_cursor_pos_callback = glfwSetCursorPosCallback(window, cursor_pos_callback);
+	previous_mouse_button_callback = glfwSetMouseButtonCallback(window, mouse_button_callback);
 	CHECK_SUCCESS(window, "Could not create window.");
 	glfwMakeContextCurrent(window);
 
@@ -263,7 +506,8 @@ box2 get_aspect_corrected_video_pixel_bounds_box()
 	return box2::from_corner_size(offset, aspect_corrected_pixel_box.size());
 }
 
-void gui_process(const double current_time_sec)
+// lays out this frame's gui, without drawing it yet
+void gui_build(const double current_time_sec)
 {
 	// render the position slider and its label
 	gui_slider(
@@ -271,8 +515,13 @@ void gui_process(const double current_time_sec)
 		static_cast<double>(video->duration_pts()), static_cast<double>(last_frame_pts),
 		[&](double new_percent) { video->seek_pts(static_cast<int64_t>(new_percent * video->duration_pts())); });
 
+	// the label strings are reused every frame, so once they've grown to fit they don't allocate anymore
+	static u8string slider_label;
 	const auto last_frame_sec = last_frame_pts * video->time_base();
-	const auto slider_label = u8_seconds_to_time_string(last_frame_sec) + u8" / " + u8_seconds_to_time_string(video->duration_sec());
+	slider_label.clear();
+	u8_append_seconds_to_time_string(slider_label, last_frame_sec);
+	slider_label += u8" / ";
+	u8_append_seconds_to_time_string(slider_label, video->duration_sec());
 	gui_label(box2::from_corner_size({ window_width - gui_time_position_width, 0 }, { gui_time_position_width, gui_play_bar_height }), slider_label, gui_font_scale);
 
 	// left buttons
@@ -283,17 +532,46 @@ void gui_process(const double current_time_sec)
 	static SelectionBoxState selection_box_state{};
 	gui_selection_box(active_selection_box, get_aspect_corrected_video_pixel_bounds_box(), video->playing(),
 		active_selection_box_is_keyframe ? vec4(1, 0, 1, 1) : vec4(1, 1, 1, 1),
-		keyframes.is_first(last_frame_sec) ? optional<float>() : keyframes.aspect_ratio(),
+		active_keyframes().is_first(last_frame_pts) ? optional<float>() : active_keyframes().aspect_ratio(),
 		[&]
 		{
-			keyframes.add(last_frame_sec, active_selection_box);
+			add_active_keyframe(last_frame_pts, active_selection_box);
 			active_selection_box_is_keyframe = true;
 		}, selection_box_state);
 
 	// render the composition UI
 
 
+	// the metrics overlay, one label per metric under the play bar
+	if (show_metrics_overlay)
+	{
+		static vector<string> metrics_lines;
+		metrics_summary_lines(metrics_lines);
+
+		float y = gui_play_bar_height;
+		for (const auto& line : metrics_lines)
+		{
+			gui_label(box2::from_corner_size({ 0, y }, { static_cast<float>(window_width), gui_metrics_line_height }),
+				u8string_view(reinterpret_cast<const char8_t*>(line.data()), line.size()), gui_font_scale);
+			y += gui_metrics_line_height;
+		}
+	}
+}
+
+void gui_process(const double current_time_sec)
+{
+	static Histogram& gui_build_time = metrics_histogram("render.gui_build");
+	static Histogram& gui_render_time = metrics_histogram("render.gui_render");
+
+	{
+		TRACE_SCOPE("gui_build");
+		ScopedTimer timer(gui_build_time);
+		gui_build(current_time_sec);
+	}
+
 	// render the gui to screen
+	TRACE_SCOPE("gui_render");
+	ScopedTimer timer(gui_render_time);
 	gui_render();
 }
 
@@ -304,24 +582,29 @@ bool gl_render()
 {
 	const auto current_time_sec = glfwGetTime();
 	if (current_time_sec < next_frame_time_sec) return false;
+	const auto frame_start_allocations = thread_allocation_count();
 
 	if (video->playing() || video->force_display())
 	{
-		const auto underflow = !video->consume_frame([&](int64_t pts, int64_t frame_duration_pts, array<span<uint8_t>, 3> planes)
+		had_underflow = !video->consume_frame([&](int64_t pts, int64_t frame_duration_pts, array<span<const uint8_t>, 3> planes)
 			{
 				const auto frame_size = video->frame_size();
 
 				// upload the data
-				glPixelStorei(GL_UNPACK_ROW_LENGTH, static_cast<GLint>(planes[0].size_bytes()));
-				glTextureSubImage2D(yuv_planar_texture_names[0], 0, 0, 0, frame_size.x, frame_size.y, GL_RED, GL_UNSIGNED_BYTE, planes[0].data());
-				glPixelStorei(GL_UNPACK_ROW_LENGTH, static_cast<GLint>(planes[1].size_bytes()));
-				glTextureSubImage2D(yuv_planar_texture_names[1], 0, 0, 0, frame_size.x / 2, frame_size.y / 2, GL_RED, GL_UNSIGNED_BYTE, planes[1].data());
-				glPixelStorei(GL_UNPACK_ROW_LENGTH, static_cast<GLint>(planes[2].size_bytes()));
-				glTextureSubImage2D(yuv_planar_texture_names[2], 0, 0, 0, frame_size.x / 2, frame_size.y / 2, GL_RED, GL_UNSIGNED_BYTE, planes[2].data());
-
-				const auto ts = pts * video->time_base();
-				active_selection_box = keyframes.at(ts);
-				active_selection_box_is_keyframe = keyframes.contains(ts);
+				static Histogram& texture_upload_time = metrics_histogram("render.texture_upload");
+				{
+					TRACE_SCOPE("texture_upload");
+					ScopedTimer timer(texture_upload_time);
+					glPixelStorei(GL_UNPACK_ROW_LENGTH, static_cast<GLint>(planes[0].size_bytes()));
+					glTextureSubImage2D(yuv_planar_texture_names[0], 0, 0, 0, frame_size.x, frame_size.y, GL_RED, GL_UNSIGNED_BYTE, planes[0].data());
+					glPixelStorei(GL_UNPACK_ROW_LENGTH, static_cast<GLint>(planes[1].size_bytes()));
+					glTextureSubImage2D(yuv_planar_texture_names[1], 0, 0, 0, frame_size.x / 2, frame_size.y / 2, GL_RED, GL_UNSIGNED_BYTE, planes[1].data());
+					glPixelStorei(GL_UNPACK_ROW_LENGTH, static_cast<GLint>(planes[2].size_bytes()));
+					glTextureSubImage2D(yuv_planar_texture_names[2], 0, 0, 0, frame_size.x / 2, frame_size.y / 2, GL_RED, GL_UNSIGNED_BYTE, planes[2].data());
+				}
+
+				active_selection_box = active_keyframes().at(pts, active_keyframe_cursor);
+				active_selection_box_is_keyframe = active_keyframes().contains(pts);
 
 				// frame is processed
 				last_frame_pts = pts;
@@ -329,9 +612,16 @@ bool gl_render()
 				video->clear_force_display();
 			});
 
-		if (underflow)
+		if (had_underflow)
+		{
+			static Counter& underflows = metrics_counter("video.underflows");
+			underflows.add();
 			return false;
+		}
 	}
+	else if (!needs_redraw)
+		return false;
+	needs_redraw = false;
 
 	glClear(GL_COLOR_BUFFER_BIT);
 
@@ -355,27 +645,344 @@ bool gl_render()
 	// process and draw the gui
 	gui_process(current_time_sec);
 
+	// a steady state frame shouldn't touch the heap at all, anything above 0 here is a regression
+	if constexpr (allocation_tracking_enabled)
+	{
+		static Gauge& frame_allocations = metrics_gauge("render.frame_allocations");
+		static Counter& allocations = metrics_counter("render.allocations");
+		const auto count = thread_allocation_count() - frame_start_allocations;
+		frame_allocations.set(static_cast<double>(count));
+		allocations.add(count);
+	}
+
 	return true;
 }
 
+// every crop track at every rendition height
+vector<ExportOutput> configured_export_outputs(const string& output_prefix, const ivec2 frame_size)
+{
+	vector<ExportOutput> outputs;
+	for (const auto& crop_track : project.crop_tracks)
+	{
+		const auto box_size = crop_track.keyframes.first().size() * vec2(frame_size);
+		const auto aspect_ratio = box_size.x / box_size.y;
+
+		auto& output = outputs.emplace_back(ExportOutput{ &crop_track });
+		for (const auto height : export_rendition_heights)
+			output.renditions.push_back({ output_prefix + "_" + crop_track.name + "_" + to_string(height) + "p.mp4",
+				{ static_cast<int>(height * aspect_ratio / 2) * 2, height } });
+	}
+	return outputs;
+}
+
+// decodes the source once and exports every crop track at every rendition height
+int export_crop_tracks(const char* url, const string& output_prefix, const ExportBackend backend)
+{
+	ExportSettings export_settings;
+	export_settings.backend = backend;
+	const auto outputs = configured_export_outputs(output_prefix, Decoder(url).frame_size());
+
+	const SegmentCache cache(filesystem::temp_directory_path() / "ve2_segment_cache", segment_cache_size_cap_bytes);
+
+	const auto start_time = chrono::steady_clock::now();
+	const auto stats = export_with_cache(url, outputs, cache, export_settings,
+		[](double progress) { cout << "\rexporting " << static_cast<int>(progress * 100) << "%" << flush; });
+	const auto elapsed_sec = chrono::duration<double>(chrono::steady_clock::now() - start_time).count();
+	cout << "\rexported " << stats.segments << " segments (" << stats.rendered << " rendered, " << stats.shared << " shared, "
+		<< stats.reused << " reused), " << stats.frames << " frames in " << elapsed_sec << "s (" << stats.frames / elapsed_sec << " fps)\n";
+
+	return 0;
+}
+
+// streams the first crop track as raw frames to stdout ("-") or a named pipe, everything else goes to stderr
+int export_pipe(const char* url, const RenditionFormat format, const string& output_path, const int height)
+{
+	// atoi gives 0 for anything that isn't a number, and the 4:2:0 frames need an even height
+	CHECK_SUCCESS(height > 0 && height % 2 == 0, "usage: ve2 <file> --pipe <y4m|nut> [output|-] [height, even and positive]");
+
+	Exporter exporter(url);
+	const auto box_size = project.crop_tracks[0].keyframes.first().size() * vec2(exporter.frame_size());
+	const auto aspect_ratio = box_size.x / box_size.y;
+
+	exporter.add_output({ &project.crop_tracks[0], { { output_path == "-" ? "pipe:1" : output_path,
+		{ static_cast<int>(height * aspect_ratio / 2) * 2, height }, format } } });
+
+	const auto start_time = chrono::steady_clock::now();
+	const auto frames = exporter.run();
+	const auto elapsed_sec = chrono::duration<double>(chrono::steady_clock::now() - start_time).count();
+	cerr << "streamed " << frames << " frames in " << elapsed_sec << "s (" << frames / elapsed_sec << " fps)\n";
+
+	return 0;
+}
+
+// copies the source without the erased ranges (given as from:to in seconds, or the project's cuts when there are none),
+// only re-encoding around the cuts
+int export_smart_cut(const char* url, const string& output_path, const span<const char* const> erased_ranges)
+{
+	const auto [duration_pts, time_base] = [&] { const Decoder decoder(url); return pair(decoder.duration_pts(), av_q2d(decoder.time_base())); }();
+	CHECK_SUCCESS(duration_pts != AV_NOPTS_VALUE, "Could not find the duration of the source.");
+
+	Composition composition(duration_pts);
+	for (const string erased_range : erased_ranges)
+	{
+		const auto separator = erased_range.find(':');
+		CHECK_SUCCESS(separator != string::npos, "Erased ranges must be given as from:to in seconds.");
+		composition.erase(static_cast<int64_t>(stod(erased_range.substr(0, separator)) / time_base),
+			static_cast<int64_t>(stod(erased_range.substr(separator + 1)) / time_base));
+	}
+
+	const auto& cut = erased_ranges.empty() && project.composition ? *project.composition : composition;
+
+	const auto start_time = chrono::steady_clock::now();
+	const auto stats = smart_cut_export(url, output_path, cut);
+	const auto elapsed_sec = chrono::duration<double>(chrono::steady_clock::now() - start_time).count();
+	cout << "copied " << stats.copied_gops << " groups of pictures, re-encoded " << stats.reencoded_gops << " (" << stats.reencoded_frames
+		<< " frames) in " << elapsed_sec << "s\n";
+
+	return 0;
+}
+
+// probes the sources and measures what playing and exporting them costs, as json for the batch scheduler
+int analyze(const span<const char* const> arguments)
+{
+	vector<const char*> urls;
+	int core_budget = static_cast<int>(std::max(thread::hardware_concurrency(), 1u));
+	const char* output_path{};
+	for (size_t index = 0; index < arguments.size(); ++index)
+		if (arguments[index] == string_view("--cores") && index + 1 < arguments.size())
+			core_budget = atoi(arguments[++index]);
+		else if (arguments[index] == string_view("--output") && index + 1 < arguments.size())
+			output_path = arguments[++index];
+		else
+			urls.push_back(arguments[index]);
+	CHECK_SUCCESS(!urls.empty() && core_budget > 0, "usage: ve2 --analyze <files...> [--cores <count>] [--output <file>]");
+
+	av_log_set_level(AV_LOG_ERROR);
+
+	// the trial exports go to a directory of the run's own, so concurrent runs don't write over each other's files
+	random_device random_bits;
+	filesystem::path temp_directory;
+	do
+	{
+		char name[32];
+		snprintf(name, sizeof(name), "ve2_analyze_%08x", random_bits());
+		temp_directory = filesystem::temp_directory_path() / name;
+	} while (!filesystem::create_directory(temp_directory));
+
+	vector<SourceAnalysis> analyses;
+	try
+	{
+		analyses = analyze_sources(urls, core_budget, [&](const size_t index, const ivec2 frame_size)
+			{
+				return configured_export_outputs((temp_directory / to_string(index)).string(), frame_size);
+			});
+	}
+	catch (...)
+	{
+		filesystem::remove_all(temp_directory);
+		throw;
+	}
+	filesystem::remove_all(temp_directory);
+
+	const auto json = analysis_json(analyses);
+	if (output_path)
+		ofstream(output_path) << json;
+	else
+		cout << json;
+
+	return 0;
+}
+
+// the key frames are in the source's pts, 0 and 10 seconds in
+void add_default_keyframes(const AVRational time_base)
+{
+	active_keyframes().add(0, { {.2f, .3f}, {.5f, .4f} });
+	active_keyframes().add(av_rescale_q(10, { 1, 1 }, time_base), { {.3f, .5f}, {.6f, .6f} });
+}
+
+// converts between the binary and the json project formats, the output's extension picks the format
+int convert_project(const char* input_path, const filesystem::path& output_path)
+{
+	const auto converted = load_project(input_path);
+	if (output_path.extension() == ".json")
+		ofstream(output_path, ios::binary) << project_json(converted);
+	else
+		save_project(converted, output_path);
+	return 0;
+}
+
+// adds a crop track cancelling the camera shake of the source to the project, or replaces the one an earlier run added,
+// and saves the project
+int stabilize_source(const char* url, const float zoom_margin)
+{
+	// a margin of the whole frame or more leaves no crop, and atof gives 0 for anything that isn't a number
+	CHECK_SUCCESS(zoom_margin > 0 && zoom_margin < 1, "usage: ve2 <file> --stabilize [zoom margin, between 0 and 1]");
+
+	StabilizerSettings settings;
+	settings.zoom_margin = zoom_margin;
+
+	const auto start_time = chrono::steady_clock::now();
+	auto keyframes = stabilize(url, settings);
+	const auto elapsed_sec = chrono::duration<double>(chrono::steady_clock::now() - start_time).count();
+
+	auto track = find_if(project.crop_tracks.begin(), project.crop_tracks.end(), [](const auto& candidate) { return candidate.name == "stabilized"; });
+	if (track == project.crop_tracks.end())
+		track = project.crop_tracks.insert(project.crop_tracks.end(), CropTrack{ "stabilized" });
+	const auto frames = distance(keyframes.begin(), keyframes.end());
+	track->keyframes = move(keyframes);
+	save_project(project, project_path);
+
+	cout << "stabilized " << frames << " frames in " << elapsed_sec << "s\n";
+	return 0;
+}
+
 int main(int argc, const char* argv[])
 {
-	keyframes.add(0, { {.2f, .3f}, {.5f, .4f} });
-	keyframes.add(10, { {.3f, .5f}, {.6f, .6f} });
+	// ve2 --analyze <files...> [--cores <count>] [--output <file>] runs headless, the files are analyzed in parallel within
+	// the core budget, which defaults to every core
+	if (argc > 2 && argv[1] == string_view("--analyze"))
+	{
+		// the sources don't share a time base, but only the first box matters to the analysis, it sizes the renditions
+		project.crop_tracks.push_back({ "main" });
+		add_default_keyframes({ 1, AV_TIME_BASE });
+		return analyze(span<const char* const>(argv + 2, argv + argc));
+	}
+
+	// ve2 --convert-project <input> <output[.json]>
+	if (argc > 3 && argv[1] == string_view("--convert-project"))
+		return convert_project(argv[2], argv[3]);
+
+	// the project next to the source, if it was ever saved
+	project_path = string(argv[1]) + ".ve2p";
+	if (filesystem::exists(project_path))
+		project = load_project(project_path);
+	if (project.crop_tracks.empty())
+	{
+		project.crop_tracks.push_back({ "main" });
+		add_default_keyframes(Decoder(argv[1]).time_base());
+	}
+
+	// ve2 <file> --stabilize [zoom margin] adds a stabilizing crop track to the project, the margin defaults to a tenth of
+	// the frame
+	if (argc > 2 && argv[2] == string_view("--stabilize"))
+		return stabilize_source(argv[1], argc > 3 ? static_cast<float>(atof(argv[3])) : StabilizerSettings().zoom_margin);
 
-	video = make_unique<Video>(argv[1]);
+	// ve2 <file> --export <output prefix> [cpu|gpu-yuv|gpu-rgb] runs headless
+	if (argc > 3 && argv[2] == string_view("--export"))
+		return export_crop_tracks(argv[1], argv[3],
+			argc > 4 && argv[4] == string_view("gpu-yuv") ? ExportBackend::GpuYuv
+			: argc > 4 && argv[4] == string_view("gpu-rgb") ? ExportBackend::GpuRgb
+			: ExportBackend::Cpu);
+
+	// ve2 <file> --pipe <y4m|nut> [output|-] [height] streams raw frames for external encoders
+	if (argc > 3 && argv[2] == string_view("--pipe"))
+	{
+		CHECK_SUCCESS(argv[3] == string_view("y4m") || argv[3] == string_view("nut"), "usage: ve2 <file> --pipe <y4m|nut> [output|-] [height]");
+		return export_pipe(argv[1], argv[3] == string_view("nut") ? RenditionFormat::NutRaw : RenditionFormat::Y4m,
+			argc > 4 ? argv[4] : "-", argc > 5 ? atoi(argv[5]) : export_rendition_heights[0]);
+	}
+
+	// ve2 <file> --smart-cut <output> [from:to...] removes the ranges without re-encoding the rest
+	if (argc > 3 && argv[2] == string_view("--smart-cut"))
+		return export_smart_cut(argv[1], argv[3], span<const char* const>(argv + 4, argv + argc));
+
+	// ve2 <file> --trace <trace file> records a timeline of the whole session
+	if (argc > 3 && argv[2] == string_view("--trace"))
+	{
+		session_trace_path = argv[3];
+		trace_start();
+	}
+
+	// ve2 <file> --record-input <recording> | --replay-input <recording> [report]
+	if (argc > 3 && argv[2] == string_view("--record-input"))
+		input_recording_path = argv[3];
+	if (argc > 3 && argv[2] == string_view("--replay-input"))
+	{
+		input_replay_path = argv[3];
+		if (argc > 4) input_replay_report_path = argv[4];
+	}
+	TRACE_THREAD_NAME("render");
+
+	// the decoder thread wakes the main loop up when it queues a frame, in case it's waiting on one, which needs glfw up
+	// before the thread starts
+	CHECK_SUCCESS(glfwInit(), "Could not initialize GLFW.");
+	source_path = argv[1];
+	video = make_unique<Video>(source_path, [] { glfwPostEmptyEvent(); });
+
+	// a replayed session edits the project just like the recorded one did, but those edits aren't worth keeping
+	if (!input_replay_path)
+		project_journal = make_unique<ProjectJournal>(project_path, project);
 
 	if (gl_init()) return -1;
 	next_frame_time_sec = glfwGetTime() + frame_time_sec;
 
+	// both hook the callbacks gl_init registered, so they have to come after it
+	if (input_recording_path)
+		input_recording_start(window, input_recording_path, [] { return pair(last_frame_pts, video->playing()); });
+	if (input_replay_path)
+	{
+		input_replay = make_unique<InputReplay>(window, input_replay_path);
+		input_replay_start_time_sec = glfwGetTime();
+	}
+
 	while (!glfwWindowShouldClose(window))
 	{
-		glfwPollEvents();
+		// sleep until the next frame is due, the decoder queues a missing frame, some input needs the screen redrawn, or
+		// the replay has its next event due
+		const auto current_time_sec = glfwGetTime();
+		auto wake_time_sec = had_underflow || (!video->playing() && !video->force_display() && !needs_redraw)
+			? numeric_limits<double>::infinity() : next_frame_time_sec;
+		if (input_replay)
+			wake_time_sec = std::min(wake_time_sec, input_replay_start_time_sec
+				+ (input_replay_finished_time_sec ? *input_replay_finished_time_sec + input_replay_tail_sec : input_replay->next_wake_time_sec()));
+
+		if (wake_time_sec == numeric_limits<double>::infinity())
+			glfwWaitEvents();
+		else if (current_time_sec < wake_time_sec)
+			glfwWaitEventsTimeout(wake_time_sec - current_time_sec);
+		else
+			glfwPollEvents();
+
+		if (input_replay)
+		{
+			const auto replay_time_sec = glfwGetTime() - input_replay_start_time_sec;
+			input_replay->dispatch(replay_time_sec, last_frame_pts, video->playing());
+
+			if (input_replay->finished() && !input_replay_finished_time_sec)
+				input_replay_finished_time_sec = replay_time_sec;
+			if (input_replay_finished_time_sec && replay_time_sec >= *input_replay_finished_time_sec + input_replay_tail_sec)
+			{
+				ofstream(input_replay_report_path) << metrics_json();
+				cout << "replay finished, metrics written to " << input_replay_report_path << "\n";
+				if constexpr (!allocation_tracking_enabled)
+					cout << "built without VE2_TRACK_ALLOCATIONS, the report has no allocation counts\n";
+				break;
+			}
+		}
+
+		poll_tracker();
 
+		// the time to produce a frame, from the decoded planes to the swap
+		static Histogram& frame_time = metrics_histogram("render.frame");
+		const auto frame_start_time = chrono::steady_clock::now();
 		if (gl_render())
 		{
-			had_underflow = false;
-			glfwSwapBuffers(window);
+			static Histogram& swap_time = metrics_histogram("render.swap");
+			{
+				TRACE_SCOPE("swap");
+				ScopedTimer timer(swap_time);
+				glfwSwapBuffers(window);
+			}
+			frame_time.record(chrono::duration<double>(chrono::steady_clock::now() - frame_start_time).count());
 		}
 	}
+
+	if (input_recording_path)
+		input_recording_stop();
+	if (session_trace_path)
+		trace_stop(session_trace_path);
+
+	// writes out the last edits, the tracker's included
+	stop_tracker();
+	project_journal.reset();
 }
@@ -1,7 +1,8 @@
 module;
-#include <gl/glew.h>
-#include <glfw/glfw3.h>
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
 #include <memory>
+#include <stdexcept>
 
 export module vertex_array;
 
@@ -83,8 +84,8 @@ struct VertexArray
 private:
 	void throw_on_invalid_permissions(bool needs_to_grow, bool needs_to_update)
 	{
-		if (needs_to_grow && !can_grow) throw exception("Tried to grow a non-growable buffer");
-		if (needs_to_update && !can_update) throw exception("Tried to update a non-updateable buffer");
+		if (needs_to_grow && !can_grow) throw runtime_error("Tried to grow a non-growable buffer");
+		if (needs_to_update && !can_update) throw runtime_error("Tried to update a non-updateable buffer");
 	}
 
 	VertexArray() = default;
@@ -1,6 +1,7 @@
 module;
 
 #include "libav.h"
+#include "trace.h"
 #include <glm/glm.hpp>
 #include <memory>
 #include <functional>
@@ -11,20 +12,32 @@ module;
 #include <mutex>
 #include <queue>
 #include <array>
+#include <chrono>
+#include <atomic>
+#include <stdexcept>
 
 export module video;
 
+import y4m_reader;
+import metrics;
+import trace;
+
 using namespace std;
 using namespace glm;
 
-#define CHECK_SUCCESS(cmd, errormsg) if(!(cmd)) { throw exception(errormsg); }
-char av_error_buffer[2048];
-#define CHECK_AV_SUCCESS(cmd) [[gsl::suppress(bounds.3)]] { const int __res = (cmd); if(__res < 0) { av_strerror(__res, av_error_buffer, sizeof(av_error_buffer)); throw exception(av_error_buffer); } }
+#define CHECK_SUCCESS(cmd, errormsg) if(!(cmd)) { throw runtime_error(errormsg); }
+#define CHECK_AV_SUCCESS(cmd) [[gsl::suppress(bounds.3)]] { const int __res = (cmd); if(__res < 0) { char av_error_buffer[AV_ERROR_MAX_STRING_SIZE]; av_strerror(__res, av_error_buffer, sizeof(av_error_buffer)); throw runtime_error(av_error_buffer); } }
 
-constexpr int frames_queue_max_length = 10;
+// frames the decoding thread runs ahead of playback, and the threads libav decodes on
+export constexpr int frames_queue_max_length = 10;
+export constexpr int decoder_thread_count = 4;
 
 struct VideoImpl
 {
+	// y4m input is read straight from a mapping of the file instead of going through the decoding thread and its queue
+	unique_ptr<Y4mReader> y4m;
+	int64_t y4m_next_frame{};
+
 	AVFormatContext* format_context{};
 	AVStream* video_stream{};
 	AVCodecContext* codec_decoder_context{};
@@ -36,40 +49,94 @@ struct VideoImpl
 	mutex frames_queue_mutex;
 	condition_variable frames_queue_cv;
 	bool playing = false, seek_needs_display = true;
+	atomic<bool> stopping = false;							// set on destruction, ends the decoding thread
+	thread decoder_thread;
+	function<void()> frame_available;						// called from the decoding thread every time it queues a frame
 
 	optional<double> seek_timestamp_sec{};					// if set, triggers the frame read thread to clear the frame cache, seek to this position and restart the decoding
+	optional<chrono::steady_clock::time_point> seek_request_time;	// when the seek waiting to be displayed was requested
 };
 
+// the decode time of a frame, split by picture type since key frames cost several times more than the rest
+Histogram& decode_time_histogram(const AVPictureType picture_type)
+{
+	static Histogram& i_frames = metrics_histogram("video.decode.I");
+	static Histogram& p_frames = metrics_histogram("video.decode.P");
+	static Histogram& b_frames = metrics_histogram("video.decode.B");
+	static Histogram& other_frames = metrics_histogram("video.decode.other");
+
+	switch (picture_type)
+	{
+	case AV_PICTURE_TYPE_I: return i_frames;
+	case AV_PICTURE_TYPE_P: return p_frames;
+	case AV_PICTURE_TYPE_B: return b_frames;
+	default: return other_frames;
+	}
+}
+
+// called with every frame handed out for display, closes the latency of a pending seek
+void record_seek_to_display(VideoImpl* video_impl)
+{
+	static Histogram& seek_to_display_time = metrics_histogram("video.seek_to_display");
+
+	if (video_impl->seek_request_time)
+	{
+		seek_to_display_time.record(chrono::duration<double>(chrono::steady_clock::now() - *video_impl->seek_request_time).count());
+		video_impl->seek_request_time.reset();
+	}
+}
+
+// hands out the next decoded frame, or returns AVERROR_EOF once the decoder gave out the last one
 int av_get_next_frame(const VideoImpl* video_impl, const int64_t skip_pts, function<void(AVFrame* frame)> process_frame)
 {
-	while (av_read_frame(video_impl->format_context, video_impl->input_packet) >= 0)
+	const auto decode_start_time = chrono::steady_clock::now();
+
+	while (true)
 	{
-		if (video_impl->input_packet->stream_index == video_impl->video_stream->index)
+		// a frame the decoder already has, from the last packet or held back for reordering
+		int res{};
 		{
-			// get the frame
-			CHECK_AV_SUCCESS(avcodec_send_packet(video_impl->codec_decoder_context, video_impl->input_packet));
+			TRACE_SCOPE("avcodec_receive_frame");
+			res = avcodec_receive_frame(video_impl->codec_decoder_context, video_impl->input_frame);
+		}
+		if (res == AVERROR_EOF) return AVERROR_EOF;
+		if (res != AVERROR(EAGAIN))
+		{
+			CHECK_AV_SUCCESS(res);
 
-			int res{};
-			while (1)
-			{
-				res = avcodec_receive_frame(video_impl->codec_decoder_context, video_impl->input_frame);
-				if (res == AVERROR(EAGAIN) || res == AVERROR_EOF) break;
-				CHECK_AV_SUCCESS(res);
+			decode_time_histogram(video_impl->input_frame->pict_type).record(
+				chrono::duration<double>(chrono::steady_clock::now() - decode_start_time).count());
 
-				// skip frames as needed for seeking
-				if (video_impl->input_frame->pts >= skip_pts)
-					process_frame(video_impl->input_frame);
+			// skip frames as needed for seeking
+			if (video_impl->input_frame->pts >= skip_pts)
+				process_frame(video_impl->input_frame);
 
-				av_frame_unref(video_impl->input_frame);
+			av_frame_unref(video_impl->input_frame);
+			return 0;
+		}
 
-				return 0;
-			}
+		// it needs more input
+		int read_result{};
+		{
+			TRACE_SCOPE("demux");
+			read_result = av_read_frame(video_impl->format_context, video_impl->input_packet);
+		}
+		if (read_result < 0)
+		{
+			// the end of the source, the empty packet drains the frames still held back for reordering and on the decoder's
+			// threads, after them the decoder returns AVERROR_EOF until it's flushed by a seek
+			TRACE_SCOPE("avcodec_send_packet");
+			CHECK_AV_SUCCESS(avcodec_send_packet(video_impl->codec_decoder_context, nullptr));
+			continue;
 		}
 
+		if (video_impl->input_packet->stream_index == video_impl->video_stream->index)
+		{
+			TRACE_SCOPE("avcodec_send_packet");
+			CHECK_AV_SUCCESS(avcodec_send_packet(video_impl->codec_decoder_context, video_impl->input_packet));
+		}
 		av_packet_unref(video_impl->input_packet);
 	}
-
-	return AVERROR_EOF;
 }
 
 AVFrame* av_deep_clone_frame(AVFrame* src)
@@ -94,8 +161,17 @@ export class Video
 	unique_ptr<VideoImpl> video_impl = make_unique<VideoImpl>();
 
 public:
-	Video(const char* url)
+	Video(const char* url, function<void()> frame_available = {})
 	{
+		video_impl->frame_available = move(frame_available);
+
+		if (Y4mReader::is_y4m(url))
+		{
+			video_impl->y4m = make_unique<Y4mReader>(url);
+			CHECK_SUCCESS(video_impl->y4m->format() == AV_PIX_FMT_YUV420P, "Only 8 bit 4:2:0 Y4M files can be played.");
+			return;
+		}
+
 		// read the file header
 		CHECK_AV_SUCCESS(avformat_open_input(&video_impl->format_context, url, nullptr, nullptr));
 
@@ -122,8 +198,8 @@ public:
 		video_impl->codec_decoder_context = avcodec_alloc_context3(codec_decoder);
 		CHECK_AV_SUCCESS(avcodec_parameters_to_context(video_impl->codec_decoder_context, video_impl->video_stream->codecpar));
 
-		// multi-threaded decoder, use 4 threads
-		video_impl->codec_decoder_context->thread_count = 4;
+		// multi-threaded decoder
+		video_impl->codec_decoder_context->thread_count = decoder_thread_count;
 		video_impl->codec_decoder_context->thread_type = FF_THREAD_FRAME;
 
 		// open the codec
@@ -132,21 +208,35 @@ public:
 		video_impl->input_frame = av_frame_alloc();
 		video_impl->input_packet = av_packet_alloc();
 
-		thread([&]
+		video_impl->decoder_thread = thread([&]
 			{
-				while (true)
+				// how long the decoder waits for room in the queue, ie how far ahead of playback it runs
+				static Histogram& queue_wait_time = metrics_histogram("video.queue_wait");
+				static Gauge& queue_length = metrics_gauge("video.queue_length");
+				TRACE_THREAD_NAME("decoder");
+
+				// the seek is set by the ui thread, only ever read or reset under the queue lock
+				const auto seek_requested = [&]
+				{
+					lock_guard<mutex> lg(video_impl->frames_queue_mutex);
+					return video_impl->seek_timestamp_sec.has_value();
+				};
+
+				while (!video_impl->stopping)
 				{
 					optional<double> _seek_timestamp_sec;
 					int64_t ts_pts = INT64_MIN;
 					{
 						lock_guard<mutex> lg(video_impl->frames_queue_mutex);
 						_seek_timestamp_sec = video_impl->seek_timestamp_sec;
+						video_impl->seek_timestamp_sec.reset();
 					}
-					video_impl->seek_timestamp_sec.reset();
 
 					// seek if needed
 					if (_seek_timestamp_sec)
 					{
+						TRACE_SCOPE("seek");
+
 						// convert seconds to pts
 						ts_pts = static_cast<int64_t>(*_seek_timestamp_sec / av_q2d(video_impl->video_stream->time_base));
 
@@ -159,25 +249,63 @@ public:
 
 					while (av_get_next_frame(video_impl.get(), ts_pts, [&](AVFrame* frame)
 						{
-							auto new_frame = av_deep_clone_frame(frame);
+							AVFrame* new_frame;
+							{
+								TRACE_SCOPE("deep_clone");
+								new_frame = av_deep_clone_frame(frame);
+							}
 
 							// queue the frame
+							TRACE_SCOPE("queue_push");
 							unique_lock<mutex> lock(video_impl->frames_queue_mutex);
-							video_impl->frames_queue_cv.wait(lock, [&] { return video_impl->seek_timestamp_sec || video_impl->frames_queue.size() < frames_queue_max_length; });
+							{
+								ScopedTimer timer(queue_wait_time);
+								video_impl->frames_queue_cv.wait(lock, [&] { return video_impl->stopping || video_impl->seek_timestamp_sec || video_impl->frames_queue.size() < frames_queue_max_length; });
+							}
 
-							// seek instead if required
-							if (video_impl->seek_timestamp_sec)
+							// seek or stop instead if required
+							if (video_impl->stopping || video_impl->seek_timestamp_sec)
 							{
 								av_frame_unref(new_frame);
 								return;
 							}
 
 							video_impl->frames_queue.push(new_frame);
-						}) != AVERROR_EOF && !video_impl->seek_timestamp_sec)
+							queue_length.set(static_cast<double>(video_impl->frames_queue.size()));
+							lock.unlock();
+
+							if (video_impl->frame_available)
+								video_impl->frame_available();
+						}) != AVERROR_EOF && !seek_requested() && !video_impl->stopping)
 					{
 					}
+
+					// at the end of the source, sleep until a seek or the destruction rather than spin on the finished decoder
+					unique_lock<mutex> lock(video_impl->frames_queue_mutex);
+					video_impl->frames_queue_cv.wait(lock, [&] { return video_impl->stopping || video_impl->seek_timestamp_sec; });
 				}
-			}).detach();
+			});
+	}
+
+	Video(const Video&) = delete;
+	Video& operator=(const Video&) = delete;
+
+	~Video()
+	{
+		if (video_impl->decoder_thread.joinable())
+		{
+			{
+				lock_guard<mutex> lock(video_impl->frames_queue_mutex);
+				video_impl->stopping = true;
+				clear_frames_queue();
+			}
+			video_impl->decoder_thread.join();
+		}
+
+		av_frame_free(&video_impl->input_frame);
+		av_packet_free(&video_impl->input_packet);
+		avcodec_free_context(&video_impl->codec_decoder_context);
+		avformat_close_input(&video_impl->format_context);
 	}
 
 	bool playing() const { return video_impl->playing; }
@@ -185,9 +313,19 @@ public:
 
 	void seek_pts(int64_t pts)
 	{
-		video_impl->seek_timestamp_sec = pts * av_q2d(video_impl->video_stream->time_base);
+		video_impl->seek_request_time = chrono::steady_clock::now();
+
+		// frames sit at fixed offsets in the mapping, so seeking is just moving the index
+		if (video_impl->y4m)
+		{
+			video_impl->y4m_next_frame = std::clamp<int64_t>(pts, 0, std::max<int64_t>(video_impl->y4m->frames() - 1, 0));
+			video_impl->seek_needs_display = true;
+			return;
+		}
+
 		{
 			lock_guard<mutex> lock(video_impl->frames_queue_mutex);
+			video_impl->seek_timestamp_sec = pts * av_q2d(video_impl->video_stream->time_base);
 			clear_frames_queue();
 		}
 		video_impl->seek_needs_display = true;
@@ -207,8 +345,35 @@ public:
 		video_impl->frames_queue_cv.notify_all();
 	}
 
-	bool consume_frame(function<void(int64_t, int64_t, array<span<uint8_t>, 3>)> process)
+	// process gets the pts, the duration and the planes of the frame, a template argument so the per frame call doesn't
+	// have to go through a std::function
+	template<typename TProcess>
+	bool consume_frame(TProcess&& process)
 	{
+		TRACE_SCOPE("consume_frame");
+
+		if (video_impl->y4m)
+		{
+			if (video_impl->y4m_next_frame >= video_impl->y4m->frames())
+				return false;					// end of the file
+
+			const uint8_t* data[4];
+			int linesize[4];
+			video_impl->y4m->planes(video_impl->y4m_next_frame, data, linesize);
+
+			array<span<const uint8_t>, 3> planes =
+			{ {
+				{ data[0], data[0] + linesize[0] },
+				{ data[1], data[1] + linesize[1] },
+				{ data[2], data[2] + linesize[2] }
+			} };
+			process(video_impl->y4m_next_frame++, 1, planes);
+
+			video_impl->seek_needs_display = false;
+			record_seek_to_display(video_impl.get());
+			return true;
+		}
+
 		AVFrame* frame;
 		{
 			lock_guard<mutex> lock(video_impl->frames_queue_mutex);
@@ -217,7 +382,7 @@ public:
 
 			frame = video_impl->frames_queue.front();
 
-			array<span<uint8_t>, 3> planes =
+			array<span<const uint8_t>, 3> planes =
 			{ {
 				{ frame->data[0], frame->data[0] + frame->linesize[0] },
 				{ frame->data[1], frame->data[1] + frame->linesize[1] },
@@ -226,8 +391,12 @@ public:
 			process(frame->best_effort_timestamp, frame->pkt_duration, planes);
 
 			video_impl->seek_needs_display = false;
+			record_seek_to_display(video_impl.get());
 			av_frame_free(&frame);
 			video_impl->frames_queue.pop();
+
+			static Gauge& queue_length = metrics_gauge("video.queue_length");
+			queue_length.set(static_cast<double>(video_impl->frames_queue.size()));
 		}
 
 		// notify the decoder thread that we consumed a frame
@@ -236,16 +405,19 @@ public:
 		return true;
 	}
 
-	ivec2 frame_size() const { return { video_impl->video_stream->codecpar->width, video_impl->video_stream->codecpar->height }; }
+	ivec2 frame_size() const
+	{
+		return video_impl->y4m ? video_impl->y4m->frame_size() : ivec2{ video_impl->video_stream->codecpar->width, video_impl->video_stream->codecpar->height };
+	}
 
-	double time_base() const { return av_q2d(video_impl->video_stream->time_base); }
-	int64_t start_pts() const { return video_impl->video_stream->start_time; }
-	int64_t duration_pts() const { return video_impl->video_stream->duration; }
+	double time_base() const { return av_q2d(video_impl->y4m ? video_impl->y4m->time_base() : video_impl->video_stream->time_base); }
+	int64_t start_pts() const { return video_impl->y4m ? 0 : video_impl->video_stream->start_time; }
+	int64_t duration_pts() const { return video_impl->y4m ? video_impl->y4m->frames() : video_impl->video_stream->duration; }
 	double duration_sec() const { return duration_pts() * time_base(); }
 
 	bool force_display() const { return video_impl->seek_needs_display; }
 	void set_force_display() { video_impl->seek_needs_display = true; }
 	void clear_force_display() { video_impl->seek_needs_display = false; }
 
-	bool colorspace_is_bt709() const { return video_impl->codec_decoder_context->colorspace == AVCOL_SPC_BT709; }
+	bool colorspace_is_bt709() const { return !video_impl->y4m && video_impl->codec_decoder_context->colorspace == AVCOL_SPC_BT709; }
 };
\ No newline at end of file
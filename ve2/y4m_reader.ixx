@@ -0,0 +1,163 @@
+module;
+
+#include "libav.h"
+#include <glm/glm.hpp>
+#include <span>
+#include <string_view>
+#include <cstring>
+#include <charconv>
+#include <fstream>
+#include <stdexcept>
+
+export module y4m_reader;
+
+import mapped_file;
+
+using namespace std;
+using namespace glm;
+
+#define CHECK_SUCCESS(cmd, errormsg) if(!(cmd)) { throw runtime_error(errormsg); }
+
+constexpr string_view y4m_signature = "YUV4MPEG2 ";
+constexpr string_view y4m_frame_signature = "FRAME";
+
+int parse_int(const string_view text)
+{
+	int value{};
+	from_chars(text.data(), text.data() + text.size(), value);
+	return value;
+}
+
+// the C tag of the stream header, 4:2:0 jpeg siting when it's missing
+AVPixelFormat y4m_pixel_format(const string_view colorspace)
+{
+	constexpr pair<string_view, AVPixelFormat> pixel_formats[] =
+	{
+		{ "420jpeg", AV_PIX_FMT_YUV420P }, { "420mpeg2", AV_PIX_FMT_YUV420P }, { "420paldv", AV_PIX_FMT_YUV420P }, { "420", AV_PIX_FMT_YUV420P },
+		{ "422", AV_PIX_FMT_YUV422P }, { "444", AV_PIX_FMT_YUV444P }, { "mono", AV_PIX_FMT_GRAY8 },
+		{ "420p10", AV_PIX_FMT_YUV420P10 }, { "422p10", AV_PIX_FMT_YUV422P10 }, { "444p10", AV_PIX_FMT_YUV444P10 }, { "mono16", AV_PIX_FMT_GRAY16 },
+	};
+
+	if (colorspace.empty()) return AV_PIX_FMT_YUV420P;
+	for (const auto& [name, pixel_format] : pixel_formats)
+		if (name == colorspace)
+			return pixel_format;
+	return AV_PIX_FMT_NONE;
+}
+
+// raw y4m input straight out of a memory mapping: there's no demuxing and no decoding, every frame sits at a fixed offset
+// so seeking is an index computation, and the planes handed out point into the mapping itself
+export class Y4mReader
+{
+	MappedFile file;
+	ivec2 size{};
+	AVRational rate{ 25, 1 };
+	AVPixelFormat pixel_format{ AV_PIX_FMT_YUV420P };
+
+	size_t first_frame_offset{}, frame_header_size{}, frame_stride{};
+	int64_t frame_count{};
+
+public:
+	// peeks at the signature, so the callers can fall back to libav for anything else
+	static bool is_y4m(const char* url)
+	{
+		char signature[y4m_signature.size()]{};
+		ifstream file(url, ios::binary);
+		return file.read(signature, sizeof(signature)) && string_view(signature, sizeof(signature)) == y4m_signature;
+	}
+
+	Y4mReader(const char* url) :file(url)
+	{
+		const auto data = file.data();
+		const string_view text(reinterpret_cast<const char*>(data.data()), data.size());
+		CHECK_SUCCESS(text.starts_with(y4m_signature), "Not a Y4M file.");
+
+		const auto header_end = text.find('\n');
+		CHECK_SUCCESS(header_end != string_view::npos, "Truncated Y4M header.");
+
+		// space separated tags, each a letter followed by its value
+		string_view colorspace;
+		for (auto tags = text.substr(y4m_signature.size(), header_end - y4m_signature.size()); !tags.empty();)
+		{
+			const auto tag_end = std::min(tags.find(' '), tags.size());
+			const auto tag = tags.substr(0, tag_end);
+			tags.remove_prefix(std::min(tag_end + 1, tags.size()));
+			if (tag.empty()) continue;
+
+			const auto value = tag.substr(1);
+			switch (tag[0])
+			{
+			case 'W': size.x = parse_int(value); break;
+			case 'H': size.y = parse_int(value); break;
+			case 'F':
+			{
+				const auto separator = value.find(':');
+				CHECK_SUCCESS(separator != string_view::npos, "Invalid Y4M frame rate.");
+				rate = { parse_int(value.substr(0, separator)), parse_int(value.substr(separator + 1)) };
+				CHECK_SUCCESS(rate.num > 0 && rate.den > 0, "Invalid Y4M frame rate.");
+				break;
+			}
+			case 'I': CHECK_SUCCESS(value == "p" || value == "?", "Interlaced Y4M files are not supported."); break;
+			case 'C': colorspace = value; break;
+			}
+		}
+		CHECK_SUCCESS(size.x > 0 && size.y > 0, "Invalid Y4M frame size.");
+
+		pixel_format = y4m_pixel_format(colorspace);
+		CHECK_SUCCESS(pixel_format != AV_PIX_FMT_NONE, "Unsupported Y4M colorspace.");
+
+		// frame headers may carry parameters, but the offsets are only fixed if they all look like the first one
+		first_frame_offset = header_end + 1;
+		const auto frame_header_end = text.find('\n', first_frame_offset);
+		if (frame_header_end == string_view::npos) return;
+		CHECK_SUCCESS(text.substr(first_frame_offset).starts_with(y4m_frame_signature), "Invalid Y4M frame header.");
+		frame_header_size = frame_header_end + 1 - first_frame_offset;
+
+		const auto frame_bytes = av_image_get_buffer_size(pixel_format, size.x, size.y, 1);
+		CHECK_SUCCESS(frame_bytes > 0, "Invalid Y4M frame layout.");
+		frame_stride = frame_header_size + frame_bytes;
+		frame_count = static_cast<int64_t>((data.size() - first_frame_offset) / frame_stride);
+	}
+
+	Y4mReader(const Y4mReader&) = delete;
+	Y4mReader& operator=(const Y4mReader&) = delete;
+
+	ivec2 frame_size() const { return size; }
+	AVPixelFormat format() const { return pixel_format; }
+	int64_t frames() const { return frame_count; }
+
+	// the frame index is the pts, in a time base of one frame
+	AVRational frame_rate() const { return rate; }
+	AVRational time_base() const { return { rate.den, rate.num }; }
+
+	// the plane pointers and line sizes of a frame, inside the mapping
+	void planes(const int64_t index, const uint8_t* data[4], int linesize[4]) const
+	{
+		CHECK_SUCCESS(index >= 0 && index < frame_count, "Y4M frame index out of range.");
+
+		const auto frame = file.data().data() + first_frame_offset + index * frame_stride;
+		CHECK_SUCCESS(!memcmp(frame, y4m_frame_signature.data(), y4m_frame_signature.size()) && frame[frame_header_size - 1] == '\n',
+			"Y4M frames with varying headers are not supported.");
+
+		uint8_t* plane_data[4]{};
+		av_image_fill_arrays(plane_data, linesize, frame + frame_header_size, pixel_format, size.x, size.y, 1);
+		for (int plane = 0; plane < 4; ++plane)
+			data[plane] = plane_data[plane];
+	}
+
+	// points an unreferenced frame at the planes in the mapping, valid as long as the reader lives
+	void fill_frame(const int64_t index, AVFrame* frame) const
+	{
+		const uint8_t* data[4];
+		av_frame_unref(frame);
+		planes(index, data, frame->linesize);
+		for (int plane = 0; plane < 4; ++plane)
+			frame->data[plane] = const_cast<uint8_t*>(data[plane]);
+		frame->format = pixel_format;
+		frame->width = size.x;
+		frame->height = size.y;
+		frame->pts = frame->best_effort_timestamp = index;
+		frame->pkt_duration = 1;
+		frame->key_frame = 1;
+	}
+};